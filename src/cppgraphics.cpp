@@ -12,20 +12,45 @@
 
 #include "cppgraphics.hpp"
 
+#include <algorithm>
 #include <array>
 #include <cassert>
 #include <string>
 #include <chrono>
 #include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <limits>
+#include <map>
 #include <memory>
 #include <random>
 #include <unordered_map>
+#include <unordered_set>
 #include <thread>
 
 #include "SDL2/SDL.h"
 
+// Vertex generation uses SSE2/AVX2 or NEON kernels when available, the
+// instruction set is chosen at runtime. Define CPPGRAPHICS_NO_SIMD to use
+// the plain C++ versions only.
+#ifndef CPPGRAPHICS_NO_SIMD
+    #if defined(__x86_64__) || defined(_M_X64) || (defined(__i386__) && defined(__SSE2__)) \
+     || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+        #define CPPGRAPHICS_SIMD_X86
+        #include <immintrin.h>
+        #ifdef _MSC_VER
+            #include <intrin.h>
+        #endif
+    #elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+        #define CPPGRAPHICS_SIMD_NEON
+        #include <arm_neon.h>
+    #endif
+#endif
+
 
 #ifdef CPPGRAPHICS_SUPPORT_IMGUI
     #include "imgui.h"
@@ -13132,6 +13157,9 @@ namespace cg {
         #define CPPGRAPHICS_GLSL_VERSION 130
     #endif
 #endif
+#ifndef GL_ALIASED_POINT_SIZE_RANGE
+    #define GL_ALIASED_POINT_SIZE_RANGE 0x846D // OpenGL ES only, not in the loader above
+#endif
 
 ///////////////////////////////////////////////////////////////////////////////
 //                                                                           //
@@ -13156,6 +13184,56 @@ struct Rect {
     T height;
 };
 
+using Point = std::array<double, 2>;
+
+// Commands of paths (see begin_path), each followed by its coordinates.
+enum class PathCommand {
+    Move,  // x, y
+    Line,  // x, y
+    Quad,  // control point, end point
+    Cubic, // two control points, end point
+    Close
+};
+
+// Vertices of user batches which only use palette colors (see BatchToDraw::draw)
+// are stored on the GPU in this compact format, index being the palette index.
+struct PaletteVertex {
+    float x;
+    float y;
+    GLushort index;
+    GLushort padding;
+};
+
+// Quantized vertices of user batches (see set_batch_quantization). Positions
+// are 16-bit fixed point relative to bounding box of the batch, colors are
+// normalized bytes or a palette index.
+struct QuantizedVertex {
+    GLushort x;
+    GLushort y;
+    GLubyte color[4];
+};
+struct QuantizedPaletteVertex {
+    GLushort x;
+    GLushort y;
+    GLushort index;
+    GLushort padding;
+};
+
+// Layouts of vertex data in VBOs.
+enum class VertexFormat {
+    Full,             // cg::Vertex
+    Palette,          // PaletteVertex
+    Quantized,        // QuantizedVertex
+    QuantizedPalette  // QuantizedPaletteVertex
+};
+
+// Column-major 4x4 matrices as used by OpenGL (u_transform uniform).
+static const std::array<float, 16>& identity_matrix()
+{
+    static const std::array<float, 16> ident = {{1,0,0,0, 0,1,0,0, 0,0,1,0, 0,0,0,1}};
+    return ident;
+}
+
 
 
 // Following class takes care of textures on the GPU.
@@ -13177,10 +13255,12 @@ public:
     void garbage_collect(int clears_not_used = -1);
     void clear_notify();
 
-    // Some textures are generated from pixel data or contain text rasterized
-    // by stb_truetype. Their key in the map is prefixed by the following.
+    // Whether all pixels of the texture are opaque (see BatchToDraw::optimize).
+    bool is_opaque(GLuint idx) const { return m_opaque.count(idx) != 0; }
+
+    // Some textures are generated from pixel data. Their key in the map
+    // is prefixed by the following.
     static constexpr const char* ImagePrefix = "/:";
-    static constexpr const char* TextPrefix  = ":/";
 
 
 private:
@@ -13191,6 +13271,51 @@ private:
         int clears_without_use;
     };
     std::unordered_map<std::string, TextureData> m_data;
+    std::unordered_set<GLuint> m_opaque;
+
+    static bool all_opaque(const unsigned char* rgba, int width, int height);
+};
+
+
+
+// Metrics of a font in font units. Vertical metrics are read right away,
+// metrics of glyphs are looked up by stb_truetype only the first time they
+// are needed and then kept (directly indexed for the first 256 codepoints).
+class FontMetrics {
+public:
+    struct Glyph {
+        int index = 0; // glyph index in the font
+        int advance = 0;
+        int left_bearing = 0;
+        std::array<int, 4> box = {{0, 0, 0, 0}}; // x0, y0, x1, y1 (y goes up)
+    };
+
+    FontMetrics() = default;
+    FontMetrics(const stbtt_fontinfo* font, bool ascii_only);
+
+    const Glyph& glyph(int codepoint);
+    int kerning(int first, int second);
+    const stbtt_fontinfo* font() const { return m_font; }
+
+    int ascent = 0;
+    int descent = 0;
+    int line_gap = 0;
+    bool ascii_only = false; // the built-in font, other characters are drawn as '?'
+
+private:
+    const stbtt_fontinfo* m_font = nullptr;
+    std::vector<Glyph> m_latin;
+    std::vector<bool> m_latin_known;
+    std::unordered_map<int, Glyph> m_other;
+
+    // Kerning of pairs of glyph indices (first << 16 | second). When the font
+    // only has a 'kern' table, all its pairs are read upfront and missing ones
+    // are zero. Otherwise (GPOS) the pairs are looked up and stored lazily.
+    std::unordered_map<uint32_t, int> m_kerning;
+    bool m_has_kerning = false;
+    bool m_kerning_complete = false;
+
+    Glyph lookup(int codepoint) const;
 };
 
 
@@ -13205,18 +13330,285 @@ public:
 
     bool add(const std::string& filename);
     const stbtt_fontinfo* get(const std::string& filename) const;
+    FontMetrics* get_metrics(const std::string& filename);
     void release_all();
 
 private:
     struct FontData {
         stbtt_fontinfo font_info;
         std::vector<unsigned char> font_data;
+        FontMetrics metrics;
     };
     std::unordered_map<std::string, FontData> m_data;
 };
 
 
 
+// Glyphs of all fonts rasterized into shared single channel textures (pages),
+// so text is drawn as one quad per glyph and dynamic text does not create
+// any textures. Glyphs are rasterized at one of a few pixel sizes (see
+// bucket), pages are filled row by row and a new one is added when full.
+class GlyphAtlas {
+public:
+    struct Glyph {
+        GLuint texture = 0;        // page, 0 for glyphs without pixels (space)
+        cg::Rect<float> uv;        // where the glyph is in the page (0 to 1)
+        std::array<float, 4> box;  // x0, y0, x1, y1 relative to the pen on baseline (raster pixels)
+    };
+
+    GlyphAtlas() = default;
+    GlyphAtlas(const GlyphAtlas&) = delete;
+    ~GlyphAtlas() { release_all(); }
+
+    // The glyph of a codepoint rasterized at given pixel height (one of the buckets).
+    // Size 0 means the signed distance field of the glyph, which serves any height.
+    const Glyph& get(const stbtt_fontinfo* font, int codepoint, int size);
+
+    // Raster size used for text which is given number of pixels high. Small text
+    // gets a bitmap of its own size, larger text uses the distance field (0).
+    static int bucket(double pixels);
+
+    // Pixel height at which the distance fields are generated. The glyph box
+    // also holds the distance field that far past the outline.
+    static int raster_size(int size) { return size == 0 ? SdfSize : size; }
+
+    void release_all();
+
+    static constexpr int PageSize = 1024;
+    static constexpr int SdfSize = 64;
+    static constexpr int SdfSpread = 8;
+
+private:
+    struct Key {
+        const stbtt_fontinfo* font;
+        int codepoint;
+        int size;
+        bool operator==(const Key& other) const {
+            return font == other.font && codepoint == other.codepoint && size == other.size;
+        }
+    };
+    struct KeyHash {
+        size_t operator()(const Key& key) const {
+            return std::hash<const void*>{}(key.font) ^ (size_t(key.codepoint) * 131u + size_t(key.size));
+        }
+    };
+    std::unordered_map<Key, Glyph, KeyHash> m_glyphs;
+    std::vector<GLuint> m_pages;
+    int m_x = 0;          // where the next glyph goes in the last page
+    int m_y = 0;
+    int m_row_height = 0; // height of the current row
+};
+
+
+
+// Following class caches layouts of text boxes (see cg::text_box). A layout is
+// the list of glyph quads relative to the corner of the box, drawing the same
+// paragraph again only copies them into the batch. The key holds everything
+// that affects the layout, color is applied when drawing. Layouts not used for
+// a while are released, the same way as in GeometryCache.
+class TextLayoutCache {
+public:
+    struct PlacedGlyph {
+        GLuint texture;
+        cg::Rect<float> uv;
+        cg::Rect<float> rect; // relative to the top left corner of the box
+    };
+
+    struct Key {
+        std::string text;
+        const stbtt_fontinfo* font;
+        int raster;           // GlyphAtlas size of the glyphs
+        std::array<double, 3> size; // text size, box width and height
+        int align;
+        bool wrap;
+        bool operator==(const Key& other) const {
+            return text == other.text && font == other.font && raster == other.raster
+                && size == other.size && align == other.align && wrap == other.wrap;
+        }
+    };
+
+    // Lookup the layout. Returns nullptr when not cached.
+    const std::vector<PlacedGlyph>* get(const Key& key);
+    const std::vector<PlacedGlyph>& add(const Key& key, std::vector<PlacedGlyph>&& glyphs);
+
+    void garbage_collect(int clears_not_used = -1);
+    void clear_notify();
+
+private:
+    struct KeyHash {
+        size_t operator()(const Key& key) const;
+    };
+    struct LayoutData {
+        std::vector<PlacedGlyph> glyphs;
+        int clears_without_use;
+    };
+    std::unordered_map<Key, LayoutData, KeyHash> m_data;
+};
+
+
+
+// Following class caches tessellated geometry of shapes which tend to be drawn
+// over and over (apps typically clear and redraw everything each step). The
+// vertices are stored in local coordinates, so drawing the same shape again
+// only means to copy and translate them. The key contains everything that
+// affects the tessellation (kind, size, thickness, colors and LOD).
+class GeometryCache {
+public:
+    enum class Kind {
+        Circle,
+        Rectangle,
+        Triangle,
+        Ellipse,
+        Arc,
+        Pie,
+        RoundedRectangle,
+        Polygon,
+        PathFill,
+        PathStroke
+    };
+
+    struct Key {
+        Key(Kind k, const std::array<double, 4>& s, double t, const cg::Color& c, const cg::Color& fc,
+            std::vector<double> p = std::vector<double>())
+            : kind(k), size(s), thickness(t), color(c), fill_color(fc), points(std::move(p)) {}
+
+        Kind kind;
+        std::array<double, 4> size; // meaning depends on kind
+        double thickness;
+        cg::Color color;
+        cg::Color fill_color;
+        std::vector<double> points; // whole contour for shapes that cannot be described by size
+        bool operator==(const Key& other) const {
+            return kind == other.kind && size == other.size && thickness == other.thickness
+                && color == other.color && fill_color == other.fill_color && points == other.points;
+        }
+    };
+
+    // Lookup the geometry. Returns nullptr when not cached.
+    const std::vector<cg::Vertex>* get(const Key& key);
+
+    // Store the geometry. It is silently dropped when the cache is full.
+    void add(const Key& key, std::vector<cg::Vertex>&& vertices);
+
+    // Same logic as in TextureCache - entities not used for a while are released.
+    void garbage_collect(int clears_not_used = -1);
+    void clear_notify();
+
+    void set_capacity(size_t bytes);
+    double hit_rate() const { return m_hits + m_misses == 0 ? 0. : double(m_hits) / double(m_hits + m_misses); }
+    size_t memory_used() const { return m_bytes; }
+
+private:
+    struct KeyHash {
+        size_t operator()(const Key& key) const;
+    };
+    struct GeometryData {
+        std::vector<cg::Vertex> vertices;
+        int clears_without_use;
+    };
+    std::unordered_map<Key, GeometryData, KeyHash> m_data;
+    size_t m_bytes = 0;
+    size_t m_capacity = 16 * 1024 * 1024;
+    size_t m_hits = 0;
+    size_t m_misses = 0;
+};
+
+
+
+// Following class keeps data the shader needs to evaluate gradients (see
+// set_fill_gradient_linear/radial) and dash patterns (see set_dash). Each of
+// them is a row of a float texture. A gradient row holds 256 colors sampled
+// from the stops and one more texel with the geometry (two points of a linear
+// gradient or center and radius of a radial one). A dash row holds period,
+// number of dashes and offset, followed by where each dash ends. Vertices refer
+// to the row, so the shader does the work at no extra vertex cost. Identical
+// rows are shared; when the table is full, the row set the longest time ago
+// is reused unless a user batch refers to it or it was used since the last clear.
+class LookupTable {
+public:
+    LookupTable() = default;
+    LookupTable(const LookupTable&) = delete;
+    ~LookupTable() { release(); }
+
+    static constexpr int Width = 257;
+    static constexpr int MaxRows = 1024;
+
+    // Find or add a row with given texels (Width RGBA values), upload it
+    // if it is new and return its index.
+    int row(const std::vector<float>& texels);
+    // User batches pin the rows their vertices refer to until they are cleared.
+    void pin(int row);
+    void unpin(int row);
+    // Called from toplevel clear with the rows the current state refers to,
+    // which vertices of the next frame will use without calling row().
+    void clear_notify(int dash_row, int gradient_row);
+    void release();
+
+private:
+    struct RowData {
+        int row;
+        unsigned last_set;
+    };
+    std::map<std::vector<float>, RowData> m_rows;
+    std::vector<unsigned> m_used; // clear count when each row was last used
+    std::vector<int> m_pins;      // number of user batches referring to each row
+    std::vector<float> m_texels; // copy of the whole texture
+    int m_capacity = 0;          // rows allocated on the GPU
+    unsigned m_counter = 0;
+    unsigned m_clears = 1;
+    GLuint m_texture = 0;
+};
+
+
+
+// Following class holds a user-owned triangle mesh. Unlike BatchToDraw, the
+// vertices are indexed and they stay on the GPU. They are only uploaded again
+// when they change (and only the part that changed). Scalar values are stored
+// in the s texture coordinate and shown using a colormap, see draw().
+class Mesh {
+public:
+    Mesh() = default;
+    Mesh(const Mesh&) = delete;
+    Mesh& operator=(const Mesh&) = delete;
+    ~Mesh() { release(); }
+
+    // Set all the data. Coordinates, values and colors are interleaved the
+    // same way as they are passed from the user, null means 'not present'.
+    void set(const float* xy, size_t vertex_count, const unsigned int* indices,
+             size_t index_count, const float* values, const float* rgba);
+
+    // Overwrite count vertices starting at first.
+    void update(size_t first, size_t count, const float* xy, const float* values,
+                const float* rgba);
+
+    void draw();
+    void release(); // Release GPU resources, the data are kept.
+
+    size_t vertex_count() const { return m_vertices.size(); }
+
+    // Colormap (-1 = none) and the range of values mapped onto it.
+    int colormap = -1;
+    double value_min = 0.;
+    double value_max = 1.;
+
+private:
+    std::vector<cg::Vertex> m_vertices;
+    std::vector<GLuint> m_indices;
+    GLuint m_vao;
+    GLuint m_vbo;
+    GLuint m_ebo;
+    bool m_allocated = false;
+
+    // Version counters - each update bumps m_version, draw uploads the data
+    // when m_uploaded_version differs. Only the dirty range is uploaded.
+    unsigned m_version = 1;
+    unsigned m_uploaded_version = 0;
+    size_t m_dirty_begin = 0;
+    size_t m_dirty_end = 0;
+};
+
+
+
 // Following class stores list of entities to be rendered.
 // Manages a vertex array, possibly with texture coords.
 // Textures are stored in TextureCache, which is common to all Batches.
@@ -13229,7 +13621,12 @@ public:
     BatchToDraw& operator=(const BatchToDraw&&) = delete;    
     ~BatchToDraw() { release(); }
 
-    void draw();
+    // Draw the batch. The transform is applied on top of the projection
+    // (it is not identity when this is a user batch drawn by draw_batch).
+    // When tween_target is given, positions and colors are interpolated
+    // between vertices of the two batches (see draw_batch_tween).
+    void draw(const std::array<float, 16>& transform = identity_matrix(),
+              BatchToDraw* tween_target = nullptr, float tween = 0.f);
     void clear();   // Clear plan, leave the vertex array.
     void release(); // Clear plan, delete vertex array.
 
@@ -13241,6 +13638,24 @@ public:
     // three times for each.
     void push_vertex(const cg::Vertex& vertex);
 
+    // Push a block of triangle vertices, translated by (dx, dy).
+    void push_vertices(const cg::Vertex* vertices, size_t count, float dx, float dy);
+
+    // Reserve a block of count triangle vertices and return pointer to it,
+    // the caller fills them in. The pointer is valid until next push.
+    cg::Vertex* push_block(size_t count);
+
+    // Drop triangle vertices pushed after first count (see line_to).
+    // Only valid when nothing else was pushed since then.
+    void truncate_vertices(size_t count);
+    size_t plan_size() const { return m_plan.size(); }
+
+    // Number of vertices pushed so far, and access to those pushed after
+    // a given index (used to fill GeometryCache and to move the geometry).
+    size_t vertex_count() const { return m_vertex_array.size(); }
+    std::vector<cg::Vertex> vertices_since(size_t idx) const;
+    void translate_vertices_since(size_t idx, float dx, float dy);
+
     // The same for lines. Has to be called in pairs.
     void push_line_vertex(const cg::Vertex& vertex);
 
@@ -13249,36 +13664,182 @@ public:
                     const cg::Rect<float>& texture_rect,
                     const cg::Rect<float>& rect);
 
-    // Push another batch to draw, referenced by its name.
-    void push_batch(const std::string& name, double x, double y);
+    // Push a glyph from a page of GlyphAtlas, drawn with given color. The page
+    // holds either coverage or a signed distance field of the glyph.
+    void push_glyph(GLuint texture,
+                    const cg::Rect<float>& texture_rect,
+                    const cg::Rect<float>& rect, const cg::Color& color, bool distance_field);
+
+    // Push a heatmap, texture holds the values, [min, max] is mapped onto the colormap.
+    void push_heatmap(GLuint texture, GLuint colormap_texture, float min, float max,
+                      const cg::Rect<float>& rect);
+
+    // Push a tilemap, cols*rows tiles with ids in tiles_texture, images of the
+    // tiles are in the atlas (atlas_cols per row, tile_size is size of a tile
+    // relative to the atlas size).
+    void push_tilemap(GLuint atlas, GLuint tiles_texture, int cols, int rows, int atlas_cols,
+                      const std::array<float, 2>& tile_size, const cg::Rect<float>& rect);
+
+    // Push another batch to draw, referenced by its name. When tween_name
+    // is not empty, positions and colors are interpolated between the two.
+    void push_batch(const std::string& name, double x, double y,
+                    const std::string& tween_name = "", float tween = 0.f);
+
+    // Push a user mesh, referenced by its id.
+    void push_mesh(int mesh, double x, double y, double scale, double angle);
+
+    // Push n round points of given diameter (see cg::points). rgba holds
+    // four floats per point, when it is null all points have given color.
+    void push_points(const float* x, const float* y, size_t n, double size,
+                     const float* rgba, const cg::Color& color);
+
+    // Set colors of the palette used by vertices with palette colors
+    // (see set_color_from_palette). Nothing else is uploaded to the GPU.
+    void set_palette(const std::vector<cg::Color>& colors);
+
+    // Allow storing the vertices in quantized format (see draw()).
+    void set_quantization(bool quantize) { m_quantize = quantize; m_dirty = true; }
+
+    // Batches used as keyframes must be stored in full format, so the
+    // vertices of both of them can be read by the shader at once.
+    void set_tweened() { if (! m_tweened) m_dirty = true; m_tweened = true; }
+
+    // Write triangles and lines of the batch into a stream and read them back
+    // (the cache of load_vector). Writing fails when the batch contains
+    // anything else, reading fails on malformed data and leaves the batch empty.
+    bool write_geometry(std::ostream& out) const;
+    bool read_geometry(std::istream& in);
 
 private:
     enum class EntityType {
         Triangles,
         Lines,
         Image,
-        Batch
+        Batch,
+        Mesh,
+        Points,
+        Heatmap,
+        Tilemap
     };
 
     struct RenderEntity {
+        RenderEntity(EntityType t, size_t idx, GLuint tex = 0)
+            : type(t), start_idx(idx), texture(tex) {}
+
         EntityType type;
         size_t start_idx; // size of the VA when this was added. used for indexing the VA.
         GLuint texture;   // texture if any, 0 otherwise
+        GLuint grid_texture = 0; // colormap of a heatmap, tile ids of a tilemap
         std::string batch_name; // name of a batch if this is a batch
-        double batch_x; // batch translation if this is a batch
-        double batch_y;
-        double line_thickness; // if this is a line
+        double batch_x = 0.; // batch (or mesh) translation if this is a batch (or mesh)
+        double batch_y = 0.;
+        double line_thickness = 0.; // if this is a line
+        int mesh = -1;       // mesh id if this is a mesh
+        double scale = 1.;   // mesh scaling and rotation
+        double angle = 0.;
+        std::string tween_name; // second keyframe if this is a tweened batch
+        float tween = 0.f;
+        int transform = -1;  // index into m_transforms, -1 for identity
+        size_t point_offset = 0; // points: byte offset of positions in m_point_data,
+        size_t point_count = 0;  // colors follow the positions when per-point colors are used
+        bool point_colors = false;
+        double point_size = 0.;
+        cg::Color point_color;
     };
 
     std::vector<RenderEntity> m_plan;
     std::vector<cg::Vertex> m_vertex_array;
     GLuint m_vao;
     GLuint m_vbo;
-    size_t m_vao_size = size_t(-1);
+    size_t m_vbo_bytes = size_t(-1);
     bool m_dirty = true;
 
+    // Points are kept apart from the triangles, positions as (x, y) floats,
+    // colors as RGBA8. They have their own VBO and VAO (see push_points).
+    std::vector<unsigned char> m_point_data;
+    GLuint m_points_vao;
+    GLuint m_points_vbo;
+    size_t m_points_vbo_bytes = size_t(-1);
+    bool m_points_dirty = false;
+
+    // Draw points of the plan entity, tween is the one the batch is drawn with.
+    void draw_points(const RenderEntity& re, float tween);
+
+    // The palette (texture unit 2) and whether the VBO uses compact format.
+    GLuint m_palette_texture = 0;
+    int m_palette_size = 0;
+    VertexFormat m_format = VertexFormat::Full;
+    bool m_quantize = false;
+    bool m_tweened = false;
+    std::array<float, 4> m_dequantize; // scale and offset of quantized positions
+    double m_draw_scale = 1.;          // largest scale the batch was drawn with since clear
+
+    // Create the VBO if needed and upload the vertices when they changed.
+    // Leaves the VAO and VBO bound.
+    void upload();
+
+    // Pack the vertices into the most compact format possible, return the format.
+    VertexFormat pack_vertices(std::vector<unsigned char>& out);
+
+    // Set uniforms needed by current vertex format (or reset them to defaults).
+    // Only the uniforms of this format are written, so they must be reset before
+    // anything else is drawn in the middle of the batch (nested batches, meshes,
+    // points), otherwise u_dequantize and u_palette_batch leak into it.
+    void set_format_uniforms(bool on) const;
+
     size_t m_plan_size_stash;
     size_t m_vertex_array_size_stash;
+    size_t m_point_data_size_stash;
+    bool m_stashed = false;
+
+    // Remove what cannot be seen and merge entities before the upload
+    // (see get_optimizer_savings). Only used for the toplevel batch, user
+    // batches are kept as drawn, their vertices may be matched by index.
+    void optimize();
+
+    // Whether six vertices starting at v are two triangles forming an
+    // opaque rectangle which covers the whole canvas.
+    bool covers_canvas(const cg::Vertex* v, bool image) const;
+
+    // Transforms of the entities (see push_transform), and version of
+    // the current transform when it was last added. Identical transforms
+    // share the index.
+    std::vector<std::array<float, 16>> m_transforms;
+    std::map<std::array<float, 16>, int> m_transform_lookup;
+    unsigned m_transform_version = 0;
+    int m_transform_current = -1;
+
+    // Vertices carry the index of their transform, the shader reads the
+    // matrices from a texture (unit 5). Entities under different transforms
+    // are then drawn by a single call.
+    GLuint m_transform_texture = 0;
+    GLuint m_transform_vbo = 0;
+    void upload_transforms();
+
+    // Index of the current transform in m_transforms (added if needed),
+    // -1 when the current transform is identity.
+    int transform_index();
+
+    // Whether entities a and b can be drawn by one call (vertex entities only).
+    bool same_draw(const RenderEntity& a, const RenderEntity& b) const;
+
+    // Whether last entity of the plan has given type and current transform,
+    // so that more of the same can be appended to it.
+    bool continues(EntityType type);
+
+    // Add entity with current transform to the plan.
+    RenderEntity& add_entity(EntityType type, GLuint texture = 0);
+
+    // Rows of State::lookup_table (gradients and dashes) the vertices refer
+    // to. A user batch pins them until it is cleared, so they are not reused
+    // while the batch can still be drawn. The toplevel batch needs no pins.
+    std::vector<int> m_lookup_rows;
+    void pin_lookup_rows(); // rows of current dash pattern and fill gradient
+
+    // The same for textures of State::grid_textures, those are not released
+    // while a user batch refers to them, even when it is not drawn.
+    std::vector<GLuint> m_grid_textures;
+    void hold_grid_texture(GLuint texture);
 };
 
 
@@ -13294,6 +13855,7 @@ struct State {
     SDL_GLContext context = nullptr;
     GLuint shader_program;
     std::string glsl_version_string;
+    float max_point_size = 1.f; // largest point size the driver supports
     double width;
     double height;
     Rect<double> viewport;
@@ -13309,10 +13871,45 @@ struct State {
     // They are loaded from files, so it would hurt a lot.
     TextureCache textures;
     FontCache fonts;
+    GlyphAtlas glyphs;
+    TextLayoutCache text_layouts;
+
+    // Cache for tessellated shapes, so they don't have to be generated each frame.
+    GeometryCache geometry;
 
     // Cache for user batches of objects to be drawn.
     std::unordered_map<std::string, BatchToDraw> user_batches;
 
+    // User meshes (see create_mesh) and the last id given out.
+    std::unordered_map<int, Mesh> meshes;
+    int last_mesh_id = -1;
+
+    // Textures with colormaps, created when first needed.
+    std::unordered_map<int, GLuint> colormap_textures;
+
+    // Gradient fills and dash patterns (texture unit 4).
+    LookupTable lookup_table;
+
+    // Whether set_color_from_palette or set_fill_color_from_palette was ever
+    // called, only then toplevel vertices are checked for palette colors.
+    bool palette_colors_used = false;
+
+    // Single channel textures of heatmaps and tilemaps, identified by pointer
+    // to the values the same way as images created from pixel data. A copy of
+    // the values is kept to find out what changed since the last upload.
+    // Textures not used for a while are released, as in TextureCache, unless
+    // a user batch refers to them.
+    struct GridTexture {
+        GLuint texture;
+        int width;
+        int height;
+        GLint internal_format;
+        std::vector<unsigned char> data;
+        int clears_without_use = -1;
+        int batches = 0; // user batches referring to the texture
+    };
+    std::unordered_map<const void*, GridTexture> grid_textures;
+
     // Currently used colors.
     cg::Color color;
     cg::Color background_color;
@@ -13325,9 +13922,64 @@ struct State {
     // Current line thickness.
     double thickness;
 
+    // Maximum distance of a tessellated curve from the real one, in pixels.
+    double curve_tolerance = 0.25;
+
+    // Where load_vector stores tessellated images, empty for nowhere.
+    std::string vector_cache_directory;
+
+    // How thick lines are joined and ended (see set_line_join).
+    int line_join;
+    int line_cap;
+    double miter_limit;
+
+    // Row of the dash pattern in lookup_table, -1 for solid lines.
+    int dash_row = -1;
+
+    // Vertices (draw calls for merging) saved by each rule of BatchToDraw::optimize.
+    std::array<double, 4> optimizer_savings = {{0., 0., 0., 0.}};
+
+    // Current transform (see push_transform) as 2x3 matrix {a, b, c, d, e, f},
+    // transformed point is (a*x + c*y + e, b*x + d*y + f). Each change bumps
+    // the version, so batches know when to store the transform again.
+    std::array<double, 6> transform = {{1., 0., 0., 1., 0., 0.}};
+    std::vector<std::array<double, 6>> transform_stack;
+    bool transform_is_identity = true;
+    unsigned transform_version = 1;
+    double transform_scale = 1.; // largest scaling factor of the transform
+
+    // Path drawn by line_to so far. When it continues, the end cap of the
+    // last segment is removed and replaced by a join (see line_to).
+    struct OpenPath {
+        BatchToDraw* batch = nullptr;
+        size_t plan_size = 0;
+        size_t vertex_end = 0;   // batch vertex count after the path was drawn
+        size_t retract_from = 0; // where the last segment (and end cap) starts
+        Point prev;              // start of the last segment
+        Point last;              // end of the path
+        std::array<Point, 2> last_start; // left and right corner where the last segment starts
+        double thickness = 0.;
+        cg::Color color;
+        int join = 0;
+        int cap = 0;
+        double miter_limit = 0.;
+        int dash_row = -1;
+        double length = 0.;      // arc length at the end of the path (for dashes)
+        unsigned transform_version = 0;
+        bool hairline = false;   // drawn as GL lines, only the length is continued
+    } open_path;
+
+    // Path recorded between begin_path and fill_path / stroke_path.
+    // Commands are stored as they come (see PathCommand), they are only
+    // flattened when the path is drawn.
+    bool path_recording = false;
+    std::vector<double> path_commands;
+    Point path_start; // where current subpath started
+
     // Current text style and font.
     // int text_style; // TODO_TEXTSTYLES: currently not used, see function set_text_style.
     const stbtt_fontinfo* current_font_ptr; // pointer into fonts cache
+    FontMetrics* current_font_metrics;     // metrics of the same font
 
     // Text captured for cg::read_line, UTF-8 encoded.
    std::string entered_text;
@@ -13383,136 +14035,476 @@ State g_state;
 
 ///////////////////////////////////////////////////////////////////////////////
 //                                                                           //
-//                         SYSTEM FUNCTIONS                                  //
+//                         VERTEX KERNELS                                    //
 //                                                                           //
 ///////////////////////////////////////////////////////////////////////////////
 
+// Loops generating vertices in bulk. Each of them has a scalar version,
+// which is the reference the SIMD versions must match exactly.
+// The kernels treat cg::Vertex as eight consecutive floats.
+static_assert(sizeof(cg::Vertex) == 8 * sizeof(float), "cg::Vertex must be eight floats");
 
-// Check that the window is open. If not, print an error message to stderr
-// and exit. fn is function that will complain in the log.
-// The purpose is to kill the process when the window is closed by user
-// and the programmer tries to use it without checking.
-static void terminate_if_no_window(const std::string& fn)
+// Vertex of a shape template (see CircleTemplate). Padded to 16 bytes,
+// so it can be loaded into one SIMD register.
+struct UnitVertex {
+    float x;
+    float y;
+    float outer; // 1 for vertices on the outer radius, 0 for inner radius
+    float padding;
+};
+
+struct VertexKernels {
+    // dst[i] = src[i] moved by (dx, dy). src and dst may be the same.
+    void (*copy_translate)(const cg::Vertex* src, size_t count, float dx, float dy, cg::Vertex* dst);
+
+    // Template vertices scaled by r_inner or r_outer (by unit[i].outer) and moved to (x, y).
+    void (*scale_unit_vertices)(const UnitVertex* unit, size_t count, float x, float y,
+                                float r_inner, float r_outer, const cg::Color& color, cg::Vertex* dst);
+
+    // Separate x and y arrays merged into (x, y) pairs (see cg::points).
+    void (*interleave_xy)(const float* x, const float* y, size_t count, float* dst);
+
+    // Floats in 0 to 1 range converted to bytes (clamped and rounded).
+    void (*pack_unorm8)(const float* src, size_t count, unsigned char* dst);
+};
+
+
+
+static void copy_translate_scalar(const cg::Vertex* src, size_t count, float dx, float dy, cg::Vertex* dst)
 {
-    if (! is_window_open()) {
-        std::cerr << "cppgraphics:  function " << fn << " called without "
-                     "an active window. The application exits.\n" << std::endl;
-        // Call exit, not terminate. This is not a hard error, the user most
-        // likely expects that closing the window will terminate the process.
-        // We don't want to raise any extra alert on this, nor have a debugger
-        // trip on this and shove it into our face.
-        std::exit(0);
+    for (size_t i=0; i<count; ++i) {
+        dst[i] = src[i];
+        dst[i].x += dx;
+        dst[i].y += dy;
     }
 }
 
 
 
-static void set_viewport(int x, int y, int a, int b)
+static void scale_unit_vertices_scalar(const UnitVertex* unit, size_t count, float x, float y,
+                                       float r_inner, float r_outer, const cg::Color& color, cg::Vertex* dst)
 {
-    g_state.viewport = { double(x), double(y), double(a), double(b)};
-    glViewport(x, y, a, b);
+    const float r_diff = r_outer - r_inner;
+    for (size_t i=0; i<count; ++i) {
+        const float r = r_inner + unit[i].outer * r_diff;
+        dst[i] = cg::Vertex{color, x + r*unit[i].x, y + r*unit[i].y, 0.f, 0.f};
+    }
 }
 
 
 
-static void update_view()
+static void interleave_xy_scalar(const float* x, const float* y, size_t count, float* dst)
 {
-    std::array<int, 2> size;
-    SDL_GetWindowSize(g_state.window, &size[0], &size[1]);
-    double new_aspect = double(size[0]) / size[1];
-    double r = new_aspect/g_state.aspect_ratio;
-
-    if (r > 1.)
-        set_viewport(int(0.5*(1.-1./r) * size[0]), 0, int(size[0]/r), size[1]);
-    else
-        set_viewport(0, int(0.5*(1.-r) * size[1]), size[0], int(r * size[1]));
+    for (size_t i=0; i<count; ++i) {
+        dst[2*i] = x[i];
+        dst[2*i+1] = y[i];
+    }
 }
 
 
 
-void set_defaults()
+static void pack_unorm8_scalar(const float* src, size_t count, unsigned char* dst)
 {
-    terminate_if_no_window(__FUNCTION__);
-
-    set_color(cg::White);
-    set_fill_color(cg::White);
-    for (int i=0; i<int(g_state.blend_colors.size()); ++i)
-        set_blend_color(i, cg::White);
-    set_thickness(1.);
-    // TODO_TEXTSTYLES (see function set_text_style)
-    //for (int style : {cg::Bold, cg::Italic, cg::Underlined, cg::StrikeThrough, cg::Outlined})
-    //    set_text_style(style, false);
-    set_font("");
+    for (size_t i=0; i<count; ++i)
+        dst[i] = (unsigned char)(255.f * std::min(1.f, std::max(0.f, src[i])) + .5f);
 }
 
 
 
-#ifdef CPPGRAPHICS_SUPPORT_IMGUI
-namespace {
-    // Following functions are inspired by
-    // https://github.com/ocornut/imgui/blame/master/examples/example_sdl_opengl3/main.cpp
-
-    static bool imgui_last_frame_rendered = true;
-
-    void imgui_setup()
-    {
-        IMGUI_CHECKVERSION();
-        ImGui::CreateContext();
-        ImGuiIO& io = ImGui::GetIO(); (void)io;
-        io.IniFilename = nullptr; // ImGui shall not save anything.
-        ImGui::StyleColorsDark();
-        ImGui_ImplSDL2_InitForOpenGL(g_state.window, g_state.context);
-        ImGui_ImplOpenGL3_Init(g_state.glsl_version_string.c_str());
-    }
+#ifdef CPPGRAPHICS_SIMD_X86
 
-    void imgui_cleanup()
-    {
-        ImGui_ImplOpenGL3_Shutdown();
-        ImGui_ImplSDL2_Shutdown();
-        ImGui::DestroyContext();
+static void copy_translate_sse2(const cg::Vertex* src, size_t count, float dx, float dy, cg::Vertex* dst)
+{
+    const float* in = reinterpret_cast<const float*>(src);
+    float* out = reinterpret_cast<float*>(dst);
+    const __m128 offset = _mm_setr_ps(dx, dy, 0.f, 0.f);
+    for (size_t i=0; i<count; ++i, in += 8, out += 8) {
+        _mm_storeu_ps(out, _mm_loadu_ps(in));
+        _mm_storeu_ps(out + 4, _mm_add_ps(_mm_loadu_ps(in + 4), offset));
     }
+}
 
-    void imgui_render()
-    {
-        if (! imgui_last_frame_rendered)
-            ImGui::Render();
-        imgui_last_frame_rendered = true;
-        ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
-    }
 
-    void imgui_newframe()
-    {
-        if (! cg::is_window_open())
-            return;
-        if (! imgui_last_frame_rendered)
-            ImGui::EndFrame();
-        
-        ImGui_ImplOpenGL3_NewFrame();
-        ImGui_ImplSDL2_NewFrame();
-        #ifdef EMSCRIPTEN
-        if (ImGui::GetIO().DeltaTime <= 0.)
-            ImGui::GetIO().DeltaTime = 0.001;
-        #endif
-        ImGui::NewFrame();
-        imgui_last_frame_rendered = false;
-    }
 
-    void imgui_error(const std::string& fn)
-    {
-        std::cerr << "cppgraphics:  function " << fn << " is not supported when "
-            "compiling with Dear ImGui support. The application terminates.\n" << std::endl;
-        std::terminate();
+static void scale_unit_vertices_sse2(const UnitVertex* unit, size_t count, float x, float y,
+                                     float r_inner, float r_outer, const cg::Color& color, cg::Vertex* dst)
+{
+    const float* in = reinterpret_cast<const float*>(unit);
+    float* out = reinterpret_cast<float*>(dst);
+    const __m128 col = _mm_loadu_ps(color.data());
+    const __m128 base = _mm_setr_ps(x, y, 0.f, 0.f);
+    const __m128 xy_mask = _mm_castsi128_ps(_mm_setr_epi32(-1, -1, 0, 0));
+    const __m128 r_in = _mm_set1_ps(r_inner);
+    const __m128 r_diff = _mm_set1_ps(r_outer - r_inner);
+    for (size_t i=0; i<count; ++i, in += 4, out += 8) {
+        const __m128 u = _mm_loadu_ps(in);
+        const __m128 outer = _mm_shuffle_ps(u, u, _MM_SHUFFLE(2, 2, 2, 2));
+        const __m128 r = _mm_add_ps(r_in, _mm_mul_ps(outer, r_diff));
+        _mm_storeu_ps(out, col);
+        _mm_storeu_ps(out + 4, _mm_add_ps(base, _mm_and_ps(_mm_mul_ps(r, u), xy_mask)));
     }
-} // anonymous namespace for imgui helpers
-#endif // CPPGRAPHICS_SUPPORT_IMGUI
+}
 
 
 
-enum {
-    attrib_position,
-    attrib_color,
-    attrib_texture
-};
+static void interleave_xy_sse2(const float* x, const float* y, size_t count, float* dst)
+{
+    size_t i = 0;
+    for (; i+4 <= count; i += 4) {
+        const __m128 vx = _mm_loadu_ps(x + i);
+        const __m128 vy = _mm_loadu_ps(y + i);
+        _mm_storeu_ps(dst + 2*i, _mm_unpacklo_ps(vx, vy));
+        _mm_storeu_ps(dst + 2*i + 4, _mm_unpackhi_ps(vx, vy));
+    }
+    interleave_xy_scalar(x + i, y + i, count - i, dst + 2*i);
+}
+
+
+
+static void pack_unorm8_sse2(const float* src, size_t count, unsigned char* dst)
+{
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.f);
+    const __m128 scale = _mm_set1_ps(255.f);
+    const __m128 half = _mm_set1_ps(.5f);
+    auto convert = [&](const float* in) {
+        const __m128 clamped = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(in), zero), one);
+        return _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(clamped, scale), half));
+    };
+    size_t i = 0;
+    for (; i+16 <= count; i += 16) {
+        const __m128i lo = _mm_packs_epi32(convert(src + i), convert(src + i + 4));
+        const __m128i hi = _mm_packs_epi32(convert(src + i + 8), convert(src + i + 12));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(lo, hi));
+    }
+    pack_unorm8_scalar(src + i, count - i, dst + i);
+}
+
+
+
+#if defined(__GNUC__) || defined(__clang__)
+    #define CPPGRAPHICS_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+    #define CPPGRAPHICS_TARGET_AVX2
+#endif
+
+CPPGRAPHICS_TARGET_AVX2
+static void copy_translate_avx2(const cg::Vertex* src, size_t count, float dx, float dy, cg::Vertex* dst)
+{
+    const float* in = reinterpret_cast<const float*>(src);
+    float* out = reinterpret_cast<float*>(dst);
+    const __m256 offset = _mm256_setr_ps(0.f, 0.f, 0.f, 0.f, dx, dy, 0.f, 0.f);
+    size_t i = 0;
+    for (; i+2 <= count; i += 2, in += 16, out += 16) {
+        _mm256_storeu_ps(out, _mm256_add_ps(_mm256_loadu_ps(in), offset));
+        _mm256_storeu_ps(out + 8, _mm256_add_ps(_mm256_loadu_ps(in + 8), offset));
+    }
+    if (i < count)
+        _mm256_storeu_ps(out, _mm256_add_ps(_mm256_loadu_ps(in), offset));
+}
+
+
+
+CPPGRAPHICS_TARGET_AVX2
+static void scale_unit_vertices_avx2(const UnitVertex* unit, size_t count, float x, float y,
+                                     float r_inner, float r_outer, const cg::Color& color, cg::Vertex* dst)
+{
+    // Two vertices at a time, one in each 128-bit lane.
+    const float* in = reinterpret_cast<const float*>(unit);
+    float* out = reinterpret_cast<float*>(dst);
+    const __m256 col = _mm256_setr_ps(color[0], color[1], color[2], color[3], color[0], color[1], color[2], color[3]);
+    const __m256 base = _mm256_setr_ps(x, y, 0.f, 0.f, x, y, 0.f, 0.f);
+    const __m256 xy_mask = _mm256_castsi256_ps(_mm256_setr_epi32(-1, -1, 0, 0, -1, -1, 0, 0));
+    const __m256 r_in = _mm256_set1_ps(r_inner);
+    const __m256 r_diff = _mm256_set1_ps(r_outer - r_inner);
+    size_t i = 0;
+    for (; i+2 <= count; i += 2, in += 8, out += 16) {
+        const __m256 u = _mm256_loadu_ps(in);
+        const __m256 outer = _mm256_shuffle_ps(u, u, _MM_SHUFFLE(2, 2, 2, 2));
+        const __m256 r = _mm256_add_ps(r_in, _mm256_mul_ps(outer, r_diff));
+        const __m256 pos = _mm256_add_ps(base, _mm256_and_ps(_mm256_mul_ps(r, u), xy_mask));
+        _mm256_storeu_ps(out, _mm256_permute2f128_ps(col, pos, 0x20));
+        _mm256_storeu_ps(out + 8, _mm256_permute2f128_ps(col, pos, 0x30));
+    }
+    if (i < count)
+        scale_unit_vertices_sse2(unit + i, count - i, x, y, r_inner, r_outer, color, dst + i);
+}
+
+
+
+static bool cpu_supports_avx2()
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_cpu_supports("avx2");
+#elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    const bool os_saves_ymm = (info[2] & (1 << 27)) && (_xgetbv(0) & 6) == 6;
+    __cpuidex(info, 7, 0);
+    return os_saves_ymm && (info[1] & (1 << 5));
+#else
+    return false;
+#endif
+}
+
+#endif // CPPGRAPHICS_SIMD_X86
+
+
+
+#ifdef CPPGRAPHICS_SIMD_NEON
+
+static void copy_translate_neon(const cg::Vertex* src, size_t count, float dx, float dy, cg::Vertex* dst)
+{
+    const float* in = reinterpret_cast<const float*>(src);
+    float* out = reinterpret_cast<float*>(dst);
+    const float offset_data[4] = {dx, dy, 0.f, 0.f};
+    const float32x4_t offset = vld1q_f32(offset_data);
+    for (size_t i=0; i<count; ++i, in += 8, out += 8) {
+        vst1q_f32(out, vld1q_f32(in));
+        vst1q_f32(out + 4, vaddq_f32(vld1q_f32(in + 4), offset));
+    }
+}
+
+
+
+static void scale_unit_vertices_neon(const UnitVertex* unit, size_t count, float x, float y,
+                                     float r_inner, float r_outer, const cg::Color& color, cg::Vertex* dst)
+{
+    const float* in = reinterpret_cast<const float*>(unit);
+    float* out = reinterpret_cast<float*>(dst);
+    const float32x4_t col = vld1q_f32(color.data());
+    const float base_data[2] = {x, y};
+    const float32x2_t base = vld1_f32(base_data);
+    const float32x2_t zero = vdup_n_f32(0.f);
+    const float r_diff = r_outer - r_inner;
+    for (size_t i=0; i<count; ++i, in += 4, out += 8) {
+        const float r = r_inner + in[2] * r_diff;
+        vst1q_f32(out, col);
+        vst1q_f32(out + 4, vcombine_f32(vadd_f32(base, vmul_n_f32(vld1_f32(in), r)), zero));
+    }
+}
+
+
+
+static void interleave_xy_neon(const float* x, const float* y, size_t count, float* dst)
+{
+    size_t i = 0;
+    for (; i+4 <= count; i += 4) {
+        float32x4x2_t xy;
+        xy.val[0] = vld1q_f32(x + i);
+        xy.val[1] = vld1q_f32(y + i);
+        vst2q_f32(dst + 2*i, xy);
+    }
+    interleave_xy_scalar(x + i, y + i, count - i, dst + 2*i);
+}
+
+
+
+static void pack_unorm8_neon(const float* src, size_t count, unsigned char* dst)
+{
+    const float32x4_t zero = vdupq_n_f32(0.f);
+    const float32x4_t one = vdupq_n_f32(1.f);
+    const float32x4_t half = vdupq_n_f32(.5f);
+    size_t i = 0;
+    for (; i+8 <= count; i += 8) {
+        const float32x4_t a = vminq_f32(vmaxq_f32(vld1q_f32(src + i), zero), one);
+        const float32x4_t b = vminq_f32(vmaxq_f32(vld1q_f32(src + i + 4), zero), one);
+        const uint32x4_t ia = vcvtq_u32_f32(vmlaq_n_f32(half, a, 255.f));
+        const uint32x4_t ib = vcvtq_u32_f32(vmlaq_n_f32(half, b, 255.f));
+        vst1_u8(dst + i, vmovn_u16(vcombine_u16(vmovn_u32(ia), vmovn_u32(ib))));
+    }
+    pack_unorm8_scalar(src + i, count - i, dst + i);
+}
+
+#endif // CPPGRAPHICS_SIMD_NEON
+
+
+
+// Picks the best kernels the CPU supports, this is only done once.
+static const VertexKernels& vertex_kernels()
+{
+    static const VertexKernels scalar = {copy_translate_scalar, scale_unit_vertices_scalar,
+                                         interleave_xy_scalar, pack_unorm8_scalar};
+#if defined(CPPGRAPHICS_SIMD_X86)
+    // Interleaving and packing are bound by memory, AVX2 would not be any faster.
+    static const VertexKernels sse2 = {copy_translate_sse2, scale_unit_vertices_sse2,
+                                       interleave_xy_sse2, pack_unorm8_sse2};
+    static const VertexKernels avx2 = {copy_translate_avx2, scale_unit_vertices_avx2,
+                                       interleave_xy_sse2, pack_unorm8_sse2};
+    static const VertexKernels& selected = cpu_supports_avx2() ? avx2 : sse2;
+    (void)scalar;
+    return selected;
+#elif defined(CPPGRAPHICS_SIMD_NEON)
+    static const VertexKernels neon = {copy_translate_neon, scale_unit_vertices_neon,
+                                       interleave_xy_neon, pack_unorm8_neon};
+    (void)scalar;
+    return neon;
+#else
+    return scalar;
+#endif
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+//                                                                           //
+//                         SYSTEM FUNCTIONS                                  //
+//                                                                           //
+///////////////////////////////////////////////////////////////////////////////
+
+
+// Check that the window is open. If not, print an error message to stderr
+// and exit. fn is function that will complain in the log.
+// The purpose is to kill the process when the window is closed by user
+// and the programmer tries to use it without checking.
+static void terminate_if_no_window(const std::string& fn)
+{
+    if (! is_window_open()) {
+        std::cerr << "cppgraphics:  function " << fn << " called without "
+                     "an active window. The application exits.\n" << std::endl;
+        // Call exit, not terminate. This is not a hard error, the user most
+        // likely expects that closing the window will terminate the process.
+        // We don't want to raise any extra alert on this, nor have a debugger
+        // trip on this and shove it into our face.
+        std::exit(0);
+    }
+}
+
+
+
+static void set_viewport(int x, int y, int a, int b)
+{
+    g_state.viewport = { double(x), double(y), double(a), double(b)};
+    glViewport(x, y, a, b);
+}
+
+
+
+// How many pixels of the window one unit of the canvas covers.
+static double view_pixels_per_unit()
+{
+    return std::max(g_state.viewport.width / g_state.width,
+                    g_state.viewport.height / g_state.height);
+}
+
+
+
+// The same for one unit of what is being drawn now, i.e. including the
+// scaling of current transform (see push_transform).
+static double pixels_per_unit()
+{
+    return view_pixels_per_unit() * g_state.transform_scale;
+}
+
+
+
+static void update_view()
+{
+    std::array<int, 2> size;
+    SDL_GetWindowSize(g_state.window, &size[0], &size[1]);
+    double new_aspect = double(size[0]) / size[1];
+    double r = new_aspect/g_state.aspect_ratio;
+
+    if (r > 1.)
+        set_viewport(int(0.5*(1.-1./r) * size[0]), 0, int(size[0]/r), size[1]);
+    else
+        set_viewport(0, int(0.5*(1.-r) * size[1]), size[0], int(r * size[1]));
+}
+
+
+
+void set_defaults()
+{
+    terminate_if_no_window(__FUNCTION__);
+
+    set_color(cg::White);
+    set_fill_color(cg::White);
+    for (int i=0; i<int(g_state.blend_colors.size()); ++i)
+        set_blend_color(i, cg::White);
+    set_thickness(1.);
+    set_line_join(cg::LineJoinMiter);
+    set_line_cap(cg::LineCapButt);
+    set_miter_limit(4.);
+    set_dash(nullptr, 0);
+    g_state.transform_stack.clear();
+    reset_transform();
+    // TODO_TEXTSTYLES (see function set_text_style)
+    //for (int style : {cg::Bold, cg::Italic, cg::Underlined, cg::StrikeThrough, cg::Outlined})
+    //    set_text_style(style, false);
+    set_font("");
+}
+
+
+
+#ifdef CPPGRAPHICS_SUPPORT_IMGUI
+namespace {
+    // Following functions are inspired by
+    // https://github.com/ocornut/imgui/blame/master/examples/example_sdl_opengl3/main.cpp
+
+    static bool imgui_last_frame_rendered = true;
+
+    void imgui_setup()
+    {
+        IMGUI_CHECKVERSION();
+        ImGui::CreateContext();
+        ImGuiIO& io = ImGui::GetIO(); (void)io;
+        io.IniFilename = nullptr; // ImGui shall not save anything.
+        ImGui::StyleColorsDark();
+        ImGui_ImplSDL2_InitForOpenGL(g_state.window, g_state.context);
+        ImGui_ImplOpenGL3_Init(g_state.glsl_version_string.c_str());
+    }
+
+    void imgui_cleanup()
+    {
+        ImGui_ImplOpenGL3_Shutdown();
+        ImGui_ImplSDL2_Shutdown();
+        ImGui::DestroyContext();
+    }
+
+    void imgui_render()
+    {
+        if (! imgui_last_frame_rendered)
+            ImGui::Render();
+        imgui_last_frame_rendered = true;
+        ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+    }
+
+    void imgui_newframe()
+    {
+        if (! cg::is_window_open())
+            return;
+        if (! imgui_last_frame_rendered)
+            ImGui::EndFrame();
+        
+        ImGui_ImplOpenGL3_NewFrame();
+        ImGui_ImplSDL2_NewFrame();
+        #ifdef EMSCRIPTEN
+        if (ImGui::GetIO().DeltaTime <= 0.)
+            ImGui::GetIO().DeltaTime = 0.001;
+        #endif
+        ImGui::NewFrame();
+        imgui_last_frame_rendered = false;
+    }
+
+    void imgui_error(const std::string& fn)
+    {
+        std::cerr << "cppgraphics:  function " << fn << " is not supported when "
+            "compiling with Dear ImGui support. The application terminates.\n" << std::endl;
+        std::terminate();
+    }
+} // anonymous namespace for imgui helpers
+#endif // CPPGRAPHICS_SUPPORT_IMGUI
+
+
+
+enum {
+    attrib_position,
+    attrib_color,
+    attrib_texture,
+    attrib_position_b, // second keyframe of tweened batches
+    attrib_color_b,
+    attrib_transform   // index of the transform of the vertex, -1 for none
+};
 
 
 
@@ -13564,14 +14556,53 @@ void create_window(const std::string& title, double width, double height, bool f
         "in vec2 i_position;\n"
         "in vec4 i_color;\n"
         "in vec2 i_texture;\n"
+        "in vec2 i_position_b;\n" // second keyframe when tweening
+        "in vec4 i_color_b;\n"
+        "in float i_transform;\n" // row of u_transforms, -1 for none
         "out vec4 v_color;\n"
         "out vec2 v_texture;\n"
         "uniform mat4 u_projection_matrix;\n"
         "uniform mat4 u_transform;\n"
+        "uniform vec2 u_value_range;\n" // colormapped mesh if min != max
+        "uniform sampler2D u_palette;\n"
+        "uniform bool u_palette_batch;\n" // all vertices are palette indices
+        "uniform vec4 u_dequantize;\n" // scale and offset of quantized positions
+        "uniform float u_tween;\n" // interpolation between keyframes
+        "uniform float u_point_size;\n" // drawing points if > 0 (pixels)
+        "uniform highp sampler2D u_lookup;\n" // gradients and dash patterns
+        "uniform highp sampler2D u_transforms;\n" // affine transforms of the batch, two texels each
         "void main() {\n"
+        "    vec2 position = i_position * u_dequantize.xy + u_dequantize.zw;\n"
         "    v_color = i_color;\n"
+        "    if (u_tween != 0.0) {\n"
+        "        position = mix(position, i_position_b, u_tween);\n"
+        "        if (i_color.a >= 0.0 && i_color_b.a >= 0.0)\n" // not a texture, palette etc.
+        "            v_color = mix(i_color, i_color_b, u_tween);\n"
+        "    }\n"
+        "    if (u_palette_batch || i_color.a == -3.0) {\n"
+        "        int idx = int(i_color.r + 0.5);\n"
+        "        v_color = texelFetch(u_palette, ivec2(idx % 256, idx / 256), 0);\n"
+        "    }\n"
         "    v_texture = i_texture;\n"
-        "    gl_Position = u_projection_matrix * u_transform * vec4( i_position, 0.0, 1.0 );\n"
+        "    if (i_color.a == -6.0 || i_color.a == -7.0) {\n" // gradient, its geometry is in the last texel
+        "        vec4 g = texelFetch(u_lookup, ivec2(256, int(i_color.r + 0.5)), 0);\n"
+        "        if (i_color.a == -6.0)\n" // linear, from g.xy to g.zw
+        "            v_texture = vec2(dot(position - g.xy, g.zw - g.xy) / dot(g.zw - g.xy, g.zw - g.xy), 0.0);\n"
+        "        else\n" // radial, center g.xy and radius g.z
+        "            v_texture = (position - g.xy) / g.z;\n"
+        "    }\n"
+        "    if (u_value_range.x != u_value_range.y) {\n"
+        "        v_color = vec4(0.0, 0.0, 0.0, -2.0);\n"
+        "        v_texture = vec2((i_texture.s - u_value_range.x) / (u_value_range.y - u_value_range.x), 0.5);\n"
+        "    }\n"
+        "    if (i_transform >= 0.0) {\n"
+        "        int k = int(i_transform + 0.5);\n"
+        "        vec4 m = texelFetch(u_transforms, ivec2(2 * (k % 256), k / 256), 0);\n" // a, b, c, d
+        "        vec2 t = texelFetch(u_transforms, ivec2(2 * (k % 256) + 1, k / 256), 0).xy;\n" // e, f
+        "        position = m.xy * position.x + m.zw * position.y + t;\n"
+        "    }\n"
+        "    gl_Position = u_projection_matrix * u_transform * vec4( position, 0.0, 1.0 );\n"
+        "    gl_PointSize = u_point_size;\n"
         "}\n";
     const char* vertex_shader_data = vertex_shader.c_str();
 
@@ -13584,11 +14615,64 @@ void create_window(const std::string& title, double width, double height, bool f
         "in vec2 v_texture;\n"
         "out vec4 o_color;\n"
         "uniform sampler2D ourTexture;\n"
+        "uniform sampler2D u_colormap;\n"
+        "uniform float u_point_size;\n"
+        "uniform highp usampler2D u_tiles;\n"
+        "uniform highp sampler2D u_lookup;\n" // gradients and dash patterns
         "void main() {\n"
         "    if(v_color.a == -1.f)\n"
         "        o_color = texture(ourTexture, v_texture);\n"
+        "    else if(v_color.a == -2.f)\n"
+        "        o_color = texture(u_colormap, v_texture);\n"
+        "    else if(v_color.a == -4.f) {\n" // heatmap, value range in red and green
+        "        float value = texture(ourTexture, v_texture).r;\n"
+        "        o_color = texture(u_colormap, vec2((value - v_color.r) / (v_color.g - v_color.r), 0.5));\n"
+        "    }\n"
+        "    else if(v_color.a == -5.f) {\n" // tilemap: atlas columns and tile size in rgb
+        "        ivec2 cell = ivec2(floor(v_texture));\n"
+        "        int id = int(texelFetch(u_tiles, cell, 0).r);\n"
+        "        if (id == 65535)\n" // empty cell
+        "            discard;\n"
+        "        int atlas_cols = int(v_color.r + 0.5);\n"
+        "        vec2 tile = vec2(float(id % atlas_cols), float(id / atlas_cols));\n"
+        "        vec2 texel = vec2(0.5) / vec2(textureSize(ourTexture, 0));\n" // do not bleed into neighbors
+        "        vec2 inside = clamp(fract(v_texture) * v_color.gb, texel, v_color.gb - texel);\n"
+        "        o_color = texture(ourTexture, tile * v_color.gb + inside);\n"
+        "    }\n"
+        "    else if(v_color.a == -6.f || v_color.a == -7.f) {\n" // gradient, row in red
+        "        float t = v_color.a == -6.f ? v_texture.s : length(v_texture);\n"
+        "        float f = clamp(t, 0.0, 1.0) * 255.0;\n"
+        "        int i = min(int(f), 254);\n"
+        "        int row = int(v_color.r + 0.5);\n"
+        "        o_color = mix(texelFetch(u_lookup, ivec2(i, row), 0), texelFetch(u_lookup, ivec2(i+1, row), 0), f - float(i));\n"
+        "    }\n"
+        "    else if(v_color.a <= -10.f) {\n" // distance field glyph: 0.5 on the outline, alpha stored as -10 - alpha
+        "        float d = texture(ourTexture, v_texture).r;\n"
+        "        float w = max(0.5 * fwidth(d), 1.0e-4);\n" // smooth over about a pixel at any scale
+        "        o_color = vec4(v_color.rgb, (-10.0 - v_color.a) * smoothstep(0.5 - w, 0.5 + w, d));\n"
+        "    }\n"
+        "    else if(v_color.a <= -8.f)\n" // glyph: coverage in red, alpha stored as -8 - alpha
+        "        o_color = vec4(v_color.rgb, (-8.0 - v_color.a) * texture(ourTexture, v_texture).r);\n"
         "    else\n"
         "        o_color = v_color;\n"
+        "    if (v_texture.t > 0.0 && v_color.a >= 0.0) {\n" // dashed line: arc length in s, dash row + 1 in t
+        "        int row = int(v_texture.t - 0.5);\n"
+        "        vec4 dash = texelFetch(u_lookup, ivec2(0, row), 0);\n" // period, count, offset
+        "        float d = mod(v_texture.s + dash.z, dash.x);\n"
+        "        int n = int(dash.y + 0.5);\n"
+        "        int k = 0;\n"
+        "        while (k < n - 1 && d >= texelFetch(u_lookup, ivec2(1 + k, row), 0).r)\n"
+        "            ++k;\n"
+        "        if (k % 2 == 1)\n" // in a gap
+        "            discard;\n"
+        "    }\n"
+        "    if (u_point_size > 0.0) {\n" // round point, edge antialiased over one pixel
+        "        float r = length(gl_PointCoord - vec2(0.5)) * u_point_size;\n"
+        "        float coverage = clamp(0.5 * u_point_size - r + 0.5, 0.0, 1.0);\n"
+        "        if (coverage == 0.0)\n"
+        "            discard;\n"
+        "        o_color.a *= coverage;\n"
+        "    }\n"
         "}\n";
     const char* fragment_shader_data = fragment_shader.c_str();
 
@@ -13647,8 +14731,20 @@ void create_window(const std::string& title, double width, double height, bool f
             glBindAttribLocation( program, attrib_position, "i_position" );
             glBindAttribLocation( program, attrib_color, "i_color" );
             glBindAttribLocation( program, attrib_texture, "i_texture" );
+            glBindAttribLocation( program, attrib_position_b, "i_position_b" );
+            glBindAttribLocation( program, attrib_color_b, "i_color_b" );
+            glBindAttribLocation( program, attrib_transform, "i_transform" );
             glLinkProgram( program );
             glUseProgram( program );
+            glUniform1i( glGetUniformLocation( program, "ourTexture" ), 0 );
+            glUniform1i( glGetUniformLocation( program, "u_colormap" ), 1 );
+            glUniform1i( glGetUniformLocation( program, "u_palette" ), 2 );
+            glUniform1i( glGetUniformLocation( program, "u_tiles" ), 3 );
+            glUniform1i( glGetUniformLocation( program, "u_lookup" ), 4 );
+            glUniform1i( glGetUniformLocation( program, "u_transforms" ), 5 );
+            glVertexAttrib1f( attrib_transform, -1.f ); // used when the array is disabled
+            glUniform4f( glGetUniformLocation( program, "u_dequantize" ), 1.f, 1.f, 0.f, 0.f );
+            glUniform1f( glGetUniformLocation( program, "u_point_size" ), 0.f );
             glDeleteShader(vs);
             glDeleteShader(fs);
         }
@@ -13668,8 +14764,17 @@ void create_window(const std::string& title, double width, double height, bool f
     glDisable( GL_DEPTH_TEST );
     glEnable(GL_CULL_FACE);
     glCullFace(GL_BACK);
-    static const std::array<float, 16> ident = {1,0,0,0, 0,1,0,0, 0,0,1,0, 0,0,0,1};
-    glUniformMatrix4fv( glGetUniformLocation( g_state.shader_program, "u_transform" ), 1, GL_FALSE, ident.data() );
+    #if ! CPPGRAPHICS_OPENGL_ES
+        glEnable(GL_VERTEX_PROGRAM_POINT_SIZE); // always on in OpenGL ES
+    #endif
+    std::array<GLfloat, 2> point_size_range;
+    #if CPPGRAPHICS_OPENGL_ES
+        glGetFloatv(GL_ALIASED_POINT_SIZE_RANGE, point_size_range.data());
+    #else
+        glGetFloatv(GL_POINT_SIZE_RANGE, point_size_range.data());
+    #endif
+    g_state.max_point_size = std::max(1.f, point_size_range[1]);
+    glUniformMatrix4fv( glGetUniformLocation( g_state.shader_program, "u_transform" ), 1, GL_FALSE, identity_matrix().data() );
 
     // Now set the size of the window. The reason to not do it in SDL_CreateWindow
     // is that is the provided size is too large, the resulting window does not show.
@@ -13715,6 +14820,18 @@ void close_window()
 
     g_state.textures.garbage_collect(); // releases all textures
     g_state.fonts.release_all();
+    g_state.glyphs.release_all();
+    g_state.text_layouts.garbage_collect(); // they refer to the glyph pages
+    g_state.geometry.garbage_collect();
+    for (auto& it : g_state.meshes)
+        it.second.release(); // data are kept, they can be uploaded again
+    for (auto& it : g_state.colormap_textures)
+        glDeleteTextures(1, &it.second);
+    g_state.colormap_textures.clear();
+    for (auto& it : g_state.grid_textures)
+        glDeleteTextures(1, &it.second.texture);
+    g_state.grid_textures.clear();
+    g_state.lookup_table.release();
 
     // Release resoures.
     g_state.toplevel_batch.release();
@@ -13754,6 +14871,9 @@ State::State()
 
 State::~State()
 {
+    // User batches hold rows of lookup_table and grid textures, they must
+    // be released while those still exist.
+    user_batches.clear();
     close_window(); // if it does not exist, this is a no-op
     SDL_Quit();
 }
@@ -13858,9 +14978,12 @@ static void render()
 
     SDL_GL_SwapWindow( g_state.window );
     ++g_state.frames_total;
-    // Every 400 frames check and remove long unused textures.
-    if (g_state.frames_total % 400 == 0)
+    // Every 400 frames check and remove long unused textures and geometry.
+    if (g_state.frames_total % 400 == 0) {
         g_state.textures.garbage_collect(10);
+        g_state.geometry.garbage_collect(10);
+        g_state.text_layouts.garbage_collect(10);
+    }
 }
 
 
@@ -14182,100 +15305,33 @@ int random_int(int max)
 ///////////////////////////////////////////////////////////////////////////////
 
 
-static std::vector<int> string_to_utf8_codepoints(const std::string& text)
-{
-    std::vector<int> codepoints;
-    for (size_t i=0; i<text.size(); ++i) {
-        unsigned char c = static_cast<unsigned char>(text[i]);
-        int bytes = c >= 0xF0 ? 4 :
-                    c >= 0xE0 ? 3 :
-                    c >= 0xC0 ? 2 : 1;
-        c = c << bytes;
-        c = c >> bytes;
-        int codepoint = 0;
-        for (int j=0; j<bytes; ++j) {
-            codepoint |= (c << (6*(bytes-j-1)));
-            if (j != bytes - 1)
-                c = static_cast<unsigned char>(text[i+j+1]) & 0x3F; // remove first two bits
-        }
-        codepoints.push_back(codepoint);
-        i += bytes-1;
+// Decode UTF-8 codepoint starting at text[i] and move i past it.
+static int next_codepoint(const std::string& text, size_t& i)
+{
+    unsigned char c = static_cast<unsigned char>(text[i]);
+    int bytes = c >= 0xF0 ? 4 :
+                c >= 0xE0 ? 3 :
+                c >= 0xC0 ? 2 : 1;
+    c = c << bytes;
+    c = c >> bytes;
+    int codepoint = 0;
+    for (int j=0; j<bytes; ++j) {
+        codepoint |= (c << (6*(bytes-j-1)));
+        if (j != bytes - 1)
+            c = i+j+1 < text.size() ? static_cast<unsigned char>(text[i+j+1]) & 0x3F : 0; // remove first two bits
     }
-    return codepoints;
+    i += bytes;
+    return codepoint;
 }
 
 
 
-// Either render a text into the SDL_Surface, or just do a dry run and return width and height.
-static SDL_Surface* draw_text(const stbtt_fontinfo* info, const std::string& text, double size,
-                              SDL_Color color, int& width, int& height, bool render = true)
+static std::vector<int> string_to_utf8_codepoints(const std::string& text)
 {
-    // The created texture does not need to be width x height. Those are
-    // just the dimensions at which it will be stretched.
-    std::vector<unsigned char> bitmap;
-    int b_w = 0;
-    int b_h = 0;
-
-    if (render) {
-        // If we are actually creating a texture, measure the required
-        // width and height and create the bitmap.
-        draw_text(info, text, size, color, b_w, b_h, false);
-        b_w += 1;
-        b_h += 1;
-        bitmap.resize(b_w * b_h, 0);
-    }
-
-    float scale = stbtt_ScaleForPixelHeight(info, float(size)); // calculate font scaling
-    int ascent, descent, lineGap;
-    stbtt_GetFontVMetrics(info, &ascent, &descent, &lineGap);
-    
-    ascent = int(roundf(ascent * scale));
-    descent = int(roundf(descent * scale));
-    
-    int x = 0;
-    int measured_height = ascent - descent;
-    std::vector<int> codepoints = string_to_utf8_codepoints(text);
-    for (size_t i=0; i<codepoints.size(); ++i) {
-        int ax, lsb, c_x1, c_y1, c_x2, c_y2;
-        stbtt_GetCodepointHMetrics(info, codepoints[i], &ax, &lsb);
-        stbtt_GetCodepointBitmapBox(info, codepoints[i], scale, scale, &c_x1, &c_y1, &c_x2, &c_y2);
-        if (render) {
-            int y = ascent + c_y1;
-            int byteOffset = int(x + roundf(lsb * scale) + (y * b_w));
-            stbtt_MakeCodepointBitmap(info, bitmap.data() + byteOffset, c_x2 - c_x1, c_y2 - c_y1, b_w, scale, scale, codepoints[i]);
-        }
-        if (i != codepoints.size() - 1) { // kerning
-            int kern = stbtt_GetCodepointKernAdvance(info, codepoints[i], codepoints[i + 1]);
-            x += int(roundf(kern * scale));
-        }
-        x += int(roundf(ax * scale)); // advance x
-    }
-
-    if (! render) { // If this was a dry run, fill in dimensions and return.
-        width = x;
-        height = measured_height;
-        return nullptr;
-    }
-
-    // Convert the bitmap to SDL_Surface:
-	SDL_Surface* surface = SDL_CreateRGBSurface(SDL_SWSURFACE, b_w, b_h, 32,
-                               0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000);
-    SDL_FillRect(surface, NULL, 0); // Init as transparent
-
-    double a = color.a / 255.;
-    double r = color.r / 255.;
-    double g = color.g / 255.;
-    double b = color.b / 255.;
-
-    for (int j=0; j<b_h; ++j) {
-        for (int i=0; i<b_w; ++i) {
-            Uint8 fact = bitmap[i+j*b_w];
-            Uint32* dst = (Uint32*)(surface->pixels) + (i+j*b_w);
-            *dst = (Uint8(a*fact)<<24) | (Uint8(r*fact)<<16) | (Uint8(g*fact)<<8) | Uint8(b*fact);
-        }
-    }
-    
-    return surface;
+    std::vector<int> codepoints;
+    for (size_t i=0; i<text.size(); )
+        codepoints.push_back(next_codepoint(text, i));
+    return codepoints;
 }
 
 
@@ -14305,790 +15361,4875 @@ static cg::Color translate_color(int color) {
 
 
 
-// Stash current state. This is called internally from read_line. It assumes
-// that there is no clear in between the stash / unstash.
-void BatchToDraw::stash()
+// Set attribute pointers of currently bound VAO and VBO for given format.
+static void set_vertex_format(VertexFormat format)
 {
-    m_plan_size_stash = m_plan.size();
-    m_vertex_array_size_stash = m_vertex_array.size();
+    glEnableVertexAttribArray( attrib_position );
+    glEnableVertexAttribArray( attrib_color );
+    if (format == VertexFormat::Full) {
+        glEnableVertexAttribArray( attrib_texture );
+        glVertexAttribPointer( attrib_color, 4, GL_FLOAT, GL_FALSE, sizeof( float ) * 8, 0 );
+        glVertexAttribPointer( attrib_position, 2, GL_FLOAT, GL_FALSE, sizeof( float ) * 8, ( void * )(4 * sizeof(float)) );
+        glVertexAttribPointer( attrib_texture, 2, GL_FLOAT, GL_FALSE, sizeof( float ) * 8, ( void * )(6 * sizeof(float)) );
+    } else if (format == VertexFormat::Palette) {
+        // The palette index goes into red component of the color,
+        // u_palette_batch uniform tells the shader to look into the palette.
+        glDisableVertexAttribArray( attrib_texture );
+        glVertexAttribPointer( attrib_position, 2, GL_FLOAT, GL_FALSE, sizeof(PaletteVertex), 0 );
+        glVertexAttribPointer( attrib_color, 1, GL_UNSIGNED_SHORT, GL_FALSE, sizeof(PaletteVertex), ( void * )(2 * sizeof(float)) );
+    } else {
+        // Positions are normalized to 0..1, u_dequantize uniform transforms
+        // them back into the bounding box of the batch.
+        glDisableVertexAttribArray( attrib_texture );
+        const GLsizei stride = format == VertexFormat::Quantized ? sizeof(QuantizedVertex) : sizeof(QuantizedPaletteVertex);
+        glVertexAttribPointer( attrib_position, 2, GL_UNSIGNED_SHORT, GL_TRUE, stride, 0 );
+        if (format == VertexFormat::Quantized)
+            glVertexAttribPointer( attrib_color, 4, GL_UNSIGNED_BYTE, GL_TRUE, stride, ( void * )(2 * sizeof(GLushort)) );
+        else
+            glVertexAttribPointer( attrib_color, 1, GL_UNSIGNED_SHORT, GL_FALSE, stride, ( void * )(2 * sizeof(GLushort)) );
+    }
 }
 
 
 
-void BatchToDraw::unstash()
+static void set_transform(const std::array<float, 16>& transform)
 {
-    assert(m_plan_size_stash <= m_plan.size() && m_vertex_array_size_stash <= m_vertex_array.size());
-    m_plan.resize(m_plan_size_stash);
-    m_vertex_array.resize(m_vertex_array_size_stash);
+    glUniformMatrix4fv( glGetUniformLocation( g_state.shader_program, "u_transform" ), 1, GL_FALSE, transform.data() );
+
+    // Mirroring transforms turn ccw triangles into cw ones, those would be culled.
+    glFrontFace(transform[0]*transform[5] - transform[1]*transform[4] < 0.f ? GL_CW : GL_CCW);
 }
 
 
 
-void BatchToDraw::draw()
+static std::array<float, 16> multiply(const std::array<float, 16>& a, const std::array<float, 16>& b)
 {
-    // In case we don't have a VBO yet, create one.
-    if (m_vao_size == size_t(-1)) {
-        glGenVertexArrays( 1, &m_vao );
-        glGenBuffers( 1, &m_vbo );
-        glBindVertexArray( m_vao );
-        glBindBuffer( GL_ARRAY_BUFFER, m_vbo );
-        glEnableVertexAttribArray( attrib_position );
-        glEnableVertexAttribArray( attrib_color );
-        glEnableVertexAttribArray( attrib_texture );
-        glVertexAttribPointer( attrib_color, 4, GL_FLOAT, GL_FALSE, sizeof( float ) * 8, 0 );
-        glVertexAttribPointer( attrib_position, 2, GL_FLOAT, GL_FALSE, sizeof( float ) * 8, ( void * )(4 * sizeof(float)) );
-        glVertexAttribPointer( attrib_texture, 2, GL_FLOAT, GL_FALSE, sizeof( float ) * 8, ( void * )(6 * sizeof(float)) );
-    }
-
-    glBindVertexArray( m_vao );
-    glBindBuffer( GL_ARRAY_BUFFER, m_vbo );
-
-    if (m_dirty) {
-        // Is our VBO large enough for what we are going to draw?
-        if (m_vertex_array.size() > m_vao_size || m_vao_size == size_t(-1)) {
-            // It is not - reallocate GPU memory so current capacity fits. This
-            // limits reallocations the same way std::vector does.
-            glBufferData( GL_ARRAY_BUFFER, m_vertex_array.capacity()*sizeof(cg::Vertex),
-                        nullptr, GL_DYNAMIC_DRAW );
-            m_vao_size = m_vertex_array.capacity();
-        }
-        // The VBO is now large enough, just copy into it.
-        glBufferSubData( GL_ARRAY_BUFFER, 0, m_vertex_array.size()*sizeof(cg::Vertex),
-                         m_vertex_array.data());
-        m_dirty = false;
-    }
-
-    for (size_t i=0; i<m_plan.size(); ++i) {
-        if (m_plan[i].type != EntityType::Batch) {
-            size_t end_idx = (i == m_plan.size()-1 ? m_vertex_array.size() : m_plan[i+1].start_idx);
-            if (m_plan[i].type == EntityType::Image)
-                glBindTexture(GL_TEXTURE_2D, m_plan[i].texture);
-            if (m_plan[i].type == EntityType::Lines)
-                glLineWidth(float(m_plan[i].line_thickness));
-            glDrawArrays( m_plan[i].type == EntityType::Lines ? GL_LINES : GL_TRIANGLES,
-                          GLint(m_plan[i].start_idx), GLsizei(end_idx - m_plan[i].start_idx) );
-        } else {
-            const RenderEntity& re = m_plan[i];
-            BatchToDraw& b = g_state.user_batches.at(re.batch_name);
-            if (re.batch_x != 0. || re.batch_y != 0.) {
-                static const std::array<float, 16> ident = {1,0,0,0, 0,1,0,0, 0,0,1,0, 0,0,0,1};
-                std::array<float, 16> transform = ident;
-                transform[12] = float(re.batch_x);
-                transform[13] = float(re.batch_y);
-                glUniformMatrix4fv( glGetUniformLocation( g_state.shader_program, "u_transform" ), 1, GL_FALSE, transform.data() );
-                b.draw();
-                glUniformMatrix4fv( glGetUniformLocation( g_state.shader_program, "u_transform" ), 1, GL_FALSE, ident.data() );
-            } else
-                b.draw();
-            glBindVertexArray( m_vao );
-            glBindBuffer( GL_ARRAY_BUFFER, m_vbo );
+    std::array<float, 16> out;
+    for (int col=0; col<4; ++col)
+        for (int row=0; row<4; ++row) {
+            float sum = 0.f;
+            for (int k=0; k<4; ++k)
+                sum += a[4*k+row] * b[4*col+k];
+            out[4*col+row] = sum;
         }
-    }
+    return out;
 }
 
 
 
-void BatchToDraw::push_vertex(const cg::Vertex& vertex)
+// Largest scaling factor of the xy part of a matrix (see set_current_transform).
+static double matrix_scale(const std::array<float, 16>& m)
 {
-    if (m_plan.empty() || m_plan.back().type != EntityType::Triangles)
-        m_plan.emplace_back(RenderEntity{EntityType::Triangles, m_vertex_array.size(), 0, "", 0., 0., 0.});
-    m_vertex_array.emplace_back(vertex);
-    m_dirty = true;
+    const double sum = double(m[0])*m[0] + double(m[1])*m[1] + double(m[4])*m[4] + double(m[5])*m[5];
+    const double det = double(m[0])*m[5] - double(m[1])*m[4];
+    return std::sqrt((sum + std::sqrt(std::max(0., sum*sum - 4.*det*det))) / 2.);
 }
 
 
 
-void BatchToDraw::push_line_vertex(const cg::Vertex& vertex)
+// Whether quantizing positions over given extent (see pack_vertices) would
+// move them by a visible amount when drawn with given scale.
+static bool quantization_visible(float extent, double scale)
 {
-    if (m_plan.empty() || m_plan.back().type != EntityType::Lines || m_plan.back().line_thickness != g_state.thickness)
-        m_plan.emplace_back(RenderEntity{EntityType::Lines, m_vertex_array.size(), 0, "", 0., 0., g_state.thickness});
-    m_vertex_array.emplace_back(vertex);
-    m_dirty = true;    
+    return extent / 65535. * view_pixels_per_unit() * scale > 1./16.;
 }
 
 
 
-void BatchToDraw::push_image(GLuint texture,
-                    const cg::Rect<float>& tr,
-                    const cg::Rect<float>& wr)
+// Matrix to scale, rotate (radians) and then translate.
+static std::array<float, 16> placement_matrix(double x, double y, double scale, double angle)
 {
-    std::vector<cg::Vertex>& va = m_vertex_array;
-
-    if (m_plan.empty() || m_plan.back().type != EntityType::Image || m_plan.back().texture != texture)
-        m_plan.emplace_back(RenderEntity{EntityType::Image, va.size(), texture, "", 0., 0., 0.});
-
-    constexpr cg::Color col = {0.f, 0.f, 0.f, -1.f}; // so that fragment shader uses a texture
-
-    va.emplace_back(cg::Vertex{col, wr.x, wr.y, tr.x, tr.y});
-    va.emplace_back(cg::Vertex{col, wr.x, wr.y+wr.height, tr.x, tr.y+tr.height});
-    va.emplace_back(cg::Vertex{col, wr.x+wr.width, wr.y, tr.x+tr.width, tr.y});
-    va.emplace_back(cg::Vertex{col, wr.x, wr.y+wr.height, tr.x, tr.y+tr.height});
-    va.emplace_back(cg::Vertex{col, wr.x+wr.width, wr.y+wr.height, tr.x+tr.width, tr.y+tr.height});
-    va.emplace_back(cg::Vertex{col, wr.x+wr.width, wr.y, tr.x+tr.width, tr.y});
-
-    m_dirty = true;
+    const float c = float(scale * std::cos(angle));
+    const float s = float(scale * std::sin(angle));
+    return {{c, s, 0.f, 0.f,  -s, c, 0.f, 0.f,  0.f, 0.f, 1.f, 0.f,  float(x), float(y), 0.f, 1.f}};
 }
 
 
 
-void BatchToDraw::push_batch(const std::string& name, double x, double y)
+// Colormaps are 256x1 textures, generated by linear interpolation
+// between few control points when first needed.
+static GLuint get_colormap_texture(int colormap)
 {
-    m_plan.emplace_back(RenderEntity{EntityType::Batch, m_vertex_array.size(),
-                                     0, name, x, y, 0.});
-}
+    auto it = g_state.colormap_textures.find(colormap);
+    if (it != g_state.colormap_textures.end())
+        return it->second;
 
+    struct Stop {
+        float pos;
+        float r, g, b;
+    };
+    static const Stop jet[] = {{0.f, 0.f, 0.f, .5f}, {.125f, 0.f, 0.f, 1.f}, {.375f, 0.f, 1.f, 1.f},
+                               {.625f, 1.f, 1.f, 0.f}, {.875f, 1.f, 0.f, 0.f}, {1.f, .5f, 0.f, 0.f}};
+    static const Stop hot[] = {{0.f, 0.f, 0.f, 0.f}, {.375f, 1.f, 0.f, 0.f}, {.75f, 1.f, 1.f, 0.f}, {1.f, 1.f, 1.f, 1.f}};
+    static const Stop viridis[] = {{0.f, .267f, .005f, .329f}, {.125f, .279f, .175f, .483f}, {.25f, .230f, .322f, .546f},
+                                   {.375f, .173f, .449f, .558f}, {.5f, .128f, .567f, .551f}, {.625f, .153f, .680f, .504f},
+                                   {.75f, .361f, .785f, .388f}, {.875f, .667f, .862f, .196f}, {1.f, .993f, .906f, .144f}};
+    static const Stop gray[] = {{0.f, 0.f, 0.f, 0.f}, {1.f, 1.f, 1.f, 1.f}};
+
+    const Stop* stops = gray; // cg::ColormapGray or out of range
+    size_t stop_count = sizeof(gray) / sizeof(Stop);
+    if (colormap == cg::ColormapJet) {
+        stops = jet;
+        stop_count = sizeof(jet) / sizeof(Stop);
+    }
+    else if (colormap == cg::ColormapHot) {
+        stops = hot;
+        stop_count = sizeof(hot) / sizeof(Stop);
+    }
+    else if (colormap == cg::ColormapViridis) {
+        stops = viridis;
+        stop_count = sizeof(viridis) / sizeof(Stop);
+    }
 
+    std::array<unsigned char, 256*4> pixels;
+    size_t stop = 0;
+    for (int i=0; i<256; ++i) {
+        float pos = i / 255.f;
+        while (stop+2 < stop_count && stops[stop+1].pos < pos)
+            ++stop;
+        const Stop& a = stops[stop];
+        const Stop& b = stops[stop+1];
+        float t = std::min(1.f, std::max(0.f, (pos - a.pos) / (b.pos - a.pos)));
+        pixels[4*i]   = (unsigned char)(255.f * (a.r + t*(b.r-a.r)) + .5f);
+        pixels[4*i+1] = (unsigned char)(255.f * (a.g + t*(b.g-a.g)) + .5f);
+        pixels[4*i+2] = (unsigned char)(255.f * (a.b + t*(b.b-a.b)) + .5f);
+        pixels[4*i+3] = 255;
+    }
 
-void BatchToDraw::clear()
-{
-    m_vertex_array.clear();
-    m_dirty = true;
-    m_plan.clear();
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 256, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+    g_state.colormap_textures.emplace(colormap, texture);
+    return texture;
 }
 
 
 
-void BatchToDraw::release()
+int LookupTable::row(const std::vector<float>& texels)
 {
-    // Actually release previously allocated memory.
-    // If there are user batches, this is called from their destructor.
+    assert(texels.size() == 4 * Width);
+    ++m_counter;
+    auto it = m_rows.find(texels);
+    if (it != m_rows.end()) {
+        it->second.last_set = m_counter;
+        m_used[size_t(it->second.row)] = m_clears;
+        return it->second.row;
+    }
 
-    this->clear();
-    m_vertex_array.shrink_to_fit();
-    if (m_vao_size != size_t(-1)) {
-        glDeleteVertexArrays(1, &m_vao);
-        glDeleteBuffers(1, &m_vbo);
+    int row = int(m_rows.size());
+    if (row == MaxRows) {
+        // Reuse the row set the longest time ago (most likely not on screen).
+        // Rows used since the last clear may be referenced by vertices which
+        // are not drawn yet, those are never reused.
+        auto oldest = m_rows.end();
+        for (auto jt = m_rows.begin(); jt != m_rows.end(); ++jt)
+            if (m_pins[size_t(jt->second.row)] == 0 && m_used[size_t(jt->second.row)] != m_clears
+                && (oldest == m_rows.end() || jt->second.last_set < oldest->second.last_set))
+                oldest = jt;
+        if (oldest == m_rows.end()) {
+            std::cerr << "cppgraphics: Too many gradients and dash patterns in use, reusing the first one.\n";
+            return 0;
+        }
+        row = oldest->second.row;
+        m_rows.erase(oldest);
+    }
+    m_rows.emplace(texels, RowData{row, m_counter});
+    if (size_t(row) >= m_used.size()) {
+        m_used.resize(size_t(row) + 1);
+        m_pins.resize(size_t(row) + 1);
+    }
+    m_used[size_t(row)] = m_clears;
+
+    glActiveTexture(GL_TEXTURE4);
+    if (m_texture == 0) {
+        glGenTextures(1, &m_texture);
+        glBindTexture(GL_TEXTURE_2D, m_texture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST); // the shader interpolates
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    } else
+        glBindTexture(GL_TEXTURE_2D, m_texture);
+    if (row >= m_capacity) {
+        // Grow the texture the same way as std::vector grows.
+        m_capacity = std::min(int(MaxRows), std::max(16, 2 * m_capacity));
+        m_texels.resize(size_t(4 * Width * m_capacity));
+        std::copy(texels.begin(), texels.end(), m_texels.begin() + 4 * Width * row);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, Width, m_capacity, 0, GL_RGBA, GL_FLOAT, m_texels.data());
+    } else {
+        std::copy(texels.begin(), texels.end(), m_texels.begin() + 4 * Width * row);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, row, Width, 1, GL_RGBA, GL_FLOAT, texels.data());
     }
-    m_vao_size = size_t(-1);
+    glActiveTexture(GL_TEXTURE0);
+    return row;
 }
 
 
 
-void begin_batch(const std::string& name)
+void LookupTable::clear_notify(int dash_row, int gradient_row)
 {
-    if (g_state.current_batch != &g_state.toplevel_batch) {
-        std::cerr << "cppgraphics: User batch cannot have another batch as a member!\n"
-                     "The application will now terminate.\n\n";
-        std::terminate();
-    }
-    g_state.current_batch = &g_state.user_batches[name];
+    ++m_clears;
+    for (int row : {dash_row, gradient_row})
+        if (row >= 0 && size_t(row) < m_used.size())
+            m_used[size_t(row)] = m_clears;
 }
 
 
 
-void end_batch()
+void LookupTable::pin(int row)
 {
-    if (g_state.current_batch == &g_state.toplevel_batch) {
-        std::cerr << "cppgraphics: end_batch called without previous call to "
-                     "begin_batch. The application will now terminate.\n\n";
-        std::terminate();
-    }
-    g_state.current_batch = &g_state.toplevel_batch;
+    if (row >= 0 && size_t(row) < m_pins.size())
+        ++m_pins[size_t(row)];
 }
 
 
 
-void clear()
+void LookupTable::unpin(int row)
 {
-    terminate_if_no_window(__FUNCTION__);
-    g_state.current_batch->clear();
+    // Rows may be gone when the table was released while the batch was kept.
+    if (row >= 0 && size_t(row) < m_pins.size() && m_pins[size_t(row)] > 0)
+        --m_pins[size_t(row)];
+}
 
-    if (g_state.current_batch == &g_state.toplevel_batch) {
-        g_state.textures.clear_notify();
 
-        // Paint visible area with background color.
-        // Anything outside will be painted with 'inactive' color
-        // in render function.
-        double thickness = g_state.thickness;
-        cg::set_thickness(0.);
-        cg::Color fill_color = g_state.fill_color;
-        g_state.fill_color = g_state.background_color;
-        cg::rectangle(0., 0., g_state.width, g_state.height);
-        cg::set_thickness(thickness);
-        g_state.fill_color = fill_color;
-    }
+
+void LookupTable::release()
+{
+    if (m_texture != 0)
+        glDeleteTextures(1, &m_texture);
+    m_texture = 0;
+    m_rows.clear();
+    m_used.clear();
+    m_pins.clear();
+    m_texels.clear();
+    m_capacity = 0;
 }
 
 
 
-static bool is_triangle_ccw(double x1, double y1, double x2, double y2, double x3, double y3)
+// Stash current state. This is called internally from read_line. It assumes
+// that there is no clear in between the stash / unstash.
+void BatchToDraw::stash()
 {
-    bool ccw = ((x2-x1)*(y3-y1)-(y2-y1)*(x3-x1)) < 0.;
-    return ccw;
+    m_stashed = true;
+    m_plan_size_stash = m_plan.size();
+    m_vertex_array_size_stash = m_vertex_array.size();
+    m_point_data_size_stash = m_point_data.size();
 }
 
 
 
-// Internal function to draw a triangle without outline and using a given color.
-// The triangle is appended into a vertex array.
-// When no color is given, g_state.blend_colors are used. In that case,
-// flip_colors flag is used to render second triangle in a rectangle.
-static void triangle_internal(double x1, double y1, double x2, double y2, double x3, double y3,
-                              const cg::Color* const color1, const cg::Color* color2 = nullptr, const cg::Color* color3 = nullptr)
+void BatchToDraw::unstash()
 {
-    // All triangles should now be ccw. Internal cppgraphics functions only pass ccw,
-    // anything from the user should be already reoriented by now.
-    assert( is_triangle_ccw(x1, y1, x2, y2, x3, y3));
-
-    if (! color2)
-        color2 = color1;
-    if (! color3)
-        color3 = color1;
-    g_state.current_batch->push_vertex(cg::Vertex{*color1, float(x1), float(y1), 0.f, 0.f});
-    g_state.current_batch->push_vertex(cg::Vertex{*color2, float(x2), float(y2), 0.f, 0.f});
-    g_state.current_batch->push_vertex(cg::Vertex{*color3, float(x3), float(y3), 0.f, 0.f});
+    assert(m_plan_size_stash <= m_plan.size() && m_vertex_array_size_stash <= m_vertex_array.size());
+    m_plan.erase(m_plan.begin() + m_plan_size_stash, m_plan.end());
+    m_vertex_array.resize(m_vertex_array_size_stash);
+    m_point_data.resize(m_point_data_size_stash);
 }
 
 
 
-void triangle(double x1, double y1, double x2, double y2, double x3, double y3)
+bool BatchToDraw::covers_canvas(const cg::Vertex* v, bool image) const
 {
-    terminate_if_no_window(__FUNCTION__);
-
-    if (! is_triangle_ccw(x1, y1, x2, y2, x3, y3)) {
-        std::swap(x2, x3);
-        std::swap(y2, y3);
+    // Images are opaque when their texture is, triangles need opaque color
+    // (gradients and palette colors have negative alpha).
+    float min_x = v[0].x, max_x = v[0].x, min_y = v[0].y, max_y = v[0].y;
+    for (int i=0; i<6; ++i) {
+        if (v[i].color[3] != (image ? -1.f : 1.f))
+            return false;
+        min_x = std::min(min_x, v[i].x);
+        max_x = std::max(max_x, v[i].x);
+        min_y = std::min(min_y, v[i].y);
+        max_y = std::max(max_y, v[i].y);
     }
+    if (min_x > 0.f || min_y > 0.f || max_x < float(g_state.width) || max_y < float(g_state.height))
+        return false;
 
-    const double t = g_state.thickness;
-    const bool one_layer = t <= 0. || g_state.color == g_state.fill_color;
-    const bool inside_opaque = g_state.fill_color[3] == 1.;
+    // All vertices are corners of the bounding box, three different ones in
+    // each triangle, and the corners the triangles do not share are opposite.
+    auto same = [](const cg::Vertex& a, const cg::Vertex& b) { return a.x == b.x && a.y == b.y; };
+    for (int i=0; i<6; ++i)
+        if ((v[i].x != min_x && v[i].x != max_x) || (v[i].y != min_y && v[i].y != max_y))
+            return false;
+    const cg::Vertex* only_first = nullptr;
+    const cg::Vertex* only_second = nullptr;
+    for (int t=0; t<2; ++t) {
+        const cg::Vertex* tri = v + 3*t;
+        const cg::Vertex* other = v + 3*(1-t);
+        if (same(tri[0], tri[1]) || same(tri[1], tri[2]) || same(tri[0], tri[2]))
+            return false;
+        for (int i=0; i<3; ++i)
+            if (! same(tri[i], other[0]) && ! same(tri[i], other[1]) && ! same(tri[i], other[2])) {
+                if ((t == 0 ? only_first : only_second) != nullptr)
+                    return false;
+                (t == 0 ? only_first : only_second) = &tri[i];
+            }
+    }
+    return only_first && only_second && only_first->x != only_second->x && only_first->y != only_second->y;
+}
 
-    if (one_layer) {
-        // a simple triangle is enough
-        triangle_internal(x1, y1, x2, y2, x3, y3, &g_state.fill_color);
-    } else {
-        // If we got here, thickness is not zero. Draw outline.
-        struct Vector2d {
-            double x;
-            double y;
-            Vector2d operator+(const Vector2d& rhs) const { return {x+rhs.x, y+rhs.y}; };
-            Vector2d operator-(const Vector2d& rhs) const { return {x-rhs.x, y-rhs.y}; };
-            Vector2d operator/(double div) const { return {x/div, y/div}; };
-            Vector2d operator*(double mult) const { return {x*mult, y*mult}; };
-        };
 
-        auto norm = [](const Vector2d& vec) -> double {
-            return std::sqrt(vec.x*vec.x + vec.y*vec.y);
-        };
 
-        // This offsets each vertex along its angle bisector.
-        // Outer triangle and its sides.
-        const std::array<Vector2d, 3> pt = {{{x1, y1}, {x2, y2}, {x3,y3}}};
-        const std::array<Vector2d, 3> side = {(pt[1]-pt[0])/norm(pt[1]-pt[0]),
-                                              (pt[2]-pt[0])/norm(pt[2]-pt[0]),
-                                              (pt[2]-pt[1])/norm(pt[2]-pt[1])};
+void BatchToDraw::optimize()
+{
+    // While the contents is stashed (see read_line), it must stay as it is.
+    if (m_stashed || m_plan.empty())
+        return;
+    std::array<double, 4>& savings = g_state.optimizer_savings;
+    auto entity_end = [this](size_t i) {
+        return i+1 == m_plan.size() ? m_vertex_array.size() : m_plan[i+1].start_idx;
+    };
 
-        std::array<Vector2d, 3> pti; // Vertices of the offset triangle.
-        // Now the offsetting.
-        for (int i=0; i<3; ++i) {
-            const Vector2d side1 = side[i>0 ? i-1 : 0] * (i==1 ? -1. : 1.);
-            const Vector2d& side2 = side[i<2 ? i+1 : 2];
-            Vector2d ab = (side1 + side2)/norm(side1+side2); // angle bisector vector
-            double angle = std::acos(ab.x*side1.x + ab.y*side1.y);
-            pti[i] = pt[i] + ab * (i==2 ? -1. : 1.) * (t/std::sin(angle));
+    // Find the last opaque rectangle covering the canvas, everything before it is hidden.
+    size_t first = 0;
+    size_t cut = 0;
+    bool found = false;
+    for (size_t i=m_plan.size(); i-- > 0 && ! found; ) {
+        const RenderEntity& re = m_plan[i];
+        const bool image = re.type == EntityType::Image;
+        if (re.transform != -1 || (re.type != EntityType::Triangles && ! image))
+            continue;
+        const size_t count = (entity_end(i) - re.start_idx) / 3 * 3;
+        for (size_t v = re.start_idx + count; v >= re.start_idx + 6; v -= 3)
+            if (covers_canvas(&m_vertex_array[v - 6], image)) {
+                if (! image || g_state.textures.is_opaque(re.texture)) {
+                    found = true;
+                    first = i;
+                    cut = v - 6;
+                }
+                break;
+            }
+    }
+    savings[OptimizeHidden] += double(cut);
+
+    // Pixel coordinates of the canvas, to find triangles between pixel centers.
+    const double sx = g_state.viewport.width / g_state.width;
+    const double sy = g_state.viewport.height / g_state.height;
+    auto misses_pixels = [&](const cg::Vertex* v, int transform) {
+        double min_x = std::numeric_limits<double>::max(), max_x = -min_x;
+        double min_y = min_x, max_y = -min_x;
+        for (int k=0; k<3; ++k) {
+            double x = v[k].x;
+            double y = v[k].y;
+            if (transform != -1) {
+                const std::array<float, 16>& m = m_transforms[size_t(transform)];
+                x = m[0] * v[k].x + m[4] * v[k].y + m[12];
+                y = m[1] * v[k].x + m[5] * v[k].y + m[13];
+            }
+            min_x = std::min(min_x, g_state.viewport.x + x * sx);
+            max_x = std::max(max_x, g_state.viewport.x + x * sx);
+            min_y = std::min(min_y, g_state.viewport.y + y * sy);
+            max_y = std::max(max_y, g_state.viewport.y + y * sy);
         }
+        return std::floor(max_x - 0.5) < std::ceil(min_x - 0.5) || std::floor(max_y - 0.5) < std::ceil(min_y - 0.5);
+    };
 
-        // Check if there is some internal area left.
-        bool too_thick = side[0].x*(pti[1]-pti[0]).x + side[0].y*(pti[1]-pti[0]).y < 0.;
-
-        // Vertices of the inner triangle are calculated, we can draw.
-        if (inside_opaque || too_thick) {
-            // we can draw the triangles on top of each other
-            triangle_internal(x1, y1, x2, y2, x3, y3, &g_state.color);
+    // Compact the vertices in place, dropping invisible triangles and lines,
+    // and merge entities which can be drawn by a single call.
+    std::vector<RenderEntity> plan;
+    plan.reserve(m_plan.size() - first);
+    size_t out = 0;
+    for (size_t i=first; i<m_plan.size(); ++i) {
+        RenderEntity& re = m_plan[i];
+        const size_t start = i == first ? cut : re.start_idx;
+        const size_t end = entity_end(i);
+        const size_t new_start = out;
+        if (re.type == EntityType::Triangles || re.type == EntityType::Lines) {
+            const size_t n = re.type == EntityType::Triangles ? 3 : 2;
+            for (size_t v=start; v+n <= end; v+=n) {
+                bool transparent = true;
+                for (size_t k=0; k<n; ++k)
+                    transparent = transparent && m_vertex_array[v+k].color[3] == 0.f;
+                if (transparent)
+                    savings[OptimizeTransparent] += double(n);
+                else if (n == 3 && misses_pixels(&m_vertex_array[v], re.transform))
+                    savings[OptimizeSubpixel] += 3.;
+                else {
+                    if (out != v)
+                        std::copy(m_vertex_array.begin() + v, m_vertex_array.begin() + v + n, m_vertex_array.begin() + out);
+                    out += n;
+                }
+            }
+            if (out == new_start)
+                continue; // nothing left
         } else {
-            // inside is transparent - draw really just the outline
-            for (int i=0; i<3; ++i) {
-                int j = i==2 ? 0 : i+1;
-                triangle_internal(pt[i].x, pt[i].y, pti[i].x, pti[i].y, pt[j].x, pt[j].y, &g_state.color);
-                triangle_internal(pti[i].x, pti[i].y, pti[j].x, pti[j].y, pt[j].x, pt[j].y, &g_state.color);
+            if (out != start)
+                std::copy(m_vertex_array.begin() + start, m_vertex_array.begin() + end, m_vertex_array.begin() + out);
+            out += end - start;
+        }
+        if (! plan.empty()) {
+            const RenderEntity& last = plan.back();
+            const bool textured = re.type == EntityType::Image || re.type == EntityType::Heatmap || re.type == EntityType::Tilemap;
+            if (last.type == re.type && last.transform == re.transform
+             && (re.type == EntityType::Triangles || textured
+                 || (re.type == EntityType::Lines && last.line_thickness == re.line_thickness))
+             && (! textured || (last.texture == re.texture && last.grid_texture == re.grid_texture))) {
+                savings[OptimizeMerged] += 1.;
+                continue;
             }
         }
+        plan.push_back(std::move(re));
+        plan.back().start_idx = new_start;
+    }
 
-        // ...and then the inside.
-        if (g_state.fill_color[3] != 0. && ! too_thick)
-            triangle_internal(pti[0].x, pti[0].y, pti[1].x, pti[1].y,
-                              pti[2].x, pti[2].y, &g_state.fill_color);
+    if (plan.size() != m_plan.size() || out != m_vertex_array.size()) {
+        m_vertex_array.resize(out);
+        m_plan.swap(plan);
+        if (g_state.open_path.batch == this)
+            g_state.open_path.batch = nullptr; // it cannot continue, its vertices moved
     }
 }
 
 
 
-void triangle_blend(double x1, double y1, double x2, double y2, double x3, double y3)
+void BatchToDraw::upload()
 {
-    terminate_if_no_window(__FUNCTION__);
-    const bool was_ccw = is_triangle_ccw(x1, y1, x2, y2, x3, y3);
-    if (! was_ccw) {
-        std::swap(x2, x3);
-        std::swap(y2, y3);
+    // In case we don't have a VBO yet, create one.
+    if (m_vbo_bytes == size_t(-1)) {
+        glGenVertexArrays( 1, &m_vao );
+        glGenBuffers( 1, &m_vbo );
+        glBindVertexArray( m_vao );
+        glBindBuffer( GL_ARRAY_BUFFER, m_vbo );
+        set_vertex_format(VertexFormat::Full);
     }
-    const auto& bc = g_state.blend_colors;
-    triangle_internal(x1, y1, x2, y2, x3, y3, &bc[0], &bc[was_ccw ? 1 : 2], &bc[was_ccw ? 2 : 1]);
-}
-
 
+    glBindVertexArray( m_vao );
+    glBindBuffer( GL_ARRAY_BUFFER, m_vbo );
 
-void rectangle(double x, double y, double a, double b)
-{
-    terminate_if_no_window(__FUNCTION__);
+    if (m_dirty) {
+        if (this == &g_state.toplevel_batch) {
+            optimize();
+            // There is no palette at toplevel, palette colors would be undefined.
+            if (g_state.palette_colors_used) {
+                static bool warned = false;
+                for (cg::Vertex& v : m_vertex_array) {
+                    if (v.color[3] != -3.f)
+                        continue;
+                    if (! warned)
+                        std::cerr << "cppgraphics: Palette colors are only supported inside batches. White is used instead.\n";
+                    warned = true;
+                    v.color = {{1.f, 1.f, 1.f, 1.f}};
+                }
+            }
+        }
 
-    const double t = g_state.thickness;
-    const bool too_thick = t > std::min(a,b)/2.;
-    const bool one_layer = t <= 0. || g_state.color == g_state.fill_color || too_thick;
-    const bool inside_opaque = g_state.fill_color[3] == 1.;
+        // User batches may be stored in a compact format. The toplevel
+        // batch changes each frame, packing it would not pay off.
+        const void* data = m_vertex_array.data();
+        size_t bytes = m_vertex_array.size()*sizeof(cg::Vertex);
+        size_t capacity_bytes = m_vertex_array.capacity()*sizeof(cg::Vertex);
+        std::vector<unsigned char> packed;
+        VertexFormat format = VertexFormat::Full;
+        if (this != &g_state.toplevel_batch && ! m_tweened) {
+            format = pack_vertices(packed);
+            if (format != VertexFormat::Full) {
+                data = packed.data();
+                bytes = capacity_bytes = packed.size();
+            }
+        }
 
-    if (one_layer) {
-        // two simple triangles are enough
-        triangle_internal(x, y, x, y+b, x+a, y, too_thick ? &g_state.color : &g_state.fill_color);
-        triangle_internal(x, y+b, x+a, y+b, x+a, y, too_thick ? &g_state.color : &g_state.fill_color);
-    } else {
-        // If we got here, thickness is not zero. Draw outline.
-        if (inside_opaque) {
-            // we can save few triangles
-            triangle_internal(x, y, x, y+b, x+a, y, &g_state.color);
-            triangle_internal(x, y+b, x+a, y+b, x+a, y, &g_state.color);
-        } else {
-            // inside is transparent - draw really just the outline
-            triangle_internal(x, y, x+a, y+t, x+a, y, &g_state.color);
-            triangle_internal(x, y, x, y+t, x+a, y+t, &g_state.color);
-            triangle_internal(x, y+b-t, x, y+b, x+a, y+b-t, &g_state.color);
-            triangle_internal(x, y+b, x+a, y+b, x+a, y+b-t, &g_state.color);
-            triangle_internal(x, y+t, x, y+b-t, x+t, y+t, &g_state.color);
-            triangle_internal(x, y+b-t,x+t, y+b-t, x+t, y+t, &g_state.color);
-            triangle_internal(x+a-t, y+t, x+a-t, y+b-t, x+a, y+t, &g_state.color);
-            triangle_internal(x+a-t, y+b-t, x+a, y+b-t, x+a, y+t, &g_state.color);
+        // Is our VBO large enough for what we are going to draw?
+        if (bytes > m_vbo_bytes || m_vbo_bytes == size_t(-1)) {
+            // It is not - reallocate GPU memory so current capacity fits. This
+            // limits reallocations the same way std::vector does.
+            glBufferData( GL_ARRAY_BUFFER, capacity_bytes, nullptr, GL_DYNAMIC_DRAW );
+            m_vbo_bytes = capacity_bytes;
         }
+        // The VBO is now large enough, just copy into it.
+        glBufferSubData( GL_ARRAY_BUFFER, 0, bytes, data);
+        if (format != m_format)
+            set_vertex_format(format);
+        m_format = format;
+        upload_transforms();
+        m_dirty = false;
+    }
 
-        // ...and then the inside.
-        if (g_state.fill_color[3] != 0.) {
-            triangle_internal(x+t, y+t, x+t, y+b-t, x+a-t, y+t, &g_state.fill_color);
-            triangle_internal(x+t, y+b-t, x+a-t, y+b-t, x+a-t, y+t, &g_state.fill_color);
+    if (m_points_dirty) {
+        if (m_points_vbo_bytes == size_t(-1)) {
+            glGenVertexArrays( 1, &m_points_vao );
+            glGenBuffers( 1, &m_points_vbo );
+            glBindVertexArray( m_points_vao );
+            glEnableVertexAttribArray( attrib_position );
+            glBindVertexArray( m_vao );
+        }
+        glBindBuffer( GL_ARRAY_BUFFER, m_points_vbo );
+        if (m_point_data.size() > m_points_vbo_bytes || m_points_vbo_bytes == size_t(-1)) {
+            glBufferData( GL_ARRAY_BUFFER, m_point_data.capacity(), nullptr, GL_DYNAMIC_DRAW );
+            m_points_vbo_bytes = m_point_data.capacity();
         }
+        glBufferSubData( GL_ARRAY_BUFFER, 0, m_point_data.size(), m_point_data.data() );
+        glBindBuffer( GL_ARRAY_BUFFER, m_vbo );
+        m_points_dirty = false;
     }
 }
 
 
 
-void rectangle_blend(double x, double y, double a, double b)
+void BatchToDraw::draw_points(const RenderEntity& re, float tween)
 {
-    terminate_if_no_window(__FUNCTION__);
+    // Positions and colors are in separate blocks, so the attributes are
+    // pointed at them for each entity. The points are neither quantized,
+    // nor palette colored, nor tweened.
+    glBindVertexArray( m_points_vao );
+    glBindBuffer( GL_ARRAY_BUFFER, m_points_vbo );
+    glVertexAttribPointer( attrib_position, 2, GL_FLOAT, GL_FALSE, 0, ( void * )re.point_offset );
+    if (re.point_colors) {
+        glEnableVertexAttribArray( attrib_color );
+        glVertexAttribPointer( attrib_color, 4, GL_UNSIGNED_BYTE, GL_TRUE, 0,
+                               ( void * )(re.point_offset + re.point_count * 2 * sizeof(float)) );
+    } else {
+        glDisableVertexAttribArray( attrib_color );
+        glVertexAttrib4fv( attrib_color, re.point_color.data() );
+    }
 
-    triangle_internal(x, y, x, y+b, x+a, y, &g_state.blend_colors[0], &g_state.blend_colors[2], &g_state.blend_colors[1]);
-    triangle_internal(x, y+b, x+a, y+b, x+a, y, &g_state.blend_colors[2], &g_state.blend_colors[3], &g_state.blend_colors[1]);
+    if (tween != 0.f)
+        glUniform1f( glGetUniformLocation( g_state.shader_program, "u_tween" ), 0.f );
+    set_format_uniforms(false);
+
+    const float pixels = std::min(g_state.max_point_size, std::max(1.f, float(re.point_size * view_pixels_per_unit())));
+    glUniform1f( glGetUniformLocation( g_state.shader_program, "u_point_size" ), pixels );
+    glDrawArrays( GL_POINTS, 0, GLsizei(re.point_count) );
+    glUniform1f( glGetUniformLocation( g_state.shader_program, "u_point_size" ), 0.f );
+
+    set_format_uniforms(true);
+    if (tween != 0.f)
+        glUniform1f( glGetUniformLocation( g_state.shader_program, "u_tween" ), tween );
+    glBindVertexArray( m_vao );
+    glBindBuffer( GL_ARRAY_BUFFER, m_vbo );
 }
 
 
 
-void circle(double x, double y, double r)
+void BatchToDraw::draw(const std::array<float, 16>& transform, BatchToDraw* tween_target, float tween)
 {
-    terminate_if_no_window(__FUNCTION__);
-    struct SinCos {
-        double sin;
-        double cos;
-    };
-
-    // We'll precalculate sin and cos values to generate a regular 192-gon.
-    // Any n-gon where n divides 192 can then be generated by striding those
-    // values. (Just one quadrant would suffice, but readability.)
-    auto generate_gon = []() {
-        double angle = 0.;
-        std::vector<SinCos> out;
-        for (int i=0; i<193; ++i, angle += 3.141592/96.)
-            out.push_back({std::sin(angle), std::cos(angle)});
-        std::reverse(out.begin(), out.end());
-        return out;
-    };
-    static const std::vector<SinCos> gon = generate_gon();
-
-    // If the circle is small in current view, use coarser polygon.
-    const std::array<double, 2> size = {g_state.width, g_state.height};
-    double ratio = std::abs(r)/std::min(std::abs(size[0]), std::abs(size[1]));
-    unsigned stride = ratio > 0.16 ? 3 : // 64gon
-                      ratio > 0.08 ? 4 : // 48gon
-                      ratio > 0.04 ? 6 : // 32gon
-                      ratio > 0.02 ? 8 : // 24gon
-                                    12 ; // 16gon
-
-    const double r_inner = std::max(0., r-g_state.thickness);
-    const bool one_fan = g_state.thickness <= 0. || g_state.color == g_state.fill_color;
-    const bool inside_opaque = g_state.fill_color[3] == 1.;
+    if (m_quantize) {
+        // The batch may be drawn larger than when it was quantized (a bigger
+        // window, draw_batch under a transform). Store it in full then.
+        double inner_scale = 1.;
+        for (const std::array<float, 16>& m : m_transforms)
+            inner_scale = std::max(inner_scale, matrix_scale(m));
+        m_draw_scale = std::max(m_draw_scale, matrix_scale(transform) * inner_scale);
+        const bool quantized = m_format == VertexFormat::Quantized || m_format == VertexFormat::QuantizedPalette;
+        if (quantized && quantization_visible(std::max(m_dequantize[0], m_dequantize[1]), m_draw_scale))
+            m_dirty = true;
+    }
+    if (tween_target)
+        tween_target->upload();
+    upload();
+
+    if (tween_target) {
+        // Second keyframe is read from the other VBO. The vertices are
+        // matched by index, so the batches must have the same size.
+        glBindBuffer( GL_ARRAY_BUFFER, tween_target->m_vbo );
+        glEnableVertexAttribArray( attrib_position_b );
+        glEnableVertexAttribArray( attrib_color_b );
+        glVertexAttribPointer( attrib_color_b, 4, GL_FLOAT, GL_FALSE, sizeof( float ) * 8, 0 );
+        glVertexAttribPointer( attrib_position_b, 2, GL_FLOAT, GL_FALSE, sizeof( float ) * 8, ( void * )(4 * sizeof(float)) );
+        glBindBuffer( GL_ARRAY_BUFFER, m_vbo );
+        glUniform1f( glGetUniformLocation( g_state.shader_program, "u_tween" ), tween );
+    }
 
-    for (unsigned i=stride; i<gon.size(); i += stride) {
-        const SinCos& prev = gon[i-stride];
-        const SinCos& next = gon[i];
-        
-        if (one_fan) {
-            // just one fan is enough
-            triangle_internal(x, y, x+r*prev.cos, y+r*prev.sin, x+r*next.cos, y+r*next.sin, &g_state.fill_color);
-        } else {
-            // If we got here, thickness is not zero.
-            // We must draw the outline...
-            if (inside_opaque) {
-                // we can save a few triangles
-                triangle_internal(x, y, x+r*prev.cos, y+r*prev.sin, x+r*next.cos, y+r*next.sin, &g_state.color);
-            } else {
-                // inside is transparent - draw really just the outline
-                triangle_internal(x+r_inner*prev.cos, y+r_inner*prev.sin,
-                                x+r*prev.cos, y+r*prev.sin,
-                                x+r_inner*next.cos, y+r_inner*next.sin, &g_state.color);
-                triangle_internal(x+r*prev.cos, y+r*prev.sin,
-                                  x+r*next.cos, y+r*next.sin,
-                                  x+r_inner*next.cos, y+r_inner*next.sin, &g_state.color);
-            }
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_2D, m_palette_texture);
+    glActiveTexture(GL_TEXTURE5);
+    glBindTexture(GL_TEXTURE_2D, m_transform_texture);
+    glActiveTexture(GL_TEXTURE0);
+    set_format_uniforms(true);
 
-            // ...and then the inside.
-            if (g_state.fill_color[3] != 0.) {
-                triangle_internal(x, y, x+r_inner*prev.cos, y+r_inner*prev.sin,
-                                        x+r_inner*next.cos, y+r_inner*next.sin, &g_state.fill_color);
+    // Vertices drawn under a transform (see push_transform) have it applied
+    // in the shader, on top of the transform of the batch. Nested batches,
+    // meshes and points get it in the uniform.
+    for (size_t i=0; i<m_plan.size(); ++i) {
+        const int entity_transform = m_plan[i].transform;
+        const std::array<float, 16> current = entity_transform < 0 ? transform
+                                            : multiply(transform, m_transforms[size_t(entity_transform)]);
+        if (m_plan[i].type == EntityType::Points) {
+            set_transform(current);
+            draw_points(m_plan[i], tween_target ? tween : 0.f);
+            set_transform(transform);
+        } else if (m_plan[i].type != EntityType::Batch && m_plan[i].type != EntityType::Mesh) {
+            // Following entities which differ only in transform are drawn together.
+            const size_t first = i;
+            while (i + 1 < m_plan.size() && same_draw(m_plan[first], m_plan[i+1]))
+                ++i;
+            size_t end_idx = (i == m_plan.size()-1 ? m_vertex_array.size() : m_plan[i+1].start_idx);
+            glFrontFace(current[0]*current[5] - current[1]*current[4] < 0.f ? GL_CW : GL_CCW); // see set_transform
+            if (m_plan[i].type == EntityType::Image)
+                glBindTexture(GL_TEXTURE_2D, m_plan[i].texture);
+            if (m_plan[i].type == EntityType::Heatmap || m_plan[i].type == EntityType::Tilemap) {
+                glActiveTexture(m_plan[i].type == EntityType::Heatmap ? GL_TEXTURE1 : GL_TEXTURE3);
+                glBindTexture(GL_TEXTURE_2D, m_plan[i].grid_texture);
+                glActiveTexture(GL_TEXTURE0);
+                glBindTexture(GL_TEXTURE_2D, m_plan[i].texture);
+            }
+            if (m_plan[i].type == EntityType::Lines)
+                glLineWidth(float(m_plan[i].line_thickness));
+            glDrawArrays( m_plan[i].type == EntityType::Lines ? GL_LINES : GL_TRIANGLES,
+                          GLint(m_plan[first].start_idx), GLsizei(end_idx - m_plan[first].start_idx) );
+        } else if (m_plan[i].type == EntityType::Batch) {
+            const RenderEntity& re = m_plan[i];
+            BatchToDraw& b = g_state.user_batches.at(re.batch_name);
+            BatchToDraw* nested_tween = nullptr;
+            if (! re.tween_name.empty()) {
+                auto it = g_state.user_batches.find(re.tween_name);
+                if (it != g_state.user_batches.end() && it->second.vertex_count() == b.vertex_count())
+                    nested_tween = &it->second;
+            }
+            // The nested batch sets the uniforms of its own format and tweening.
+            set_format_uniforms(false);
+            if (tween_target)
+                glUniform1f( glGetUniformLocation( g_state.shader_program, "u_tween" ), 0.f );
+            const std::array<float, 16> batch_transform = (re.batch_x != 0. || re.batch_y != 0.)
+                ? multiply(current, placement_matrix(re.batch_x, re.batch_y, 1., 0.)) : current;
+            set_transform(batch_transform);
+            b.draw(batch_transform, nested_tween, re.tween);
+            set_transform(transform);
+            set_format_uniforms(true);
+            if (tween_target)
+                glUniform1f( glGetUniformLocation( g_state.shader_program, "u_tween" ), tween );
+            glBindVertexArray( m_vao );
+            glBindBuffer( GL_ARRAY_BUFFER, m_vbo );
+            glActiveTexture(GL_TEXTURE2);
+            glBindTexture(GL_TEXTURE_2D, m_palette_texture);
+            glActiveTexture(GL_TEXTURE5);
+            glBindTexture(GL_TEXTURE_2D, m_transform_texture);
+            glActiveTexture(GL_TEXTURE0);
+        } else {
+            const RenderEntity& re = m_plan[i];
+            auto it = g_state.meshes.find(re.mesh);
+            if (it == g_state.meshes.end())
+                continue; // the mesh was deleted in the meantime
+            Mesh& mesh = it->second;
+            set_transform(multiply(current, placement_matrix(re.batch_x, re.batch_y, re.scale, re.angle)));
+            if (mesh.colormap != -1) {
+                glActiveTexture(GL_TEXTURE1);
+                glBindTexture(GL_TEXTURE_2D, get_colormap_texture(mesh.colormap));
+                glActiveTexture(GL_TEXTURE0);
+                glUniform2f( glGetUniformLocation( g_state.shader_program, "u_value_range" ),
+                             float(mesh.value_min), float(mesh.value_max) );
+            }
+            set_format_uniforms(false);
+            if (tween_target)
+                glUniform1f( glGetUniformLocation( g_state.shader_program, "u_tween" ), 0.f );
+            mesh.draw();
+            if (tween_target)
+                glUniform1f( glGetUniformLocation( g_state.shader_program, "u_tween" ), tween );
+            set_format_uniforms(true);
+            if (mesh.colormap != -1)
+                glUniform2f( glGetUniformLocation( g_state.shader_program, "u_value_range" ), 0.f, 0.f );
+            set_transform(transform);
+            glBindVertexArray( m_vao );
+            glBindBuffer( GL_ARRAY_BUFFER, m_vbo );
+        }
+    }
+
+    set_transform(transform); // glFrontFace may have been changed for mirrored entities
+    set_format_uniforms(false);
+
+    if (tween_target) {
+        glUniform1f( glGetUniformLocation( g_state.shader_program, "u_tween" ), 0.f );
+        glBindVertexArray( m_vao );
+        glDisableVertexAttribArray( attrib_position_b );
+        glDisableVertexAttribArray( attrib_color_b );
+    }
+}
+
+
+
+VertexFormat BatchToDraw::pack_vertices(std::vector<unsigned char>& out)
+{
+    // Find out what the vertices need.
+    bool all_plain = true;   // no texture coordinates
+    bool all_palette = true; // only palette colors
+    bool all_rgba = true;    // only ordinary colors
+    float min_x = std::numeric_limits<float>::max();
+    float min_y = min_x;
+    float max_x = -min_x;
+    float max_y = -min_x;
+    for (const cg::Vertex& v : m_vertex_array) {
+        all_plain = all_plain && v.s == 0.f && v.t == 0.f;
+        all_palette = all_palette && v.color[3] == -3.f;
+        all_rgba = all_rgba && v.color[3] >= 0.f;
+        min_x = std::min(min_x, v.x);
+        min_y = std::min(min_y, v.y);
+        max_x = std::max(max_x, v.x);
+        max_y = std::max(max_y, v.y);
+    }
+    all_palette = all_palette && m_palette_texture != 0;
+    if (! all_plain || m_vertex_array.empty() || (! all_palette && (! all_rgba || ! m_quantize)))
+        return VertexFormat::Full;
+
+    if (m_quantize) {
+        // 16 bits over the bounding box means that the error is at most
+        // extent/131070. Only quantize when that is well below a pixel
+        // in current view and at the scale the batch is drawn with, so it
+        // cannot be seen (draw() checks again when either grows).
+        const float extent_x = std::max(max_x - min_x, 1e-6f);
+        const float extent_y = std::max(max_y - min_y, 1e-6f);
+        if (! quantization_visible(std::max(extent_x, extent_y), m_draw_scale)) {
+            m_dequantize = {{extent_x, extent_y, min_x, min_y}};
+            auto quantize = [](float val, float min, float extent) {
+                return GLushort(std::min(65535.f, std::max(0.f, (val - min) / extent * 65535.f + .5f)));
+            };
+            if (all_palette) {
+                out.resize(m_vertex_array.size() * sizeof(QuantizedPaletteVertex));
+                QuantizedPaletteVertex* qv = reinterpret_cast<QuantizedPaletteVertex*>(out.data());
+                for (const cg::Vertex& v : m_vertex_array)
+                    *(qv++) = QuantizedPaletteVertex{quantize(v.x, min_x, extent_x), quantize(v.y, min_y, extent_y),
+                                                     GLushort(v.color[0]), 0};
+                return VertexFormat::QuantizedPalette;
+            }
+            out.resize(m_vertex_array.size() * sizeof(QuantizedVertex));
+            QuantizedVertex* qv = reinterpret_cast<QuantizedVertex*>(out.data());
+            for (const cg::Vertex& v : m_vertex_array) {
+                QuantizedVertex q{quantize(v.x, min_x, extent_x), quantize(v.y, min_y, extent_y), {0, 0, 0, 0}};
+                for (int i=0; i<4; ++i)
+                    q.color[i] = GLubyte(std::min(1.f, std::max(0.f, v.color[i])) * 255.f + .5f);
+                *(qv++) = q;
+            }
+            return VertexFormat::Quantized;
+        }
+    }
+
+    if (! all_palette)
+        return VertexFormat::Full;
+
+    // When there is a palette and all vertices use it, the colors need
+    // not be stored at all.
+    out.resize(m_vertex_array.size() * sizeof(PaletteVertex));
+    PaletteVertex* pv = reinterpret_cast<PaletteVertex*>(out.data());
+    for (const cg::Vertex& v : m_vertex_array)
+        *(pv++) = PaletteVertex{v.x, v.y, GLushort(v.color[0]), 0};
+    return VertexFormat::Palette;
+}
+
+
+
+void BatchToDraw::set_format_uniforms(bool on) const
+{
+    const bool palette = m_format == VertexFormat::Palette || m_format == VertexFormat::QuantizedPalette;
+    const bool quantized = m_format == VertexFormat::Quantized || m_format == VertexFormat::QuantizedPalette;
+    if (palette)
+        glUniform1i( glGetUniformLocation( g_state.shader_program, "u_palette_batch" ), on ? 1 : 0 );
+    if (quantized) {
+        static const std::array<float, 4> no_dequantize = {{1.f, 1.f, 0.f, 0.f}};
+        glUniform4fv( glGetUniformLocation( g_state.shader_program, "u_dequantize" ), 1,
+                      on ? m_dequantize.data() : no_dequantize.data() );
+    }
+}
+
+
+
+int BatchToDraw::transform_index()
+{
+    if (g_state.transform_is_identity)
+        return -1;
+    if (m_transform_version != g_state.transform_version) {
+        const std::array<double, 6>& m = g_state.transform;
+        const std::array<float, 16> matrix = {{float(m[0]), float(m[1]), 0.f, 0.f,  float(m[2]), float(m[3]), 0.f, 0.f,
+                                               0.f, 0.f, 1.f, 0.f,  float(m[4]), float(m[5]), 0.f, 1.f}};
+        auto it = m_transform_lookup.find(matrix);
+        if (it == m_transform_lookup.end()) {
+            it = m_transform_lookup.emplace(matrix, int(m_transforms.size())).first;
+            m_transforms.push_back(matrix);
+        }
+        m_transform_current = it->second;
+        m_transform_version = g_state.transform_version;
+    }
+    return m_transform_current;
+}
+
+
+
+bool BatchToDraw::same_draw(const RenderEntity& a, const RenderEntity& b) const
+{
+    if (a.type != b.type || a.type == EntityType::Batch || a.type == EntityType::Mesh || a.type == EntityType::Points)
+        return false;
+    if (a.type == EntityType::Lines && a.line_thickness != b.line_thickness)
+        return false;
+    if (a.texture != b.texture || a.grid_texture != b.grid_texture)
+        return false;
+    // Mirroring transforms turn the triangles around, they need other glFrontFace.
+    auto mirrored = [this](int transform) {
+        if (transform < 0)
+            return false;
+        const std::array<float, 16>& m = m_transforms[size_t(transform)];
+        return m[0]*m[5] - m[1]*m[4] < 0.f;
+    };
+    return mirrored(a.transform) == mirrored(b.transform);
+}
+
+
+
+void BatchToDraw::upload_transforms()
+{
+    bool transformed = false;
+    for (const RenderEntity& re : m_plan)
+        transformed = transformed || (re.transform != -1 && re.type != EntityType::Batch
+                                      && re.type != EntityType::Mesh && re.type != EntityType::Points);
+    if (! transformed) {
+        glDisableVertexAttribArray( attrib_transform );
+        return;
+    }
+
+    // Two texels per transform, 256 transforms in a row.
+    const int rows = int(m_transforms.size() + 255) / 256;
+    std::vector<float> texels(size_t(rows) * 512 * 4, 0.f);
+    for (size_t i=0; i<m_transforms.size(); ++i) {
+        const std::array<float, 16>& m = m_transforms[i];
+        float* texel = &texels[(i / 256 * 512 + i % 256 * 2) * 4];
+        for (float val : {m[0], m[1], m[4], m[5], m[12], m[13]})
+            *(texel++) = val;
+    }
+    glActiveTexture(GL_TEXTURE5);
+    if (m_transform_texture == 0) {
+        glGenTextures(1, &m_transform_texture);
+        glBindTexture(GL_TEXTURE_2D, m_transform_texture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    }
+    glBindTexture(GL_TEXTURE_2D, m_transform_texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, 512, rows, 0, GL_RGBA, GL_FLOAT, texels.data());
+    glActiveTexture(GL_TEXTURE0);
+
+    std::vector<float> indices(m_vertex_array.size(), -1.f);
+    for (size_t i=0; i<m_plan.size(); ++i) {
+        const size_t end_idx = (i == m_plan.size()-1 ? m_vertex_array.size() : m_plan[i+1].start_idx);
+        std::fill(indices.begin() + std::ptrdiff_t(m_plan[i].start_idx), indices.begin() + std::ptrdiff_t(end_idx),
+                  float(m_plan[i].transform));
+    }
+    if (m_transform_vbo == 0)
+        glGenBuffers( 1, &m_transform_vbo );
+    glBindBuffer( GL_ARRAY_BUFFER, m_transform_vbo );
+    glBufferData( GL_ARRAY_BUFFER, indices.size() * sizeof(float), indices.data(), GL_DYNAMIC_DRAW );
+    glEnableVertexAttribArray( attrib_transform );
+    glVertexAttribPointer( attrib_transform, 1, GL_FLOAT, GL_FALSE, sizeof(float), 0 );
+    glBindBuffer( GL_ARRAY_BUFFER, m_vbo );
+}
+
+
+
+bool BatchToDraw::continues(EntityType type)
+{
+    return ! m_plan.empty() && m_plan.back().type == type && m_plan.back().transform == transform_index();
+}
+
+
+
+BatchToDraw::RenderEntity& BatchToDraw::add_entity(EntityType type, GLuint texture)
+{
+    m_plan.emplace_back(type, m_vertex_array.size(), texture);
+    m_plan.back().transform = transform_index();
+    return m_plan.back();
+}
+
+
+
+void BatchToDraw::pin_lookup_rows()
+{
+    if (this == &g_state.toplevel_batch)
+        return;
+    const bool gradient = g_state.fill_color[3] == -6.f || g_state.fill_color[3] == -7.f;
+    for (int row : {g_state.dash_row, gradient ? int(g_state.fill_color[0]) : -1}) {
+        if (row >= 0 && std::find(m_lookup_rows.rbegin(), m_lookup_rows.rend(), row) == m_lookup_rows.rend()) {
+            g_state.lookup_table.pin(row);
+            m_lookup_rows.push_back(row);
+        }
+    }
+}
+
+
+
+void BatchToDraw::hold_grid_texture(GLuint texture)
+{
+    if (this == &g_state.toplevel_batch
+     || std::find(m_grid_textures.begin(), m_grid_textures.end(), texture) != m_grid_textures.end())
+        return;
+    for (auto& it : g_state.grid_textures) {
+        if (it.second.texture == texture) {
+            ++it.second.batches;
+            m_grid_textures.push_back(texture);
+        }
+    }
+}
+
+
+
+void BatchToDraw::push_vertex(const cg::Vertex& vertex)
+{
+    if (! continues(EntityType::Triangles))
+        add_entity(EntityType::Triangles);
+    pin_lookup_rows();
+    m_vertex_array.emplace_back(vertex);
+    m_dirty = true;
+}
+
+
+
+void BatchToDraw::push_vertices(const cg::Vertex* vertices, size_t count, float dx, float dy)
+{
+    if (! continues(EntityType::Triangles))
+        add_entity(EntityType::Triangles);
+    pin_lookup_rows();
+    size_t old_size = m_vertex_array.size();
+    m_vertex_array.resize(old_size + count);
+    vertex_kernels().copy_translate(vertices, count, dx, dy, m_vertex_array.data() + old_size);
+    m_dirty = true;
+}
+
+
+
+cg::Vertex* BatchToDraw::push_block(size_t count)
+{
+    if (! continues(EntityType::Triangles))
+        add_entity(EntityType::Triangles);
+    pin_lookup_rows();
+    size_t old_size = m_vertex_array.size();
+    m_vertex_array.resize(old_size + count);
+    m_dirty = true;
+    return m_vertex_array.data() + old_size;
+}
+
+
+
+void BatchToDraw::truncate_vertices(size_t count)
+{
+    assert(count <= m_vertex_array.size());
+    assert(! m_plan.empty() && m_plan.back().type == EntityType::Triangles && m_plan.back().start_idx <= count);
+    m_vertex_array.resize(count);
+    m_dirty = true;
+}
+
+
+
+std::vector<cg::Vertex> BatchToDraw::vertices_since(size_t idx) const
+{
+    assert(idx <= m_vertex_array.size());
+    return std::vector<cg::Vertex>(m_vertex_array.begin() + idx, m_vertex_array.end());
+}
+
+
+
+void BatchToDraw::translate_vertices_since(size_t idx, float dx, float dy)
+{
+    assert(idx <= m_vertex_array.size());
+    cg::Vertex* vertices = m_vertex_array.data() + idx;
+    vertex_kernels().copy_translate(vertices, m_vertex_array.size() - idx, dx, dy, vertices);
+    m_dirty = true;
+}
+
+
+
+void BatchToDraw::push_line_vertex(const cg::Vertex& vertex)
+{
+    if (! continues(EntityType::Lines) || m_plan.back().line_thickness != g_state.thickness) {
+        add_entity(EntityType::Lines);
+        m_plan.back().line_thickness = g_state.thickness;
+    }
+    pin_lookup_rows();
+    m_vertex_array.emplace_back(vertex);
+    m_dirty = true;    
+}
+
+
+
+void BatchToDraw::push_image(GLuint texture,
+                    const cg::Rect<float>& tr,
+                    const cg::Rect<float>& wr)
+{
+    std::vector<cg::Vertex>& va = m_vertex_array;
+
+    if (! continues(EntityType::Image) || m_plan.back().texture != texture)
+        add_entity(EntityType::Image, texture);
+
+    constexpr cg::Color col = {0.f, 0.f, 0.f, -1.f}; // so that fragment shader uses a texture
+
+    va.emplace_back(cg::Vertex{col, wr.x, wr.y, tr.x, tr.y});
+    va.emplace_back(cg::Vertex{col, wr.x, wr.y+wr.height, tr.x, tr.y+tr.height});
+    va.emplace_back(cg::Vertex{col, wr.x+wr.width, wr.y, tr.x+tr.width, tr.y});
+    va.emplace_back(cg::Vertex{col, wr.x, wr.y+wr.height, tr.x, tr.y+tr.height});
+    va.emplace_back(cg::Vertex{col, wr.x+wr.width, wr.y+wr.height, tr.x+tr.width, tr.y+tr.height});
+    va.emplace_back(cg::Vertex{col, wr.x+wr.width, wr.y, tr.x+tr.width, tr.y});
+
+    m_dirty = true;
+}
+
+
+
+void BatchToDraw::push_glyph(GLuint texture,
+                             const cg::Rect<float>& tr,
+                             const cg::Rect<float>& wr, const cg::Color& color, bool distance_field)
+{
+    std::vector<cg::Vertex>& va = m_vertex_array;
+
+    if (! continues(EntityType::Image) || m_plan.back().texture != texture)
+        add_entity(EntityType::Image, texture);
+
+    // Glyph coverage (or distance) is in the red channel, alpha of the color is
+    // stored as -8 - alpha (-10 - alpha for a distance field).
+    const cg::Color col = {color[0], color[1], color[2], (distance_field ? -10.f : -8.f) - color[3]};
+
+    va.emplace_back(cg::Vertex{col, wr.x, wr.y, tr.x, tr.y});
+    va.emplace_back(cg::Vertex{col, wr.x, wr.y+wr.height, tr.x, tr.y+tr.height});
+    va.emplace_back(cg::Vertex{col, wr.x+wr.width, wr.y, tr.x+tr.width, tr.y});
+    va.emplace_back(cg::Vertex{col, wr.x, wr.y+wr.height, tr.x, tr.y+tr.height});
+    va.emplace_back(cg::Vertex{col, wr.x+wr.width, wr.y+wr.height, tr.x+tr.width, tr.y+tr.height});
+    va.emplace_back(cg::Vertex{col, wr.x+wr.width, wr.y, tr.x+tr.width, tr.y});
+
+    m_dirty = true;
+}
+
+
+
+void BatchToDraw::push_heatmap(GLuint texture, GLuint colormap_texture, float min, float max,
+                               const cg::Rect<float>& wr)
+{
+    std::vector<cg::Vertex>& va = m_vertex_array;
+
+    if (! continues(EntityType::Heatmap) || m_plan.back().texture != texture
+     || m_plan.back().grid_texture != colormap_texture) {
+        add_entity(EntityType::Heatmap, texture);
+        m_plan.back().grid_texture = colormap_texture;
+        hold_grid_texture(texture);
+    }
+
+    // The fragment shader reads the value from the texture and maps
+    // it onto the colormap, the range is passed in the color.
+    const cg::Color col = {min, max, 0.f, -4.f};
+
+    va.emplace_back(cg::Vertex{col, wr.x, wr.y, 0.f, 0.f});
+    va.emplace_back(cg::Vertex{col, wr.x, wr.y+wr.height, 0.f, 1.f});
+    va.emplace_back(cg::Vertex{col, wr.x+wr.width, wr.y, 1.f, 0.f});
+    va.emplace_back(cg::Vertex{col, wr.x, wr.y+wr.height, 0.f, 1.f});
+    va.emplace_back(cg::Vertex{col, wr.x+wr.width, wr.y+wr.height, 1.f, 1.f});
+    va.emplace_back(cg::Vertex{col, wr.x+wr.width, wr.y, 1.f, 0.f});
+
+    m_dirty = true;
+}
+
+
+
+void BatchToDraw::push_tilemap(GLuint atlas, GLuint tiles_texture, int cols, int rows, int atlas_cols,
+                               const std::array<float, 2>& tile_size, const cg::Rect<float>& wr)
+{
+    std::vector<cg::Vertex>& va = m_vertex_array;
+
+    if (! continues(EntityType::Tilemap) || m_plan.back().texture != atlas
+     || m_plan.back().grid_texture != tiles_texture) {
+        add_entity(EntityType::Tilemap, atlas);
+        m_plan.back().grid_texture = tiles_texture;
+        hold_grid_texture(tiles_texture);
+    }
+
+    // Texture coordinates are in tiles, the fragment shader looks up
+    // the tile id and finds the tile in the atlas.
+    const cg::Color col = {float(atlas_cols), tile_size[0], tile_size[1], -5.f};
+    const float c = float(cols);
+    const float r = float(rows);
+
+    va.emplace_back(cg::Vertex{col, wr.x, wr.y, 0.f, 0.f});
+    va.emplace_back(cg::Vertex{col, wr.x, wr.y+wr.height, 0.f, r});
+    va.emplace_back(cg::Vertex{col, wr.x+wr.width, wr.y, c, 0.f});
+    va.emplace_back(cg::Vertex{col, wr.x, wr.y+wr.height, 0.f, r});
+    va.emplace_back(cg::Vertex{col, wr.x+wr.width, wr.y+wr.height, c, r});
+    va.emplace_back(cg::Vertex{col, wr.x+wr.width, wr.y, c, 0.f});
+
+    m_dirty = true;
+}
+
+
+
+void BatchToDraw::push_batch(const std::string& name, double x, double y,
+                             const std::string& tween_name, float tween)
+{
+    RenderEntity& re = add_entity(EntityType::Batch);
+    re.batch_name = name;
+    re.batch_x = x;
+    re.batch_y = y;
+    re.tween_name = tween_name;
+    re.tween = tween;
+}
+
+
+
+void BatchToDraw::push_mesh(int mesh, double x, double y, double scale, double angle)
+{
+    RenderEntity& re = add_entity(EntityType::Mesh);
+    re.batch_x = x;
+    re.batch_y = y;
+    re.mesh = mesh;
+    re.scale = scale;
+    re.angle = angle;
+}
+
+
+
+void BatchToDraw::push_points(const float* x, const float* y, size_t n, double size,
+                              const float* rgba, const cg::Color& color)
+{
+    RenderEntity& re = add_entity(EntityType::Points);
+    re.point_offset = m_point_data.size();
+    re.point_count = n;
+    re.point_colors = rgba != nullptr;
+    re.point_size = size * g_state.transform_scale; // points are not transformed, only moved
+    re.point_color = color;
+
+    // The arrays are copied as they are, no vertices are generated.
+    const size_t position_bytes = n * 2 * sizeof(float);
+    m_point_data.resize(re.point_offset + position_bytes + (rgba ? n * 4 : 0));
+    vertex_kernels().interleave_xy(x, y, n, reinterpret_cast<float*>(m_point_data.data() + re.point_offset));
+    if (rgba)
+        vertex_kernels().pack_unorm8(rgba, 4*n, m_point_data.data() + re.point_offset + position_bytes);
+    m_points_dirty = true;
+}
+
+
+
+void BatchToDraw::set_palette(const std::vector<cg::Color>& colors)
+{
+    // The palette is a texture with 256 colors per row.
+    const int width = 256;
+    const int height = int((colors.size() + width - 1) / width);
+    std::vector<unsigned char> pixels(size_t(width*height*4), 0);
+    for (size_t i=0; i<colors.size(); ++i)
+        for (int j=0; j<4; ++j)
+            pixels[4*i+j] = (unsigned char)(255.f * std::min(1.f, std::max(0.f, colors[i][j])) + .5f);
+
+    if (m_palette_texture == 0) {
+        glGenTextures(1, &m_palette_texture);
+        glBindTexture(GL_TEXTURE_2D, m_palette_texture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        m_dirty = true; // so the vertices are repacked, see draw()
+    } else
+        glBindTexture(GL_TEXTURE_2D, m_palette_texture);
+
+    if (height == (m_palette_size + width - 1) / width)
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+    else
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+    m_palette_size = int(colors.size());
+}
+
+
+
+void BatchToDraw::clear()
+{
+    m_stashed = false;
+    m_vertex_array.clear();
+    m_point_data.clear();
+    m_transforms.clear();
+    m_transform_lookup.clear();
+    m_transform_version = 0;
+    m_transform_current = -1;
+    m_draw_scale = 1.;
+    m_dirty = true;
+    m_plan.clear();
+    for (int row : m_lookup_rows)
+        g_state.lookup_table.unpin(row);
+    m_lookup_rows.clear();
+    for (GLuint texture : m_grid_textures)
+        for (auto& it : g_state.grid_textures)
+            if (it.second.texture == texture && it.second.batches > 0)
+                --it.second.batches;
+    m_grid_textures.clear();
+}
+
+
+
+bool BatchToDraw::write_geometry(std::ostream& out) const
+{
+    for (const RenderEntity& re : m_plan)
+        if ((re.type != EntityType::Triangles && re.type != EntityType::Lines) || re.transform != -1)
+            return false;
+    const std::uint64_t entities = m_plan.size();
+    out.write(reinterpret_cast<const char*>(&entities), sizeof(entities));
+    for (const RenderEntity& re : m_plan) {
+        const std::uint64_t header[2] = {std::uint64_t(re.type), re.start_idx};
+        out.write(reinterpret_cast<const char*>(header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(&re.line_thickness), sizeof(re.line_thickness));
+    }
+    const std::uint64_t vertices = m_vertex_array.size();
+    out.write(reinterpret_cast<const char*>(&vertices), sizeof(vertices));
+    out.write(reinterpret_cast<const char*>(m_vertex_array.data()), std::streamsize(vertices * sizeof(cg::Vertex)));
+    return bool(out);
+}
+
+
+
+bool BatchToDraw::read_geometry(std::istream& in)
+{
+    clear();
+    // Counts are checked against what is left in the stream before anything
+    // is allocated, a corrupt file must not make us allocate gigabytes.
+    auto remaining = [&in]() -> std::uint64_t {
+        const std::streampos pos = in.tellg();
+        if (pos == std::streampos(-1))
+            return 0;
+        in.seekg(0, std::ios::end);
+        const std::streampos end = in.tellg();
+        in.seekg(pos);
+        return end > pos ? std::uint64_t(end - pos) : 0;
+    };
+    const std::uint64_t entity_bytes = 2 * sizeof(std::uint64_t) + sizeof(double);
+    std::uint64_t entities = 0;
+    in.read(reinterpret_cast<char*>(&entities), sizeof(entities));
+    if (in && entities > remaining() / entity_bytes)
+        in.setstate(std::ios::failbit);
+    for (std::uint64_t i=0; in && i<entities; ++i) {
+        std::uint64_t header[2] = {0, 0};
+        double thickness = 0.;
+        in.read(reinterpret_cast<char*>(header), sizeof(header));
+        in.read(reinterpret_cast<char*>(&thickness), sizeof(thickness));
+        if (header[0] != std::uint64_t(EntityType::Triangles) && header[0] != std::uint64_t(EntityType::Lines))
+            in.setstate(std::ios::failbit);
+        m_plan.emplace_back(EntityType(header[0]), size_t(header[1]));
+        m_plan.back().line_thickness = thickness;
+    }
+    std::uint64_t vertices = 0;
+    in.read(reinterpret_cast<char*>(&vertices), sizeof(vertices));
+    if (in && vertices > remaining() / sizeof(cg::Vertex))
+        in.setstate(std::ios::failbit);
+    for (size_t i=0; in && i<m_plan.size(); ++i)
+        if (m_plan[i].start_idx > vertices || (i > 0 && m_plan[i].start_idx < m_plan[i-1].start_idx))
+            in.setstate(std::ios::failbit);
+    if (in) {
+        m_vertex_array.resize(size_t(vertices));
+        in.read(reinterpret_cast<char*>(m_vertex_array.data()), std::streamsize(vertices * sizeof(cg::Vertex)));
+    }
+    if (! in) {
+        clear();
+        return false;
+    }
+    return true;
+}
+
+
+
+void BatchToDraw::release()
+{
+    // Actually release previously allocated memory.
+    // If there are user batches, this is called from their destructor.
+
+    this->clear();
+    m_vertex_array.shrink_to_fit();
+    m_point_data.shrink_to_fit();
+    if (m_vbo_bytes != size_t(-1)) {
+        glDeleteVertexArrays(1, &m_vao);
+        glDeleteBuffers(1, &m_vbo);
+    }
+    m_vbo_bytes = size_t(-1);
+    if (m_points_vbo_bytes != size_t(-1)) {
+        glDeleteVertexArrays(1, &m_points_vao);
+        glDeleteBuffers(1, &m_points_vbo);
+    }
+    m_points_vbo_bytes = size_t(-1);
+    m_format = VertexFormat::Full;
+    if (m_palette_texture != 0)
+        glDeleteTextures(1, &m_palette_texture);
+    m_palette_texture = 0;
+    m_palette_size = 0;
+    if (m_transform_texture != 0)
+        glDeleteTextures(1, &m_transform_texture);
+    m_transform_texture = 0;
+    if (m_transform_vbo != 0)
+        glDeleteBuffers(1, &m_transform_vbo);
+    m_transform_vbo = 0;
+}
+
+
+
+void Mesh::set(const float* xy, size_t vertex_count, const unsigned int* indices,
+               size_t index_count, const float* values, const float* rgba)
+{
+    m_vertices.assign(vertex_count, cg::Vertex{{{1.f, 1.f, 1.f, 1.f}}, 0.f, 0.f, 0.f, 0.f});
+    m_indices.assign(indices, indices + index_count);
+    update(0, vertex_count, xy, values, rgba);
+}
+
+
+
+void Mesh::update(size_t first, size_t count, const float* xy, const float* values,
+                  const float* rgba)
+{
+    assert(first + count <= m_vertices.size());
+    for (size_t i=0; i<count; ++i) {
+        cg::Vertex& v = m_vertices[first+i];
+        if (xy) {
+            v.x = xy[2*i];
+            v.y = xy[2*i+1];
+        }
+        if (values)
+            v.s = values[i];
+        if (rgba)
+            v.color = {{rgba[4*i], rgba[4*i+1], rgba[4*i+2], rgba[4*i+3]}};
+    }
+
+    // Extend the dirty range, so next draw knows what to upload.
+    if (m_version == m_uploaded_version) {
+        m_dirty_begin = first;
+        m_dirty_end = first + count;
+    } else {
+        m_dirty_begin = std::min(m_dirty_begin, first);
+        m_dirty_end = std::max(m_dirty_end, first + count);
+    }
+    ++m_version;
+}
+
+
+
+void Mesh::draw()
+{
+    if (! m_allocated) {
+        glGenVertexArrays( 1, &m_vao );
+        glGenBuffers( 1, &m_vbo );
+        glGenBuffers( 1, &m_ebo );
+        glBindVertexArray( m_vao );
+        glBindBuffer( GL_ARRAY_BUFFER, m_vbo );
+        set_vertex_format(VertexFormat::Full);
+        glBufferData( GL_ARRAY_BUFFER, m_vertices.size()*sizeof(cg::Vertex), m_vertices.data(), GL_STATIC_DRAW );
+        glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, m_ebo ); // part of the VAO state
+        glBufferData( GL_ELEMENT_ARRAY_BUFFER, m_indices.size()*sizeof(GLuint), m_indices.data(), GL_STATIC_DRAW );
+        m_allocated = true;
+        m_uploaded_version = m_version;
+    }
+
+    glBindVertexArray( m_vao );
+
+    if (m_uploaded_version != m_version) {
+        glBindBuffer( GL_ARRAY_BUFFER, m_vbo );
+        glBufferSubData( GL_ARRAY_BUFFER, m_dirty_begin*sizeof(cg::Vertex),
+                         (m_dirty_end-m_dirty_begin)*sizeof(cg::Vertex), m_vertices.data() + m_dirty_begin );
+        m_uploaded_version = m_version;
+    }
+
+    // The orientation of user triangles is not known.
+    glDisable(GL_CULL_FACE);
+    glDrawElements(GL_TRIANGLES, GLsizei(m_indices.size()), GL_UNSIGNED_INT, nullptr);
+    glEnable(GL_CULL_FACE);
+}
+
+
+
+void Mesh::release()
+{
+    if (m_allocated) {
+        glDeleteVertexArrays(1, &m_vao);
+        glDeleteBuffers(1, &m_vbo);
+        glDeleteBuffers(1, &m_ebo);
+    }
+    m_allocated = false;
+}
+
+
+
+void begin_batch(const std::string& name)
+{
+    if (g_state.current_batch != &g_state.toplevel_batch) {
+        std::cerr << "cppgraphics: User batch cannot have another batch as a member!\n"
+                     "The application will now terminate.\n\n";
+        std::terminate();
+    }
+    g_state.current_batch = &g_state.user_batches[name];
+}
+
+
+
+void end_batch()
+{
+    if (g_state.current_batch == &g_state.toplevel_batch) {
+        std::cerr << "cppgraphics: end_batch called without previous call to "
+                     "begin_batch. The application will now terminate.\n\n";
+        std::terminate();
+    }
+    g_state.current_batch = &g_state.toplevel_batch;
+}
+
+
+
+static void set_current_transform(const std::array<double, 6>& m)
+{
+    g_state.transform = m;
+    g_state.transform_is_identity = m == std::array<double, 6>{{1., 0., 0., 1., 0., 0.}};
+    ++g_state.transform_version;
+
+    // Largest singular value of the linear part.
+    const double sum = m[0]*m[0] + m[1]*m[1] + m[2]*m[2] + m[3]*m[3];
+    const double det = m[0]*m[3] - m[1]*m[2];
+    g_state.transform_scale = std::sqrt((sum + std::sqrt(std::max(0., sum*sum - 4.*det*det))) / 2.);
+}
+
+
+
+// Multiply current transform by another one from the right, so it applies first.
+static void apply_transform(double a, double b, double c, double d, double e, double f)
+{
+    const std::array<double, 6>& m = g_state.transform;
+    set_current_transform({{m[0]*a + m[2]*b, m[1]*a + m[3]*b,
+                            m[0]*c + m[2]*d, m[1]*c + m[3]*d,
+                            m[0]*e + m[2]*f + m[4], m[1]*e + m[3]*f + m[5]}});
+}
+
+
+
+void push_transform()
+{
+    terminate_if_no_window(__FUNCTION__);
+    g_state.transform_stack.push_back(g_state.transform);
+}
+
+
+
+void pop_transform()
+{
+    terminate_if_no_window(__FUNCTION__);
+    if (g_state.transform_stack.empty()) {
+        std::cerr << "cppgraphics: pop_transform() called without matching push_transform(). "
+                     "The call is ignored.\n";
+        return;
+    }
+    set_current_transform(g_state.transform_stack.back());
+    g_state.transform_stack.pop_back();
+}
+
+
+
+void translate(double dx, double dy)
+{
+    terminate_if_no_window(__FUNCTION__);
+    apply_transform(1., 0., 0., 1., dx, dy);
+}
+
+
+
+void rotate(double angle)
+{
+    terminate_if_no_window(__FUNCTION__);
+    const double c = std::cos(angle);
+    const double s = std::sin(angle);
+    apply_transform(c, s, -s, c, 0., 0.);
+}
+
+
+
+void scale(double sx, double sy)
+{
+    terminate_if_no_window(__FUNCTION__);
+    apply_transform(sx, 0., 0., sy, 0., 0.);
+}
+
+
+
+void scale(double s)
+{
+    scale(s, s);
+}
+
+
+
+void reset_transform()
+{
+    terminate_if_no_window(__FUNCTION__);
+    set_current_transform({{1., 0., 0., 1., 0., 0.}});
+}
+
+
+
+void clear()
+{
+    terminate_if_no_window(__FUNCTION__);
+    g_state.current_batch->clear();
+
+    if (g_state.current_batch == &g_state.toplevel_batch) {
+        g_state.textures.clear_notify();
+        g_state.geometry.clear_notify();
+        g_state.text_layouts.clear_notify();
+        const bool gradient = g_state.fill_color[3] == -6.f || g_state.fill_color[3] == -7.f;
+        g_state.lookup_table.clear_notify(g_state.dash_row, gradient ? int(g_state.fill_color[0]) : -1);
+
+        // Grid textures keep a copy of the whole grid, those of pointers which
+        // are gone (a new buffer each frame) are released after a few frames.
+        // User batches may still draw a texture not uploaded for long.
+        for (auto it = g_state.grid_textures.begin(); it != g_state.grid_textures.end(); ) {
+            if (++it->second.clears_without_use > 10 && it->second.batches == 0) {
+                glDeleteTextures(1, &it->second.texture);
+                it = g_state.grid_textures.erase(it);
+            } else
+                ++it;
+        }
+
+        // Paint visible area with background color.
+        // Anything outside will be painted with 'inactive' color
+        // in render function.
+        double thickness = g_state.thickness;
+        cg::set_thickness(0.);
+        cg::Color fill_color = g_state.fill_color;
+        g_state.fill_color = g_state.background_color;
+        const std::array<double, 6> transform = g_state.transform;
+        set_current_transform({{1., 0., 0., 1., 0., 0.}});
+        cg::rectangle(0., 0., g_state.width, g_state.height);
+        set_current_transform(transform);
+        cg::set_thickness(thickness);
+        g_state.fill_color = fill_color;
+    }
+}
+
+
+
+static bool is_triangle_ccw(double x1, double y1, double x2, double y2, double x3, double y3)
+{
+    bool ccw = ((x2-x1)*(y3-y1)-(y2-y1)*(x3-x1)) < 0.;
+    return ccw;
+}
+
+
+
+// Internal function to draw a triangle without outline and using a given color.
+// The triangle is appended into a vertex array.
+// When no color is given, g_state.blend_colors are used. In that case,
+// flip_colors flag is used to render second triangle in a rectangle.
+static void triangle_internal(double x1, double y1, double x2, double y2, double x3, double y3,
+                              const cg::Color* const color1, const cg::Color* color2 = nullptr, const cg::Color* color3 = nullptr)
+{
+    // All triangles should now be ccw. Internal cppgraphics functions only pass ccw,
+    // anything from the user should be already reoriented by now.
+    assert( is_triangle_ccw(x1, y1, x2, y2, x3, y3));
+
+    if (! color2)
+        color2 = color1;
+    if (! color3)
+        color3 = color1;
+    g_state.current_batch->push_vertex(cg::Vertex{*color1, float(x1), float(y1), 0.f, 0.f});
+    g_state.current_batch->push_vertex(cg::Vertex{*color2, float(x2), float(y2), 0.f, 0.f});
+    g_state.current_batch->push_vertex(cg::Vertex{*color3, float(x3), float(y3), 0.f, 0.f});
+}
+
+
+
+// Draws a shape using GeometryCache. When the geometry is not cached yet,
+// generate is called to push it into current batch with origin at (0,0).
+// It is then saved and moved to where it belongs.
+template <class Generator>
+static void draw_cached(const GeometryCache::Key& key, double x, double y, Generator generate)
+{
+    BatchToDraw& batch = *g_state.current_batch;
+    if (const std::vector<cg::Vertex>* vertices = g_state.geometry.get(key)) {
+        batch.push_vertices(vertices->data(), vertices->size(), float(x), float(y));
+        return;
+    }
+    const size_t start_idx = batch.vertex_count();
+    generate();
+    g_state.geometry.add(key, batch.vertices_since(start_idx));
+    batch.translate_vertices_since(start_idx, float(x), float(y));
+}
+
+
+
+// Level of detail for curves of given radius (in canvas units). Returns
+// stride into the 192-gon, the coarsest one whose chord error in current
+// view is within g_state.curve_tolerance. At least a hexagon is used.
+static unsigned curve_stride(double r)
+{
+    struct Level {
+        unsigned stride;
+        double sagitta; // 1 - cos(pi/n), chord error of a unit n-gon
+    };
+    auto generate_levels = []() {
+        std::vector<Level> out;
+        for (unsigned stride : {32, 24, 16, 12, 8, 6, 4, 3, 2, 1})
+            out.push_back({stride, 1. - std::cos(3.141592653589793 * stride / 192.)});
+        return out;
+    };
+    static const std::vector<Level> levels = generate_levels();
+
+    const double r_pixels = std::abs(r) * pixels_per_unit();
+    for (const Level& level : levels)
+        if (r_pixels * level.sagitta <= g_state.curve_tolerance)
+            return level.stride;
+    return 1;
+}
+
+
+
+// Triangle fan from center over consecutive points (closing the loop when
+// closed is true). Points go in the same direction as in circle_internal.
+static void emit_fan(const std::vector<Point>& points, const Point& center, bool closed, const cg::Color& color)
+{
+    const size_t segments = closed ? points.size() : points.size() - 1;
+    cg::Vertex* out = g_state.current_batch->push_block(3 * segments);
+    for (size_t i=0; i<segments; ++i) {
+        const Point& prev = points[i];
+        const Point& next = points[(i+1) % points.size()];
+        *out++ = cg::Vertex{color, float(center[0]), float(center[1]), 0.f, 0.f};
+        *out++ = cg::Vertex{color, float(prev[0]), float(prev[1]), 0.f, 0.f};
+        *out++ = cg::Vertex{color, float(next[0]), float(next[1]), 0.f, 0.f};
+    }
+}
+
+
+
+// Band between outer and inner points, two triangles per segment.
+static void emit_ring(const std::vector<Point>& outer, const std::vector<Point>& inner, bool closed, const cg::Color& color)
+{
+    assert(outer.size() == inner.size());
+    const size_t segments = closed ? outer.size() : outer.size() - 1;
+    cg::Vertex* out = g_state.current_batch->push_block(6 * segments);
+    for (size_t i=0; i<segments; ++i) {
+        const size_t j = (i+1) % outer.size();
+        const cg::Vertex prev_in  {color, float(inner[i][0]), float(inner[i][1]), 0.f, 0.f};
+        const cg::Vertex prev_out {color, float(outer[i][0]), float(outer[i][1]), 0.f, 0.f};
+        const cg::Vertex next_in  {color, float(inner[j][0]), float(inner[j][1]), 0.f, 0.f};
+        const cg::Vertex next_out {color, float(outer[j][0]), float(outer[j][1]), 0.f, 0.f};
+        *out++ = prev_in;
+        *out++ = prev_out;
+        *out++ = next_in;
+        *out++ = prev_out;
+        *out++ = next_out;
+        *out++ = next_in;
+    }
+}
+
+
+
+// Move a convex closed outline (ordered as circle_internal draws it) inwards
+// by t. Each vertex moves along its miter, which only needs the normalized
+// edge vectors: for unit inward normals n1 and n2 of the adjacent edges,
+// the vertex moves by (n1 + n2) * t / (1 + n1.n2).
+static std::vector<Point> inset_convex(const std::vector<Point>& outline, double t)
+{
+    const size_t n = outline.size();
+    std::vector<Point> normals(n); // inward normal of edge i -> i+1
+    for (size_t i=0; i<n; ++i) {
+        const Point& a = outline[i];
+        const Point& b = outline[(i+1) % n];
+        const double len = std::hypot(b[0]-a[0], b[1]-a[1]);
+        normals[i] = len == 0. ? Point{{0., 0.}} : Point{{(b[1]-a[1]) / len, -(b[0]-a[0]) / len}};
+    }
+    std::vector<Point> out(n);
+    for (size_t i=0; i<n; ++i) {
+        const Point& n1 = normals[(i + n - 1) % n];
+        const Point& n2 = normals[i];
+        const double k = t / std::max(1e-9, 1. + n1[0]*n2[0] + n1[1]*n2[1]);
+        out[i] = {{outline[i][0] + (n1[0] + n2[0]) * k, outline[i][1] + (n1[1] + n2[1]) * k}};
+    }
+    return out;
+}
+
+
+
+// Stroke generator for lines and polylines, using current color, thickness,
+// line join, line cap and miter limit. The stroke is centered on the path.
+// Segments are quads between their two ends, joins fill the gap on the outer
+// side of each corner. The inner corners of adjacent segments meet in one
+// point, unless the segments are too short for that (then they overlap).
+// No trigonometric functions are evaluated, only normalized edge vectors
+// and precomputed rotations for round joins and caps.
+namespace stroke {
+
+// Left and right corner of a segment end (left = direction rotated by +90°).
+struct Ends {
+    Point left;
+    Point right;
+};
+
+inline Point add(const Point& a, const Point& v, double k) { return {{a[0] + k*v[0], a[1] + k*v[1]}}; }
+inline double cross(const Point& u, const Point& w) { return u[0]*w[1] - u[1]*w[0]; }
+inline Point left_normal(const Point& d) { return {{-d[1], d[0]}}; }
+
+
+
+// Strokes turn both ways, triangles are reoriented to be ccw (see is_triangle_ccw).
+static void triangle(std::vector<cg::Vertex>& out, const Point& a, const Point& b, const Point& c)
+{
+    const double orientation = (b[0]-a[0])*(c[1]-a[1]) - (b[1]-a[1])*(c[0]-a[0]);
+    if (orientation == 0.)
+        return;
+    const Point& second = orientation < 0. ? b : c;
+    const Point& third = orientation < 0. ? c : b;
+    out.push_back(cg::Vertex{g_state.color, float(a[0]), float(a[1]), 0.f, 0.f});
+    out.push_back(cg::Vertex{g_state.color, float(second[0]), float(second[1]), 0.f, 0.f});
+    out.push_back(cg::Vertex{g_state.color, float(third[0]), float(third[1]), 0.f, 0.f});
+}
+
+
+
+static void body(std::vector<cg::Vertex>& out, const Ends& start, const Ends& end)
+{
+    triangle(out, start.left, start.right, end.left);
+    triangle(out, start.right, end.right, end.left);
+}
+
+
+
+// Dashed lines (see set_dash) carry arc length in s and dash row + 1 in t.
+// Vertices from index 'from' on get base plus their distance from origin
+// along dir (zero dir means the same arc length for all, e.g. for joins).
+static void arc_length(std::vector<cg::Vertex>& out, size_t from, const Point& origin,
+                       const Point& dir, double base)
+{
+    if (g_state.dash_row < 0)
+        return;
+    for (size_t i=from; i<out.size(); ++i) {
+        out[i].s = float(base + (out[i].x - origin[0]) * dir[0] + (out[i].y - origin[1]) * dir[1]);
+        out[i].t = float(g_state.dash_row + 1);
+    }
+}
+
+
+
+static Ends butt(const Point& p, const Point& dir, double hw)
+{
+    const Point n = left_normal(dir);
+    return {add(p, n, hw), add(p, n, -hw)};
+}
+
+
+
+// Rotation (cos, sin) by one segment of a circle of radius r (see curve_stride)
+// and how many of those segments make a half turn.
+struct RotationStep {
+    Point rotation;
+    int half_steps;
+};
+
+static RotationStep rotation_step(double r)
+{
+    auto generate_steps = []() {
+        std::array<RotationStep, 33> out;
+        for (unsigned stride=1; stride<out.size(); ++stride)
+            out[stride] = {{{std::cos(3.141592653589793 * stride / 96.), std::sin(3.141592653589793 * stride / 96.)}},
+                           int(96 / stride)}; // every stride of curve_stride divides 96
+        return out;
+    };
+    static const std::array<RotationStep, 33> steps = generate_steps();
+    return steps[curve_stride(r)];
+}
+
+
+
+// Fan from apex over circular arc around center from vector 'from' to 'to'
+// (both of length hw), going ccw (dir = 1) or cw (dir = -1). When half_turn
+// is set, the arc is exactly a half circle (from and to are opposite).
+static void round(std::vector<cg::Vertex>& out, const Point& apex, const Point& center,
+                  const Point& from, const Point& to, double dir, double hw, bool half_turn)
+{
+    const RotationStep rotation = rotation_step(hw);
+    const Point& step = rotation.rotation;
+    const double s = dir * step[1];
+    const int half_steps = rotation.half_steps;
+    Point v = from;
+    for (int i=1; ; ++i) {
+        const Point next = {{v[0]*step[0] - v[1]*s, v[0]*s + v[1]*step[0]}};
+        if (half_turn ? i >= half_steps : cross(next, to) * dir <= 0.)
+            break;
+        triangle(out, apex, add(center, v, 1.), add(center, next, 1.));
+        v = next;
+    }
+    triangle(out, apex, add(center, v, 1.), add(center, to, 1.));
+}
+
+
+
+static void cap(std::vector<cg::Vertex>& out, const Point& p, const Point& dir, double hw, bool at_start)
+{
+    const Point n = left_normal(dir);
+    if (g_state.line_cap == cg::LineCapSquare) {
+        const Ends end = butt(p, dir, hw);
+        const Point ext = {{dir[0] * (at_start ? -hw : hw), dir[1] * (at_start ? -hw : hw)}};
+        body(out, end, {add(end.left, ext, 1.), add(end.right, ext, 1.)});
+    } else if (g_state.line_cap == cg::LineCapRound) {
+        // From one side around the end to the other, always counterclockwise.
+        const Point side = {{n[0] * (at_start ? hw : -hw), n[1] * (at_start ? hw : -hw)}};
+        round(out, p, p, side, {{-side[0], -side[1]}}, 1., hw, true);
+    }
+}
+
+
+
+// Join at p between segments with directions d1 and d2 (unit vectors)
+// and lengths len1 and len2. Emits the join and returns where the first
+// segment ends and where the second one starts.
+static std::pair<Ends, Ends> join(std::vector<cg::Vertex>& out, const Point& p,
+                                  const Point& d1, double len1, const Point& d2, double len2, double hw)
+{
+    const Point n1 = left_normal(d1);
+    const Point n2 = left_normal(d2);
+    const double turn = cross(d1, d2);
+    const double dot = d1[0]*d2[0] + d1[1]*d2[1];
+    if (std::abs(turn) < 1e-12 && dot > 0.) {
+        const Ends straight = butt(p, d1, hw);
+        return std::make_pair(straight, straight);
+    }
+
+    // Inner side is where the path turns to (left when turn > 0).
+    const double inner = turn > 0. ? 1. : -1.;
+    const Point o1 = add(p, n1, -inner * hw);
+    const Point o2 = add(p, n2, -inner * hw);
+
+    // Unit miter scaled so that hw * miter is the offset of the corner.
+    const double denom = 1. + n1[0]*n2[0] + n1[1]*n2[1];
+    const Point miter = {{(n1[0] + n2[0]) / std::max(denom, 1e-12), (n1[1] + n2[1]) / std::max(denom, 1e-12)}};
+    const double back = std::abs(miter[0]*d1[0] + miter[1]*d1[1]) * hw; // how far the inner corner reaches along the segments
+    const bool meet = denom > 1e-12 && back <= len1 && back <= len2;
+
+    const Point i1 = meet ? add(p, miter, inner * hw) : add(p, n1, inner * hw);
+    const Point i2 = meet ? add(p, miter, inner * hw) : add(p, n2, inner * hw);
+    const Point& apex = meet ? i1 : p;
+
+    if (g_state.line_join == cg::LineJoinRound) {
+        const Point from = {{o1[0] - p[0], o1[1] - p[1]}};
+        const Point to = {{o2[0] - p[0], o2[1] - p[1]}};
+        if (dot <= -1. + 1e-12) // U-turn, the side to go around is ambiguous
+            round(out, apex, p, from, to, -inner, hw, true);
+        else
+            round(out, apex, p, from, to, inner, hw, false);
+    } else {
+        // Miter length relative to line width, as in SVG: 1/sin(angle/2).
+        const double miter_ratio = std::sqrt(miter[0]*miter[0] + miter[1]*miter[1]);
+        if (g_state.line_join == cg::LineJoinMiter && denom > 1e-12 && miter_ratio <= g_state.miter_limit) {
+            const Point tip = add(p, miter, -inner * hw);
+            triangle(out, apex, o1, tip);
+            triangle(out, apex, tip, o2);
+        } else
+            triangle(out, apex, o1, o2);
+    }
+
+    const Ends end = inner > 0. ? Ends{i1, o1} : Ends{o1, i1};
+    const Ends start = inner > 0. ? Ends{i2, o2} : Ends{o2, i2};
+    return std::make_pair(end, start);
+}
+
+
+
+// Stroke of the whole polyline (a polygon when closed).
+static void polyline(std::vector<cg::Vertex>& out, const std::vector<Point>& path, bool closed)
+{
+    std::vector<Point> pts;
+    for (const Point& pt : path)
+        if (pts.empty() || pt != pts.back())
+            pts.push_back(pt);
+    while (closed && pts.size() > 1 && pts.front() == pts.back())
+        pts.pop_back();
+    if (pts.size() < 2)
+        return;
+
+    const double hw = g_state.thickness / 2.;
+    const size_t segments = closed ? pts.size() : pts.size() - 1;
+    std::vector<Point> dirs(segments);
+    std::vector<double> lens(segments);
+    for (size_t i=0; i<segments; ++i) {
+        const Point& a = pts[i];
+        const Point& b = pts[(i+1) % pts.size()];
+        lens[i] = std::hypot(b[0]-a[0], b[1]-a[1]);
+        dirs[i] = {{(b[0]-a[0]) / lens[i], (b[1]-a[1]) / lens[i]}};
+    }
+
+    Ends start;
+    Ends closing_end;
+    const Point no_dir = {{0., 0.}};
+    if (closed) {
+        const auto ends = join(out, pts[0], dirs.back(), lens.back(), dirs[0], lens[0], hw);
+        closing_end = ends.first;
+        start = ends.second;
+    } else {
+        start = butt(pts[0], dirs[0], hw);
+        cap(out, pts[0], dirs[0], hw, true);
+    }
+    arc_length(out, 0, pts[0], closed ? no_dir : dirs[0], 0.);
+
+    double length = 0.;
+    for (size_t i=0; i<segments; ++i) {
+        size_t from = out.size();
+        if (i+1 < segments) {
+            const auto ends = join(out, pts[i+1], dirs[i], lens[i], dirs[i+1], lens[i+1], hw);
+            arc_length(out, from, pts[i+1], no_dir, length + lens[i]);
+            from = out.size();
+            body(out, start, ends.first);
+            start = ends.second;
+        } else {
+            body(out, start, closed ? closing_end : butt(pts.back(), dirs[i], hw));
+            if (! closed)
+                cap(out, pts.back(), dirs.back(), hw, false);
+        }
+        arc_length(out, from, pts[i], dirs[i], length);
+        length += lens[i];
+    }
+}
+
+} // namespace stroke
+
+
+
+// Thin lines are drawn as GL lines, anything thicker than a pixel as a stroke.
+static bool is_hairline()
+{
+    return g_state.thickness * pixels_per_unit() <= 1.;
+}
+
+
+
+static void stroke_points(const std::vector<Point>& path, bool closed)
+{
+    if (is_hairline()) {
+        const float dash = float(g_state.dash_row + 1);
+        double length = 0.;
+        for (size_t i=0; i+1 < path.size() + (closed ? 1 : 0); ++i) {
+            const Point& a = path[i];
+            const Point& b = path[(i+1) % path.size()];
+            const double end = dash == 0.f ? 0. : length + std::hypot(b[0]-a[0], b[1]-a[1]);
+            g_state.current_batch->push_line_vertex(cg::Vertex{g_state.color, float(a[0]), float(a[1]), float(length), dash});
+            g_state.current_batch->push_line_vertex(cg::Vertex{g_state.color, float(b[0]), float(b[1]), float(end), dash});
+            length = end;
+        }
+        return;
+    }
+    std::vector<cg::Vertex> out;
+    stroke::polyline(out, path, closed);
+    if (! out.empty())
+        g_state.current_batch->push_vertices(out.data(), out.size(), 0.f, 0.f);
+}
+
+
+
+// Triangle with an outline, the vertices must be ccw.
+static void triangle_outlined_internal(double x1, double y1, double x2, double y2, double x3, double y3)
+{
+    const std::vector<Point> outer = {{{x1, y1}}, {{x2, y2}}, {{x3, y3}}};
+    const std::vector<Point> inner = inset_convex(outer, g_state.thickness);
+
+    // No inside is left when the inner triangle turned inside out.
+    if (! is_triangle_ccw(inner[0][0], inner[0][1], inner[1][0], inner[1][1], inner[2][0], inner[2][1])) {
+        triangle_internal(x1, y1, x2, y2, x3, y3, &g_state.color);
+        return;
+    }
+
+    // Outline is just the ring, so nothing is drawn twice...
+    emit_ring(outer, inner, true, g_state.color);
+
+    // ...and then the inside.
+    if (g_state.fill_color[3] != 0.)
+        triangle_internal(inner[0][0], inner[0][1], inner[1][0], inner[1][1],
+                          inner[2][0], inner[2][1], &g_state.fill_color);
+}
+
+
+
+void triangle(double x1, double y1, double x2, double y2, double x3, double y3)
+{
+    terminate_if_no_window(__FUNCTION__);
+
+    if (! is_triangle_ccw(x1, y1, x2, y2, x3, y3)) {
+        std::swap(x2, x3);
+        std::swap(y2, y3);
+    }
+
+    const double t = g_state.thickness;
+    const bool one_layer = t <= 0. || g_state.color == g_state.fill_color;
+
+    if (one_layer) {
+        // a simple triangle is enough
+        triangle_internal(x1, y1, x2, y2, x3, y3, &g_state.fill_color);
+    } else {
+        // If we got here, thickness is not zero. The outline is relatively
+        // expensive to calculate, so the result goes into the cache.
+        GeometryCache::Key key{GeometryCache::Kind::Triangle, {{x2-x1, y2-y1, x3-x1, y3-y1}},
+                               t, g_state.color, g_state.fill_color};
+        draw_cached(key, x1, y1, [&]() {
+            triangle_outlined_internal(0., 0., x2-x1, y2-y1, x3-x1, y3-y1);
+        });
+    }
+}
+
+
+
+void triangle_blend(double x1, double y1, double x2, double y2, double x3, double y3)
+{
+    terminate_if_no_window(__FUNCTION__);
+    const bool was_ccw = is_triangle_ccw(x1, y1, x2, y2, x3, y3);
+    if (! was_ccw) {
+        std::swap(x2, x3);
+        std::swap(y2, y3);
+    }
+    const auto& bc = g_state.blend_colors;
+    triangle_internal(x1, y1, x2, y2, x3, y3, &bc[0], &bc[was_ccw ? 1 : 2], &bc[was_ccw ? 2 : 1]);
+}
+
+
+
+// Rectangle with an outline which is not too thick.
+static void rectangle_outlined_internal(double x, double y, double a, double b)
+{
+    const double t = g_state.thickness;
+
+    // Same order of corners as circle_internal uses.
+    const std::vector<Point> outer = {{{x+a, y+b}}, {{x+a, y}}, {{x, y}}, {{x, y+b}}};
+    const std::vector<Point> inner = {{{x+a-t, y+b-t}}, {{x+a-t, y+t}}, {{x+t, y+t}}, {{x+t, y+b-t}}};
+    emit_ring(outer, inner, true, g_state.color);
+
+    // ...and then the inside.
+    if (g_state.fill_color[3] != 0.) {
+        triangle_internal(x+t, y+t, x+t, y+b-t, x+a-t, y+t, &g_state.fill_color);
+        triangle_internal(x+t, y+b-t, x+a-t, y+b-t, x+a-t, y+t, &g_state.fill_color);
+    }
+}
+
+
+
+void rectangle(double x, double y, double a, double b)
+{
+    terminate_if_no_window(__FUNCTION__);
+
+    const double t = g_state.thickness;
+    const bool too_thick = t > std::min(a,b)/2.;
+    const bool one_layer = t <= 0. || g_state.color == g_state.fill_color || too_thick;
+
+    if (one_layer) {
+        // two simple triangles are enough
+        triangle_internal(x, y, x, y+b, x+a, y, too_thick ? &g_state.color : &g_state.fill_color);
+        triangle_internal(x, y+b, x+a, y+b, x+a, y, too_thick ? &g_state.color : &g_state.fill_color);
+    } else {
+        // If we got here, thickness is not zero. Draw outline.
+        GeometryCache::Key key{GeometryCache::Kind::Rectangle, {{a, b, 0., 0.}},
+                               t, g_state.color, g_state.fill_color};
+        draw_cached(key, x, y, [&]() {
+            rectangle_outlined_internal(0., 0., a, b);
+        });
+    }
+}
+
+
+
+void rectangle_blend(double x, double y, double a, double b)
+{
+    terminate_if_no_window(__FUNCTION__);
+
+    triangle_internal(x, y, x, y+b, x+a, y, &g_state.blend_colors[0], &g_state.blend_colors[2], &g_state.blend_colors[1]);
+    triangle_internal(x, y+b, x+a, y+b, x+a, y, &g_state.blend_colors[2], &g_state.blend_colors[3], &g_state.blend_colors[1]);
+}
+
+
+
+// Unit circle vertices for one level of detail, laid out as triangles
+// exactly as circle_internal emits them. Circles are then generated by
+// scaling and translating the whole block, without any trigonometry
+// or per-triangle bookkeeping.
+struct CircleTemplate {
+    std::vector<UnitVertex> fan;  // center + two rim vertices per segment
+    std::vector<UnitVertex> ring; // two triangles per segment
+
+    explicit CircleTemplate(unsigned stride);
+};
+
+
+
+CircleTemplate::CircleTemplate(unsigned stride)
+{
+    // Regular 192-gon, any n-gon where n divides 192 is generated by striding.
+    // Clockwise, so that the triangles end up ccw in y-down coordinates.
+    std::vector<std::array<double, 2>> gon;
+    for (int i=192; i>=0; --i) {
+        double angle = i * (3.141592/96.);
+        gon.push_back({{std::cos(angle), std::sin(angle)}});
+    }
+
+    for (unsigned i=stride; i<gon.size(); i += stride) {
+        const UnitVertex prev_in  = {float(gon[i-stride][0]), float(gon[i-stride][1]), 0.f, 0.f};
+        const UnitVertex prev_out = {prev_in.x, prev_in.y, 1.f, 0.f};
+        const UnitVertex next_in  = {float(gon[i][0]), float(gon[i][1]), 0.f, 0.f};
+        const UnitVertex next_out = {next_in.x, next_in.y, 1.f, 0.f};
+
+        fan.push_back({0.f, 0.f, 0.f, 0.f});
+        fan.push_back(prev_out);
+        fan.push_back(next_out);
+
+        ring.push_back(prev_in);
+        ring.push_back(prev_out);
+        ring.push_back(next_in);
+        ring.push_back(prev_out);
+        ring.push_back(next_out);
+        ring.push_back(next_in);
+    }
+}
+
+
+
+// Scale the template into a newly reserved block of the current batch.
+static void emit_circle_template(const std::vector<UnitVertex>& unit,
+                                 float x, float y, float r_inner, float r_outer, const cg::Color& color)
+{
+    cg::Vertex* out = g_state.current_batch->push_block(unit.size());
+    vertex_kernels().scale_unit_vertices(unit.data(), unit.size(), x, y, r_inner, r_outer, color, out);
+}
+
+
+
+// Circle approximated by a regular n-gon, where n = 192 / stride.
+static void circle_internal(double x, double y, double r, unsigned stride)
+{
+    // One template for each stride used by circle(), created on first use.
+    static std::array<std::unique_ptr<CircleTemplate>, 33> templates;
+    assert(stride < templates.size() && 192 % stride == 0);
+    if (! templates[stride])
+        templates[stride].reset(new CircleTemplate(stride));
+    const CircleTemplate& tmpl = *templates[stride];
+
+    const float r_inner = float(std::max(0., r-g_state.thickness));
+    const bool one_fan = g_state.thickness <= 0. || g_state.color == g_state.fill_color;
+
+    if (one_fan) {
+        // just one fan is enough
+        emit_circle_template(tmpl.fan, float(x), float(y), 0.f, float(r), g_state.fill_color);
+        return;
+    }
+
+    // If we got here, thickness is not zero.
+    // We must draw the outline (just the ring, nothing is drawn twice)...
+    emit_circle_template(tmpl.ring, float(x), float(y), r_inner, float(r), g_state.color);
+
+    // ...and then the inside.
+    if (g_state.fill_color[3] != 0.)
+        emit_circle_template(tmpl.fan, float(x), float(y), 0.f, r_inner, g_state.fill_color);
+}
+
+
+
+void set_line_join(int join)
+{
+    if (join != cg::LineJoinMiter && join != cg::LineJoinBevel && join != cg::LineJoinRound) {
+        std::cerr << "cppgraphics: Unknown line join " << join << ". The call is ignored.\n";
+        return;
+    }
+    g_state.line_join = join;
+}
+
+
+
+void set_line_cap(int cap)
+{
+    if (cap != cg::LineCapButt && cap != cg::LineCapSquare && cap != cg::LineCapRound) {
+        std::cerr << "cppgraphics: Unknown line cap " << cap << ". The call is ignored.\n";
+        return;
+    }
+    g_state.line_cap = cap;
+}
+
+
+
+void set_miter_limit(double limit)
+{
+    if (! (limit >= 1.)) {
+        std::cerr << "cppgraphics: Miter limit must be at least 1. The call is ignored.\n";
+        return;
+    }
+    g_state.miter_limit = limit;
+}
+
+
+
+void set_dash(const double* pattern, int count, double offset)
+{
+    terminate_if_no_window(__FUNCTION__);
+    if (! pattern || count <= 0) {
+        g_state.dash_row = -1;
+        return;
+    }
+    if (count > LookupTable::Width - 1) {
+        std::cerr << "cppgraphics: set_dash(): At most " << LookupTable::Width - 1 << " dash lengths are supported. "
+                     "The call is ignored.\n";
+        return;
+    }
+
+    // Odd number of lengths is repeated to get the same number of dashes and gaps.
+    std::vector<double> lengths(pattern, pattern + count);
+    if (count % 2 == 1 && 2*count <= LookupTable::Width - 1)
+        lengths.insert(lengths.end(), pattern, pattern + count);
+    double period = 0.;
+    for (double length : lengths) {
+        if (! (length >= 0.)) {
+            std::cerr << "cppgraphics: set_dash(): Dash lengths must not be negative. The call is ignored.\n";
+            return;
+        }
+        period += length;
+    }
+    if (period <= 0.) {
+        g_state.dash_row = -1;
+        return;
+    }
+
+    std::vector<float> texels(4 * LookupTable::Width);
+    texels[0] = float(period);
+    texels[1] = float(lengths.size());
+    texels[2] = float(std::fmod(offset, period) + (offset < 0. ? period : 0.));
+    double end = 0.;
+    for (size_t i=0; i<lengths.size(); ++i) {
+        end += lengths[i];
+        texels[4 * (i+1)] = float(end);
+    }
+    g_state.dash_row = g_state.lookup_table.row(texels);
+}
+
+
+
+void set_curve_tolerance(double pixels)
+{
+    if (! (pixels > 0.)) {
+        std::cerr << "cppgraphics: Curve tolerance must be positive. The call is ignored.\n";
+        return;
+    }
+    g_state.curve_tolerance = pixels;
+}
+
+
+
+void circle(double x, double y, double r)
+{
+    terminate_if_no_window(__FUNCTION__);
+
+    // Use as few segments as the circle needs in current view.
+    const unsigned stride = curve_stride(r);
+
+    GeometryCache::Key key{GeometryCache::Kind::Circle, {{r, double(stride), 0., 0.}},
+                           g_state.thickness, g_state.color, g_state.fill_color};
+    draw_cached(key, x, y, [&]() {
+        circle_internal(0., 0., r, stride);
+    });
+}
+
+
+
+// Common tessellation of closed curved shapes. The outline is given by outer
+// points, inner points are the same outline moved inwards by thickness.
+// The inside must be fillable by a fan from center (and inner_center).
+// Layering is the same as in circle_internal. When too_thick is set, there
+// is no inside left and the whole shape gets outline color.
+static void contour_internal(const std::vector<Point>& outer, const std::vector<Point>& inner,
+                             const Point& center, const Point& inner_center, bool too_thick)
+{
+    const bool one_fan = g_state.thickness <= 0. || g_state.color == g_state.fill_color || too_thick;
+
+    if (one_fan) {
+        emit_fan(outer, center, true, too_thick ? g_state.color : g_state.fill_color);
+        return;
+    }
+
+    // Outline first...
+    emit_ring(outer, inner, true, g_state.color);
+
+    // ...and then the inside.
+    if (g_state.fill_color[3] != 0.)
+        emit_fan(inner, inner_center, true, g_state.fill_color);
+}
+
+
+
+// Number of segments of an arc spanning given angle, so that it is as fine
+// as the 192/stride-gon (see curve_stride).
+static int arc_segments(double angle, unsigned stride)
+{
+    const double pi = 3.141592653589793;
+    return std::max(1, int(std::ceil(std::abs(angle) / (2.*pi) * (192. / stride) - 1e-9)));
+}
+
+
+
+// Append points of an elliptic arc, parametrized by angle going from 'from'
+// to 'to', split into given number of segments. Both end points are included.
+static void append_arc_points(std::vector<Point>& out, double cx, double cy, double rx, double ry,
+                              double from, double to, int segments)
+{
+    for (int i=0; i<=segments; ++i) {
+        const double angle = from + (to - from) * i / segments;
+        out.push_back({{cx + rx * std::cos(angle), cy + ry * std::sin(angle)}});
+    }
+}
+
+
+
+void ellipse(double x, double y, double a, double b)
+{
+    terminate_if_no_window(__FUNCTION__);
+    a = std::abs(a);
+    b = std::abs(b);
+
+    const unsigned stride = curve_stride(std::max(a, b));
+    GeometryCache::Key key{GeometryCache::Kind::Ellipse, {{a, b, double(stride), 0.}},
+                           g_state.thickness, g_state.color, g_state.fill_color};
+    draw_cached(key, x, y, [&]() {
+        // The inner outline is an ellipse with both semi-axes shorter by
+        // thickness. That is exact at the vertices, slightly thinner in
+        // between, and it never folds over itself like a true offset.
+        const double t = std::max(0., g_state.thickness);
+        const double pi = 3.141592653589793;
+        std::vector<Point> outer;
+        std::vector<Point> inner;
+        const int segments = arc_segments(2.*pi, stride);
+        append_arc_points(outer, 0., 0., a, b, 2.*pi, 0., segments);
+        append_arc_points(inner, 0., 0., std::max(0., a-t), std::max(0., b-t), 2.*pi, 0., segments);
+        outer.pop_back();
+        inner.pop_back();
+        contour_internal(outer, inner, {{0., 0.}}, {{0., 0.}}, t >= std::min(a, b));
+    });
+}
+
+
+
+void arc(double x, double y, double r, double angle_start, double angle_end)
+{
+    terminate_if_no_window(__FUNCTION__);
+    r = std::abs(r);
+    if (angle_end < angle_start)
+        std::swap(angle_start, angle_end);
+    const double pi = 3.141592653589793;
+    angle_end = std::min(angle_end, angle_start + 2.*pi);
+
+    const unsigned stride = curve_stride(r);
+    if (g_state.thickness <= 0.) {
+        // Zero thickness means a thin line, same as cg::line.
+        std::vector<Point> points;
+        append_arc_points(points, x, y, r, r, angle_end, angle_start, arc_segments(angle_end - angle_start, stride));
+        for (size_t i=1; i<points.size(); ++i)
+            line(points[i-1][0], points[i-1][1], points[i][0], points[i][1]);
+        return;
+    }
+
+    // Same band that circle would draw as its outline.
+    GeometryCache::Key key{GeometryCache::Kind::Arc, {{r, angle_start, angle_end, double(stride)}},
+                           g_state.thickness, g_state.color, g_state.fill_color};
+    draw_cached(key, x, y, [&]() {
+        std::vector<Point> outer;
+        std::vector<Point> inner;
+        const double r_inner = std::max(0., r - g_state.thickness);
+        const int segments = arc_segments(angle_end - angle_start, stride);
+        append_arc_points(outer, 0., 0., r, r, angle_end, angle_start, segments);
+        append_arc_points(inner, 0., 0., r_inner, r_inner, angle_end, angle_start, segments);
+        emit_ring(outer, inner, false, g_state.color);
+    });
+}
+
+
+
+void pie(double x, double y, double r, double angle_start, double angle_end)
+{
+    terminate_if_no_window(__FUNCTION__);
+    r = std::abs(r);
+    if (angle_end < angle_start)
+        std::swap(angle_start, angle_end);
+    const double pi = 3.141592653589793;
+    const double angle = angle_end - angle_start;
+    if (angle >= 2.*pi) {
+        circle(x, y, r);
+        return;
+    }
+
+    const unsigned stride = curve_stride(r);
+    GeometryCache::Key key{GeometryCache::Kind::Pie, {{r, angle_start, angle_end, double(stride)}},
+                           g_state.thickness, g_state.color, g_state.fill_color};
+    draw_cached(key, x, y, [&]() {
+        const double t = std::max(0., g_state.thickness);
+        // Radius of the largest circle inside the pie. No inside is left
+        // when the thickness is larger.
+        const double half_sin = std::sin(std::min(angle, pi) / 2.);
+        const double inscribed = r * half_sin / (1. + half_sin);
+
+        const bool too_thick = t >= inscribed;
+
+        // The inner outline is exact: arc of radius r-t ending where it meets
+        // the radii moved inwards by t, and the apex where those two meet.
+        // It has as many segments as the outer arc, so the points pair up.
+        const int segments = arc_segments(angle, stride);
+        const double r_inner = r - t;
+        const double delta = too_thick ? 0. : std::asin(t / r_inner);
+        const double mid = (angle_start + angle_end) / 2.;
+        const double apex = too_thick ? 0. : std::min(t / std::sin(angle / 2.), r_inner);
+
+        std::vector<Point> outer;
+        std::vector<Point> inner;
+        append_arc_points(outer, 0., 0., r, r, angle_end, angle_start, segments);
+        append_arc_points(inner, 0., 0., r_inner, r_inner, angle_end - delta, angle_start + delta, segments);
+        outer.push_back({{0., 0.}});
+        inner.push_back({{apex * std::cos(mid), apex * std::sin(mid)}});
+        contour_internal(outer, inner, outer.back(), inner.back(), too_thick);
+    });
+}
+
+
+
+void rounded_rectangle(double x, double y, double a, double b, double r)
+{
+    terminate_if_no_window(__FUNCTION__);
+    a = std::abs(a);
+    b = std::abs(b);
+    r = std::min(std::abs(r), std::min(a, b) / 2.);
+    if (r == 0.) {
+        rectangle(x, y, a, b);
+        return;
+    }
+
+    const unsigned stride = curve_stride(r);
+    GeometryCache::Key key{GeometryCache::Kind::RoundedRectangle, {{a, b, r, double(stride)}},
+                           g_state.thickness, g_state.color, g_state.fill_color};
+    draw_cached(key, x, y, [&]() {
+        const double t = std::max(0., g_state.thickness);
+        const double pi = 3.141592653589793;
+
+        // Corners in the same order as the circle is drawn. The inner outline
+        // has corners of radius r-t around the same centers, or sharp ones
+        // when the outline is thicker than the radius.
+        struct Corner {
+            double cx;
+            double cy;
+            double from;
+        };
+        const std::array<Corner, 4> corners = {{{a-r, r, 2.*pi},
+                                                {r, r, 1.5*pi},
+                                                {r, b-r, pi},
+                                                {a-r, b-r, 0.5*pi}}};
+        std::vector<Point> outer;
+        std::vector<Point> inner;
+        for (const Corner& c : corners) {
+            const size_t first = outer.size();
+            append_arc_points(outer, c.cx, c.cy, r, r, c.from, c.from - 0.5*pi, arc_segments(0.5*pi, stride));
+            const double mid = c.from - 0.25*pi;
+            for (size_t i=first; i<outer.size(); ++i) {
+                if (t <= r)
+                    inner.push_back({{c.cx + (outer[i][0]-c.cx) * (r-t)/r, c.cy + (outer[i][1]-c.cy) * (r-t)/r}});
+                else // sharp corner, (t-r)*sqrt(2) towards the center
+                    inner.push_back({{c.cx - (t-r) * std::sqrt(2.) * std::cos(mid), c.cy - (t-r) * std::sqrt(2.) * std::sin(mid)}});
+            }
+        }
+        const Point center = {{a/2., b/2.}};
+        contour_internal(outer, inner, center, center, t >= std::min(a, b) / 2.);
+    });
+}
+
+
+
+// Ear clipping triangulation of a simple polygon given by rings of points,
+// the first ring is the outline, others are holes. Returns indices into
+// points, three per triangle, all of them ccw (see is_triangle_ccw).
+// Holes are first connected to the outline by bridges, then ears are cut
+// off one by one. Self-intersecting input does not crash, but the result
+// may miss some parts.
+static std::vector<size_t> triangulate_polygon(const std::vector<Point>& points, const std::vector<size_t>& ring_sizes)
+{
+    auto cross = [&points](size_t a, size_t b, size_t c) {
+        const Point& pa = points[a];
+        const Point& pb = points[b];
+        const Point& pc = points[c];
+        return (pb[0]-pa[0])*(pc[1]-pa[1]) - (pb[1]-pa[1])*(pc[0]-pa[0]);
+    };
+    auto ring_area = [&points](const std::vector<size_t>& ring) {
+        double area = 0.;
+        for (size_t i=0; i<ring.size(); ++i) {
+            const Point& a = points[ring[i]];
+            const Point& b = points[ring[(i+1) % ring.size()]];
+            area += a[0]*b[1] - b[0]*a[1];
+        }
+        return area;
+    };
+
+    // Split into rings of indices. The outline must have negative area
+    // (so its ears are ccw), holes the opposite.
+    std::vector<std::vector<size_t>> rings;
+    size_t start = 0;
+    for (size_t ring_size : ring_sizes) {
+        std::vector<size_t> ring;
+        for (size_t i=start; i<start+ring_size; ++i)
+            if (ring.empty() || points[i] != points[ring.back()])
+                ring.push_back(i);
+        while (ring.size() > 1 && points[ring.front()] == points[ring.back()])
+            ring.pop_back();
+        start += ring_size;
+        if (ring.size() < 3) {
+            if (rings.empty())
+                return {};
+            continue;
+        }
+        if ((ring_area(ring) > 0.) == rings.empty())
+            std::reverse(ring.begin(), ring.end());
+        rings.push_back(std::move(ring));
+    }
+    if (rings.empty())
+        return {};
+
+    // Bridge the holes, rightmost first. A ray from the rightmost vertex
+    // of the hole towards +x hits the polygon built so far, the bridge goes
+    // to a vertex visible from the hole (as in the earcut algorithm).
+    std::vector<size_t> polygon = rings[0];
+    std::vector<std::pair<double, size_t>> holes; // max x and ring index
+    for (size_t r=1; r<rings.size(); ++r) {
+        double max_x = points[rings[r][0]][0];
+        for (size_t idx : rings[r])
+            max_x = std::max(max_x, points[idx][0]);
+        holes.emplace_back(max_x, r);
+    }
+    std::sort(holes.begin(), holes.end(), [](const std::pair<double, size_t>& a, const std::pair<double, size_t>& b) {
+        return a.first > b.first;
+    });
+    for (const auto& hole_info : holes) {
+        const std::vector<size_t>& hole = rings[hole_info.second];
+        size_t m = 0;
+        for (size_t i=1; i<hole.size(); ++i)
+            if (points[hole[i]][0] > points[hole[m]][0])
+                m = i;
+        const Point& pm = points[hole[m]];
+
+        // Closest edge hit by the ray and its endpoint with larger x.
+        double hit_x = std::numeric_limits<double>::infinity();
+        size_t bridge = size_t(-1);
+        for (size_t i=0; i<polygon.size(); ++i) {
+            const Point& a = points[polygon[i]];
+            const Point& b = points[polygon[(i+1) % polygon.size()]];
+            if ((a[1] <= pm[1]) == (b[1] <= pm[1]) && a[1] != pm[1])
+                continue;
+            const double x = a[1] == b[1] ? std::min(a[0], b[0]) : a[0] + (pm[1]-a[1]) * (b[0]-a[0]) / (b[1]-a[1]);
+            if (x >= pm[0] && x < hit_x) {
+                hit_x = x;
+                bridge = a[0] > b[0] ? i : (i+1) % polygon.size();
+            }
+        }
+        if (bridge == size_t(-1))
+            continue; // hole outside of the outline
+
+        // Another vertex may be in the way, so all vertices inside the
+        // triangle (hole vertex, hit point, bridge) are candidates. The one
+        // closest in angle to the ray wins. Vertices duplicated by previous
+        // bridges must be connected where the hole is inside their corner.
+        auto side = [](const Point& a, const Point& b, const Point& c) {
+            return (b[0]-a[0])*(c[1]-a[1]) - (b[1]-a[1])*(c[0]-a[0]);
+        };
+        auto locally_inside = [&](size_t i) {
+            const Point& pa = points[polygon[(i + polygon.size() - 1) % polygon.size()]];
+            const Point& p = points[polygon[i]];
+            const Point& pc = points[polygon[(i+1) % polygon.size()]];
+            return side(pa, p, pc) < 0. ? side(p, pm, pc) >= 0. && side(p, pa, pm) >= 0.
+                                        : side(p, pm, pa) < 0. || side(p, pc, pm) < 0.;
+        };
+        const Point pb = points[polygon[bridge]];
+        const Point hit = {{hit_x, pm[1]}};
+        double best_tan = std::numeric_limits<double>::infinity();
+        double best_x = 0.;
+        size_t best = size_t(-1);
+        for (size_t i=0; i<polygon.size(); ++i) {
+            const Point& p = points[polygon[i]];
+            if (p[0] < pm[0] || p == pm)
+                continue;
+            const double s1 = side(pm, hit, p);
+            const double s2 = side(hit, pb, p);
+            const double s3 = side(pb, pm, p);
+            const bool inside = (s1 >= 0. && s2 >= 0. && s3 >= 0.) || (s1 <= 0. && s2 <= 0. && s3 <= 0.);
+            if (! inside || ! locally_inside(i))
+                continue;
+            const double tan = std::abs(p[1]-pm[1]) / std::max(1e-300, p[0]-pm[0]);
+            if (tan < best_tan || (tan == best_tan && p[0] > best_x)) {
+                best_tan = tan;
+                best_x = p[0];
+                best = i;
+            }
+        }
+        if (best != size_t(-1))
+            bridge = best;
+
+        // Splice: ... bridge, hole from m all the way around, m, bridge ...
+        std::vector<size_t> merged(polygon.begin(), polygon.begin() + bridge + 1);
+        for (size_t i=0; i<=hole.size(); ++i)
+            merged.push_back(hole[(m + i) % hole.size()]);
+        merged.insert(merged.end(), polygon.begin() + bridge, polygon.end());
+        polygon = std::move(merged);
+    }
+
+    // Ear clipping on a circular doubly linked list.
+    const size_t n = polygon.size();
+    std::vector<size_t> prev(n);
+    std::vector<size_t> next(n);
+    for (size_t i=0; i<n; ++i) {
+        prev[i] = (i + n - 1) % n;
+        next[i] = (i + 1) % n;
+    }
+
+    // Large polygons have the vertices also linked in z-order (Morton code of
+    // the position), so the ear test only visits the vertices whose code is
+    // in the range of the triangle's bounding box instead of all of them
+    // (as in the earcut algorithm). Small ones are faster without it.
+    const bool hashed = n > 80;
+    const size_t none = size_t(-1);
+    std::vector<std::uint32_t> z;
+    std::vector<size_t> prev_z;
+    std::vector<size_t> next_z;
+    double origin_x = 0.;
+    double origin_y = 0.;
+    double z_scale = 0.;
+    auto z_order = [&](double x, double y) {
+        auto spread = [](std::uint32_t v) { // 0..32767 to every other bit
+            v = (v | (v << 8)) & 0x00FF00FF;
+            v = (v | (v << 4)) & 0x0F0F0F0F;
+            v = (v | (v << 2)) & 0x33333333;
+            return (v | (v << 1)) & 0x55555555;
+        };
+        return spread(std::uint32_t((x - origin_x) * z_scale)) | (spread(std::uint32_t((y - origin_y) * z_scale)) << 1);
+    };
+    if (hashed) {
+        double max_x = points[polygon[0]][0];
+        double max_y = points[polygon[0]][1];
+        origin_x = max_x;
+        origin_y = max_y;
+        for (size_t idx : polygon) {
+            origin_x = std::min(origin_x, points[idx][0]);
+            origin_y = std::min(origin_y, points[idx][1]);
+            max_x = std::max(max_x, points[idx][0]);
+            max_y = std::max(max_y, points[idx][1]);
+        }
+        const double extent = std::max(max_x - origin_x, max_y - origin_y);
+        z_scale = extent > 0. ? 32767. / extent : 0.;
+        z.resize(n);
+        for (size_t i=0; i<n; ++i)
+            z[i] = z_order(points[polygon[i]][0], points[polygon[i]][1]);
+        std::vector<size_t> order(n);
+        for (size_t i=0; i<n; ++i)
+            order[i] = i;
+        std::sort(order.begin(), order.end(), [&z](size_t a, size_t b) { return z[a] < z[b]; });
+        prev_z.assign(n, none);
+        next_z.assign(n, none);
+        for (size_t k=1; k<n; ++k) {
+            prev_z[order[k]] = order[k-1];
+            next_z[order[k-1]] = order[k];
+        }
+    }
+
+    auto is_ear = [&](size_t i) {
+        const size_t a = polygon[prev[i]];
+        const size_t b = polygon[i];
+        const size_t c = polygon[next[i]];
+        if (cross(a, b, c) >= 0.)
+            return false; // reflex or degenerate
+        const double min_x = std::min({points[a][0], points[b][0], points[c][0]});
+        const double max_x = std::max({points[a][0], points[b][0], points[c][0]});
+        const double min_y = std::min({points[a][1], points[b][1], points[c][1]});
+        const double max_y = std::max({points[a][1], points[b][1], points[c][1]});
+        auto inside = [&](size_t j) {
+            const Point& p = points[polygon[j]];
+            if (p[0] < min_x || p[0] > max_x || p[1] < min_y || p[1] > max_y)
+                return false;
+            if (p == points[a] || p == points[b] || p == points[c])
+                return false; // bridge duplicates
+            return cross(a, b, polygon[j]) <= 0. && cross(b, c, polygon[j]) <= 0. && cross(c, a, polygon[j]) <= 0.;
+        };
+        if (hashed) {
+            const std::uint32_t z_min = z_order(min_x, min_y);
+            const std::uint32_t z_max = z_order(max_x, max_y);
+            for (size_t j=next_z[i]; j!=none && z[j] <= z_max; j=next_z[j])
+                if (j != prev[i] && j != next[i] && inside(j))
+                    return false;
+            for (size_t j=prev_z[i]; j!=none && z[j] >= z_min; j=prev_z[j])
+                if (j != prev[i] && j != next[i] && inside(j))
+                    return false;
+            return true;
+        }
+        for (size_t j=next[next[i]]; j!=prev[i]; j=next[j])
+            if (inside(j))
+                return false;
+        return true;
+    };
+
+    std::vector<size_t> triangles;
+    triangles.reserve(3 * (n - 2));
+    size_t remaining = n;
+    size_t i = 0;
+    size_t tried = 0; // vertices checked since last cut
+    while (remaining > 3) {
+        const bool stuck = tried >= remaining;
+        if (stuck || is_ear(i)) {
+            // When nothing is an ear (the input self-intersects or is
+            // degenerate), cut the vertex anyway. Output triangles only
+            // if they are not inverted.
+            if (! stuck || cross(polygon[prev[i]], polygon[i], polygon[next[i]]) < 0.)
+                triangles.insert(triangles.end(), {polygon[prev[i]], polygon[i], polygon[next[i]]});
+            next[prev[i]] = next[i];
+            prev[next[i]] = prev[i];
+            if (hashed) {
+                if (prev_z[i] != none)
+                    next_z[prev_z[i]] = next_z[i];
+                if (next_z[i] != none)
+                    prev_z[next_z[i]] = prev_z[i];
+            }
+            --remaining;
+            tried = 0;
+            i = next[next[i]]; // going on past the next vertex gives less slivers
+        } else {
+            i = next[i];
+            ++tried;
+        }
+    }
+    if (cross(polygon[prev[i]], polygon[i], polygon[next[i]]) < 0.)
+        triangles.insert(triangles.end(), {polygon[prev[i]], polygon[i], polygon[next[i]]});
+    return triangles;
+}
+
+
+
+// Triangles (three points each, ccw) covering the area enclosed by closed
+// polylines under the nonzero or even-odd fill rule. Unlike triangulate_polygon,
+// the polylines may intersect themselves and each other and overlapping parts
+// are covered exactly once (translucent fills do not get darker there). The
+// plane is cut into horizontal slabs at every vertex and crossing of two edges.
+// Edges do not cross inside a slab, so the filled spans between them are
+// trapezoids; a trapezoid goes on into the next slab while the same two edges
+// bound it.
+static std::vector<Point> fill_polylines(const std::vector<std::vector<Point>>& polylines, bool even_odd)
+{
+    struct Edge {
+        Point top;    // end with smaller y
+        Point bottom;
+        int winding;  // +1 going down, -1 going up
+        double x_at(double y) const {
+            return top[0] + (y - top[1]) * (bottom[0] - top[0]) / (bottom[1] - top[1]);
+        }
+    };
+    std::vector<Edge> edges;
+    std::vector<double> ys;
+    for (const std::vector<Point>& polyline : polylines) {
+        if (polyline.size() < 3)
+            continue;
+        for (size_t i=0; i<polyline.size(); ++i) {
+            const Point& a = polyline[i];
+            const Point& b = polyline[(i+1) % polyline.size()];
+            ys.push_back(a[1]);
+            if (a[1] != b[1]) // horizontal edges do not change the winding
+                edges.push_back(a[1] < b[1] ? Edge{a, b, 1} : Edge{b, a, -1});
+        }
+    }
+    std::vector<Point> out;
+    if (edges.empty())
+        return out;
+    std::sort(ys.begin(), ys.end());
+    ys.erase(std::unique(ys.begin(), ys.end()), ys.end());
+    std::sort(edges.begin(), edges.end(), [](const Edge& a, const Edge& b) { return a.top[1] < b.top[1]; });
+    const double eps = 1e-9 * std::max(1., ys.back() - ys.front());
+
+    auto emit = [&out](const Edge& left, const Edge& right, double y0, double y1) {
+        const Point quad[4] = {{{left.x_at(y0), y0}}, {{right.x_at(y0), y0}},
+                               {{right.x_at(y1), y1}}, {{left.x_at(y1), y1}}};
+        for (const std::array<int, 3>& t : {std::array<int, 3>{{0, 1, 2}}, std::array<int, 3>{{0, 2, 3}}}) {
+            const Point& a = quad[t[0]];
+            const Point& b = quad[t[1]];
+            const Point& c = quad[t[2]];
+            const double orientation = (b[0]-a[0])*(c[1]-a[1]) - (b[1]-a[1])*(c[0]-a[0]);
+            if (orientation == 0.)
+                continue;
+            out.insert(out.end(), {a, orientation < 0. ? b : c, orientation < 0. ? c : b});
+        }
+    };
+
+    std::vector<size_t> active;
+    std::map<std::pair<size_t, size_t>, double> open; // bounding edges of a trapezoid -> its top
+    size_t next_edge = 0;
+    size_t next_y = 0;
+    double y0 = ys.front();
+    while (true) {
+        while (next_y < ys.size() && ys[next_y] <= y0)
+            ++next_y;
+        active.erase(std::remove_if(active.begin(), active.end(), [&](size_t e) { return edges[e].bottom[1] <= y0; }),
+                     active.end());
+        while (next_edge < edges.size() && edges[next_edge].top[1] <= y0)
+            active.push_back(next_edge++);
+        if (next_y == ys.size())
+            break;
+
+        // The slab ends at the next vertex or where two edges cross, whichever
+        // comes first. If two edges cross inside the slab, some two neighbours
+        // (in the order in the middle of it) cross there too.
+        double y1 = ys[next_y];
+        for (bool split = true; split; ) {
+            split = false;
+            const double mid = (y0 + y1) / 2.;
+            std::sort(active.begin(), active.end(), [&](size_t a, size_t b) { return edges[a].x_at(mid) < edges[b].x_at(mid); });
+            for (size_t k=0; k+1<active.size(); ++k) {
+                const Edge& a = edges[active[k]];
+                const Edge& b = edges[active[k+1]];
+                const double da = (a.bottom[0] - a.top[0]) / (a.bottom[1] - a.top[1]);
+                const double db = (b.bottom[0] - b.top[0]) / (b.bottom[1] - b.top[1]);
+                if (da == db)
+                    continue;
+                const double y = y0 + (b.x_at(y0) - a.x_at(y0)) / (da - db);
+                if (y > y0 + eps && y < y1 - eps) {
+                    y1 = y;
+                    split = true;
+                }
+            }
+        }
+
+        // Spans inside by the fill rule, trapezoids no longer bounded by the
+        // same edges are finished.
+        std::map<std::pair<size_t, size_t>, double> still_open;
+        int winding = 0;
+        for (size_t k=0; k+1<active.size(); ++k) {
+            winding += edges[active[k]].winding;
+            if (even_odd ? winding % 2 == 0 : winding == 0)
+                continue;
+            const std::pair<size_t, size_t> span(active[k], active[k+1]);
+            auto it = open.find(span);
+            still_open[span] = it == open.end() ? y0 : it->second;
+            if (it != open.end())
+                open.erase(it);
+        }
+        for (const auto& trapezoid : open)
+            emit(edges[trapezoid.first.first], edges[trapezoid.first.second], trapezoid.second, y0);
+        open.swap(still_open);
+        y0 = y1;
+    }
+    for (const auto& trapezoid : open)
+        emit(edges[trapezoid.first.first], edges[trapezoid.first.second], trapezoid.second, y0);
+    return out;
+}
+
+
+
+void polygon_with_holes(const double* xy, const size_t* ring_sizes, size_t ring_count)
+{
+    terminate_if_no_window(__FUNCTION__);
+
+    size_t n = 0;
+    for (size_t r=0; r<ring_count; ++r)
+        n += ring_sizes[r];
+    if (n == 0)
+        return;
+
+    // The triangulation is expensive, so it is cached with the coordinates
+    // as a key. Same polygon drawn again is then only copied.
+    GeometryCache::Key key{GeometryCache::Kind::Polygon, {{double(ring_count), 0., 0., 0.}},
+                           0., g_state.fill_color, g_state.fill_color,
+                           std::vector<double>(xy, xy + 2*n)};
+    for (size_t r=0; r<ring_count; ++r)
+        key.points.push_back(double(ring_sizes[r]));
+
+    if (g_state.fill_color[3] != 0.) {
+        draw_cached(key, 0., 0., [&]() {
+            std::vector<Point> points(n);
+            for (size_t i=0; i<n; ++i)
+                points[i] = {{xy[2*i], xy[2*i+1]}};
+            const std::vector<size_t> triangles = triangulate_polygon(points, std::vector<size_t>(ring_sizes, ring_sizes + ring_count));
+            cg::Vertex* out = g_state.current_batch->push_block(triangles.size());
+            for (size_t idx : triangles)
+                *out++ = cg::Vertex{g_state.fill_color, float(points[idx][0]), float(points[idx][1]), 0.f, 0.f};
+        });
+    }
+
+    // Outline is stroked the same way as cg::line does it, centered on the edges.
+    if (g_state.thickness > 0.) {
+        size_t start = 0;
+        for (size_t r=0; r<ring_count; ++r) {
+            std::vector<Point> ring(ring_sizes[r]);
+            for (size_t i=0; i<ring_sizes[r]; ++i)
+                ring[i] = {{xy[2*(start+i)], xy[2*(start+i)+1]}};
+            stroke_points(ring, true);
+            start += ring_sizes[r];
+        }
+    }
+}
+
+
+
+void polygon(const double* xy, size_t n)
+{
+    polygon_with_holes(xy, &n, 1);
+}
+
+
+
+void points(const float* x, const float* y, size_t n, double size, const float* rgba)
+{
+    terminate_if_no_window(__FUNCTION__);
+    if (! x || ! y || size <= 0.) {
+        std::cerr << "cppgraphics: points(): Invalid coordinates or size. The call is ignored.\n";
+        return;
+    }
+    if (n == 0 || (! rgba && g_state.color[3] == 0.))
+        return;
+    g_state.current_batch->push_points(x, y, n, size, rgba, g_state.color);
+}
+
+
+
+void line(double x1, double y1, double x2, double y2)
+{
+    terminate_if_no_window(__FUNCTION__);
+    stroke_points({{{x1, y1}}, {{x2, y2}}}, false);
+}
+
+
+
+// Number of segments a Bezier curve is flattened into, so that it is not
+// farther than tol from the real curve (Wang's formula). dd is the largest
+// second difference of the control points, degree is 2 or 3.
+static int bezier_segments(double dd, int degree, double tol)
+{
+    const double n = std::sqrt(degree * (degree - 1) / 8. * dd / tol);
+    return std::max(1, std::min(1000, int(std::ceil(n))));
+}
+
+
+
+// Flatten recorded path commands into polylines (one per subpath), curves
+// are split uniformly by bezier_segments.
+static void flatten_path(const std::vector<double>& commands, double tol,
+                         std::vector<std::vector<Point>>& polylines, std::vector<bool>& closed)
+{
+    Point current = {{0., 0.}};
+    auto second_difference = [](const Point& a, const Point& b, const Point& c) {
+        return std::hypot(a[0] - 2.*b[0] + c[0], a[1] - 2.*b[1] + c[1]);
+    };
+    auto start_if_needed = [&]() {
+        if (polylines.empty() || closed.back()) {
+            polylines.push_back({current});
+            closed.push_back(false);
+        }
+    };
+
+    for (size_t i=0; i<commands.size(); ) {
+        const PathCommand command = PathCommand(int(commands[i]));
+        const double* c = &commands[i+1];
+        if (command == PathCommand::Move) {
+            current = {{c[0], c[1]}};
+            polylines.push_back({current});
+            closed.push_back(false);
+            i += 3;
+        } else if (command == PathCommand::Line) {
+            start_if_needed();
+            current = {{c[0], c[1]}};
+            polylines.back().push_back(current);
+            i += 3;
+        } else if (command == PathCommand::Quad) {
+            start_if_needed();
+            const Point p0 = current;
+            const Point p1 = {{c[0], c[1]}};
+            const Point p2 = {{c[2], c[3]}};
+            const int n = bezier_segments(second_difference(p0, p1, p2), 2, tol);
+            for (int k=1; k<=n; ++k) {
+                const double t = double(k) / n;
+                const double u = 1. - t;
+                polylines.back().push_back({{u*u*p0[0] + 2.*u*t*p1[0] + t*t*p2[0],
+                                             u*u*p0[1] + 2.*u*t*p1[1] + t*t*p2[1]}});
+            }
+            current = p2;
+            i += 5;
+        } else if (command == PathCommand::Cubic) {
+            start_if_needed();
+            const Point p0 = current;
+            const Point p1 = {{c[0], c[1]}};
+            const Point p2 = {{c[2], c[3]}};
+            const Point p3 = {{c[4], c[5]}};
+            const double dd = std::max(second_difference(p0, p1, p2), second_difference(p1, p2, p3));
+            const int n = bezier_segments(dd, 3, tol);
+            for (int k=1; k<=n; ++k) {
+                const double t = double(k) / n;
+                const double u = 1. - t;
+                const double b0 = u*u*u;
+                const double b1 = 3.*u*u*t;
+                const double b2 = 3.*u*t*t;
+                const double b3 = t*t*t;
+                polylines.back().push_back({{b0*p0[0] + b1*p1[0] + b2*p2[0] + b3*p3[0],
+                                             b0*p0[1] + b1*p1[1] + b2*p2[1] + b3*p3[1]}});
+            }
+            current = p3;
+            i += 7;
+        } else { // Close
+            if (! polylines.empty() && ! closed.back()) {
+                std::vector<Point>& polyline = polylines.back();
+                if (polyline.size() > 1 && polyline.back() == polyline.front())
+                    polyline.pop_back(); // closing edge is implied
+                closed.back() = true;
+                current = polyline.front();
+            }
+            i += 1;
+        }
+    }
+}
+
+
+
+void begin_path()
+{
+    terminate_if_no_window(__FUNCTION__);
+    g_state.path_recording = true;
+    g_state.path_commands.clear();
+    g_state.path_start = {{g_state.pencil_x, g_state.pencil_y}};
+}
+
+
+
+// Record a segment of the path. When no move_to came after begin_path,
+// the first segment starts at the pencil position, not at (0,0).
+static void record_path_segment(std::initializer_list<double> command)
+{
+    if (g_state.path_commands.empty())
+        g_state.path_commands.insert(g_state.path_commands.end(), {double(PathCommand::Move), g_state.pencil_x, g_state.pencil_y});
+    g_state.path_commands.insert(g_state.path_commands.end(), command);
+}
+
+
+
+void quad_to(double cx, double cy, double x, double y)
+{
+    terminate_if_no_window(__FUNCTION__);
+    if (g_state.path_recording) {
+        record_path_segment({double(PathCommand::Quad), cx, cy, x, y});
+        g_state.pencil_x = x;
+        g_state.pencil_y = y;
+        return;
+    }
+    // Outside of a path, the curve is drawn right away by line_to.
+    std::vector<std::vector<Point>> polylines;
+    std::vector<bool> closed;
+    flatten_path({double(PathCommand::Move), g_state.pencil_x, g_state.pencil_y,
+                  double(PathCommand::Quad), cx, cy, x, y},
+                 g_state.curve_tolerance / pixels_per_unit(), polylines, closed);
+    for (size_t i=1; i<polylines[0].size(); ++i)
+        line_to(polylines[0][i][0], polylines[0][i][1]);
+}
+
+
+
+void cubic_to(double c1x, double c1y, double c2x, double c2y, double x, double y)
+{
+    terminate_if_no_window(__FUNCTION__);
+    if (g_state.path_recording) {
+        record_path_segment({double(PathCommand::Cubic), c1x, c1y, c2x, c2y, x, y});
+        g_state.pencil_x = x;
+        g_state.pencil_y = y;
+        return;
+    }
+    std::vector<std::vector<Point>> polylines;
+    std::vector<bool> closed;
+    flatten_path({double(PathCommand::Move), g_state.pencil_x, g_state.pencil_y,
+                  double(PathCommand::Cubic), c1x, c1y, c2x, c2y, x, y},
+                 g_state.curve_tolerance / pixels_per_unit(), polylines, closed);
+    for (size_t i=1; i<polylines[0].size(); ++i)
+        line_to(polylines[0][i][0], polylines[0][i][1]);
+}
+
+
+
+void close_path()
+{
+    terminate_if_no_window(__FUNCTION__);
+    if (g_state.path_recording)
+        g_state.path_commands.push_back(double(PathCommand::Close));
+    else
+        line_to(g_state.path_start[0], g_state.path_start[1]);
+    g_state.pencil_x = g_state.path_start[0];
+    g_state.pencil_y = g_state.path_start[1];
+}
+
+
+
+void fill_path()
+{
+    terminate_if_no_window(__FUNCTION__);
+    g_state.path_recording = false;
+    if (g_state.path_commands.empty() || g_state.fill_color[3] == 0.)
+        return;
+
+    // Flattening depends on the view, so the tolerance is a part of the key.
+    const double tol = g_state.curve_tolerance / pixels_per_unit();
+    GeometryCache::Key key{GeometryCache::Kind::PathFill, {{tol, 0., 0., 0.}},
+                           0., g_state.fill_color, g_state.fill_color, g_state.path_commands};
+    draw_cached(key, 0., 0., [&]() {
+        std::vector<std::vector<Point>> polylines;
+        std::vector<bool> closed;
+        flatten_path(g_state.path_commands, tol, polylines, closed);
+        std::vector<Point> points;
+        std::vector<size_t> ring_sizes;
+        for (const std::vector<Point>& polyline : polylines) {
+            if (polyline.size() < 3)
+                continue;
+            points.insert(points.end(), polyline.begin(), polyline.end());
+            ring_sizes.push_back(polyline.size());
+        }
+        const std::vector<size_t> triangles = triangulate_polygon(points, ring_sizes);
+        cg::Vertex* out = g_state.current_batch->push_block(triangles.size());
+        for (size_t idx : triangles)
+            *out++ = cg::Vertex{g_state.fill_color, float(points[idx][0]), float(points[idx][1]), 0.f, 0.f};
+    });
+}
+
+
+
+void stroke_path()
+{
+    terminate_if_no_window(__FUNCTION__);
+    g_state.path_recording = false;
+    if (g_state.path_commands.empty() || g_state.thickness <= 0.)
+        return;
+
+    const double tol = g_state.curve_tolerance / pixels_per_unit();
+    auto stroke_all = [&]() {
+        std::vector<std::vector<Point>> polylines;
+        std::vector<bool> closed;
+        flatten_path(g_state.path_commands, tol, polylines, closed);
+        for (size_t i=0; i<polylines.size(); ++i)
+            stroke_points(polylines[i], closed[i]);
+    };
+    if (is_hairline()) {
+        stroke_all(); // GL lines, those are not cached
+        return;
+    }
+    GeometryCache::Key key{GeometryCache::Kind::PathStroke,
+                           {{tol, double(g_state.line_join), double(g_state.line_cap), g_state.miter_limit}},
+                           g_state.thickness, g_state.color, g_state.color, g_state.path_commands};
+    key.points.push_back(double(g_state.dash_row)); // the last value is always the dash pattern
+    draw_cached(key, 0., 0., stroke_all);
+}
+
+
+
+void move_to(double x, double y)
+{
+    terminate_if_no_window(__FUNCTION__);
+    g_state.pencil_x = x;
+    g_state.pencil_y = y;
+    g_state.path_start = {{x, y}};
+    if (g_state.path_recording)
+        g_state.path_commands.insert(g_state.path_commands.end(), {double(PathCommand::Move), x, y});
+}
+
+
+
+void line_to(double x, double y)
+{
+    terminate_if_no_window(__FUNCTION__);
+    if (g_state.path_recording) {
+        record_path_segment({double(PathCommand::Line), x, y});
+        g_state.pencil_x = x;
+        g_state.pencil_y = y;
+        return;
+    }
+    const Point from = {{g_state.pencil_x, g_state.pencil_y}};
+    const Point to = {{x, y}};
+    g_state.pencil_x = x;
+    g_state.pencil_y = y;
+    if (from == to)
+        return;
+
+    // When the last line_to drew the end of the same path and nothing else
+    // was drawn since, its end cap is removed and the segments are joined.
+    BatchToDraw& batch = *g_state.current_batch;
+    State::OpenPath& path = g_state.open_path;
+    const bool hairline = is_hairline();
+    const bool continues = path.batch == &batch && path.plan_size == batch.plan_size()
+                        && path.vertex_end == batch.vertex_count() && path.last == from
+                        && path.thickness == g_state.thickness && path.color == g_state.color
+                        && path.join == g_state.line_join && path.cap == g_state.line_cap
+                        && path.miter_limit == g_state.miter_limit && path.dash_row == g_state.dash_row
+                        && path.transform_version == g_state.transform_version && path.hairline == hairline;
+
+    const double len = std::hypot(to[0]-from[0], to[1]-from[1]);
+    const double length = continues ? path.length : 0.; // arc length at 'from'
+    if (hairline) {
+        // Lines have neither joins nor caps, only the dash pattern goes on
+        // where the last segment ended (see stroke_points).
+        const float dash = float(g_state.dash_row + 1);
+        batch.push_line_vertex(cg::Vertex{g_state.color, float(from[0]), float(from[1]), float(dash == 0.f ? 0. : length), dash});
+        batch.push_line_vertex(cg::Vertex{g_state.color, float(to[0]), float(to[1]), float(dash == 0.f ? 0. : length + len), dash});
+    } else {
+        const double hw = g_state.thickness / 2.;
+        const Point dir = {{(to[0]-from[0]) / len, (to[1]-from[1]) / len}};
+        std::vector<cg::Vertex> out;
+        stroke::Ends start;
+        size_t retract_from;
+
+        if (continues) {
+            // Redo the last segment, now ending with a join.
+            batch.truncate_vertices(path.retract_from);
+            const double prev_len = std::hypot(path.last[0]-path.prev[0], path.last[1]-path.prev[1]);
+            const Point prev_dir = {{(path.last[0]-path.prev[0]) / prev_len, (path.last[1]-path.prev[1]) / prev_len}};
+            const auto ends = stroke::join(out, from, prev_dir, prev_len, dir, len, hw);
+            stroke::arc_length(out, 0, from, {{0., 0.}}, length);
+            const size_t body_from = out.size();
+            stroke::body(out, {path.last_start[0], path.last_start[1]}, ends.first);
+            stroke::arc_length(out, body_from, path.prev, prev_dir, length - prev_len);
+            start = ends.second;
+            retract_from = path.retract_from + out.size();
+        } else {
+            start = stroke::butt(from, dir, hw);
+            stroke::cap(out, from, dir, hw, true);
+            retract_from = batch.vertex_count() + out.size();
+        }
+        const size_t segment_from = out.size();
+        stroke::body(out, start, stroke::butt(to, dir, hw));
+        stroke::cap(out, to, dir, hw, false);
+        stroke::arc_length(out, continues ? segment_from : 0, from, dir, length);
+        batch.push_vertices(out.data(), out.size(), 0.f, 0.f);
+
+        path.retract_from = retract_from;
+        path.prev = from;
+        path.last_start = {{start.left, start.right}};
+    }
+
+    path.batch = &batch;
+    path.plan_size = batch.plan_size();
+    path.vertex_end = batch.vertex_count();
+    path.last = to;
+    path.thickness = g_state.thickness;
+    path.color = g_state.color;
+    path.join = g_state.line_join;
+    path.cap = g_state.line_cap;
+    path.miter_limit = g_state.miter_limit;
+    path.dash_row = g_state.dash_row;
+    path.length = length + len;
+    path.transform_version = g_state.transform_version;
+    path.hairline = hairline;
+}
+
+
+
+bool TextureCache::add(const std::string& filename, const unsigned char* data, int width, int height)
+{
+    {
+        // This function is meant to add new textures, it should not be called
+        // for ones already in the map. The only case when the texture with this
+        // id is already loaded is when it was created from user-provided pixel
+        // data. In that case, the string starts with ImagePrefix. Check
+        // this precondition:
+        auto texture_it = m_data.find(filename);
+        assert(texture_it == m_data.end()
+            || (filename.size() > 1
+                 && filename[0] == TextureCache::ImagePrefix[0]
+                 && filename[1] == TextureCache::ImagePrefix[1])
+               );
+    
+        if (texture_it != m_data.end()) {
+            // In this case we are asked to regenerate the pixel data.
+            // Delete the old texture and remove it from the map.
+            glDeleteTextures(1, &texture_it->second.idx);
+            m_opaque.erase(texture_it->second.idx);
+            m_data.erase(texture_it);
+        }
+    }
+
+    // First create the texture.
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);	
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+    if (data) {
+        // Create the texture from provided pixel data.
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
+        if (all_opaque(data, width, height))
+            m_opaque.insert(texture);
+    }
+    else {
+        // We are creating a texture from an image. Load it using stb_image
+        // and fill in the texture.
+        int nrChannels;
+        unsigned char *im_data = stbi_load(filename.c_str(), &width, &height, &nrChannels, 4);
+        if (! im_data) {
+            glDeleteTextures(1, &texture);
+            return false;
+        }
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, im_data);
+        if (nrChannels == 3 || all_opaque(im_data, width, height))
+            m_opaque.insert(texture);
+        stbi_image_free(im_data);
+    }
+
+    // The texture is created. Save the id into our map so we can find it
+    // when needed again.
+    m_data.emplace(filename, TextureData{texture, width, height, -1});
+    return true;
+}
+
+
+
+bool TextureCache::all_opaque(const unsigned char* rgba, int width, int height)
+{
+    const size_t size = 4 * size_t(width) * size_t(height);
+    for (size_t i=3; i<size; i+=4)
+        if (rgba[i] != 255)
+            return false;
+    return true;
+}
+
+
+
+bool TextureCache::get(const std::string& filename, GLuint& idx, int& width, int& height)
+{
+    auto it = m_data.find(filename);
+    if (it == m_data.end())
+        return false;
+    width = it->second.width;
+    height = it->second.height;
+    idx = it->second.idx;
+    it->second.clears_without_use = -1;
+    return true;
+}
+
+
+
+void TextureCache::clear_notify()
+{
+    // Mark all cached textures as unused since last clear.
+    // Using a texture sets the number to -1, the texture
+    // is freed in TextureCache::garbage_collect.
+    for (auto& it : m_data)
+        ++it.second.clears_without_use;
+}
+
+
+
+void TextureCache::garbage_collect(int clears_not_used)
+{
+    std::vector<std::string> names;
+    for (const auto& name_and_data : m_data) {
+        if (name_and_data.second.clears_without_use > clears_not_used)
+            names.emplace_back(name_and_data.first);
+    }
+
+    for (const std::string& name : names) {
+        auto it = m_data.find(name);
+        assert(it != m_data.end());
+        glDeleteTextures(1, &it->second.idx);
+        m_opaque.erase(it->second.idx);
+        m_data.erase(it);
+    }
+}
+
+
+
+size_t GeometryCache::KeyHash::operator()(const Key& key) const
+{
+    size_t seed = std::hash<int>{}(int(key.kind));
+    auto combine = [&seed](float val) {
+        seed ^= std::hash<float>{}(val) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+    };
+    for (double val : key.size)
+        combine(float(val));
+    combine(float(key.thickness));
+    for (int i=0; i<4; ++i) {
+        combine(key.color[i]);
+        combine(key.fill_color[i]);
+    }
+    for (double val : key.points)
+        combine(float(val));
+    return seed;
+}
+
+
+
+const std::vector<cg::Vertex>* GeometryCache::get(const Key& key)
+{
+    auto it = m_data.find(key);
+    if (it == m_data.end()) {
+        ++m_misses;
+        return nullptr;
+    }
+    ++m_hits;
+    it->second.clears_without_use = -1;
+    return &it->second.vertices;
+}
+
+
+
+void GeometryCache::add(const Key& key, std::vector<cg::Vertex>&& vertices)
+{
+    const size_t bytes = vertices.size() * sizeof(cg::Vertex) + key.points.size() * sizeof(double);
+    if (m_bytes + bytes > m_capacity)
+        return; // garbage_collect will make some space later.
+    auto it = m_data.find(key);
+    if (it != m_data.end())
+        return;
+    m_data.emplace(key, GeometryData{std::move(vertices), -1});
+    m_bytes += bytes;
+}
+
+
+
+void GeometryCache::clear_notify()
+{
+    for (auto& it : m_data)
+        ++it.second.clears_without_use;
+}
+
+
+
+void GeometryCache::garbage_collect(int clears_not_used)
+{
+    for (auto it = m_data.begin(); it != m_data.end(); ) {
+        if (it->second.clears_without_use > clears_not_used) {
+            m_bytes -= it->second.vertices.size() * sizeof(cg::Vertex) + it->first.points.size() * sizeof(double);
+            it = m_data.erase(it);
+        } else
+            ++it;
+    }
+}
+
+
+
+void GeometryCache::set_capacity(size_t bytes)
+{
+    m_capacity = bytes;
+    if (m_bytes > m_capacity) {
+        m_data.clear();
+        m_bytes = 0;
+    }
+}
+
+
+
+// Decoding routines for the built-it font, function taken from Dear ImGui.
+// https://github.com/ocornut/imgui
+namespace {
+    extern const unsigned char s_built_in_font_data[54951]; // defined at the end of file
+    
+    int Decode85Byte(char c)
+    {
+        return c >= '\\' ? c-36 : c-35;
+    }
+
+    void Decode85(const unsigned char* src, unsigned char* dst)
+    {
+        while (*src)
+        {
+            unsigned int tmp = Decode85Byte(src[0]) + 85 * (Decode85Byte(src[1])
+                       + 85 * (Decode85Byte(src[2]) + 85 * (Decode85Byte(src[3])
+                       + 85 *  Decode85Byte(src[4]))));
+            dst[0] = ((tmp >> 0) & 0xFF);
+            dst[1] = ((tmp >> 8) & 0xFF);
+            dst[2] = ((tmp >> 16) & 0xFF);
+            dst[3] = ((tmp >> 24) & 0xFF);
+            src += 5;
+            dst += 4;
+        }
+    }
+} // anonymous namespace
+
+
+
+bool FontCache::add(const std::string& filename)
+{
+    assert(m_data.find(filename) == m_data.end());
+    auto it = m_data.insert(std::pair<std::string, FontData>(filename, FontData())).first;
+    stbtt_fontinfo& font = it->second.font_info;
+    std::vector<unsigned char>& data = it->second.font_data;
+
+    if (filename.empty()) {
+        data.resize(54951);
+        Decode85(s_built_in_font_data, data.data());
+    } else {
+        std::ifstream stream(filename, std::ios::in | std::ios::binary);
+        if (stream)
+            data = std::vector<unsigned char>((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+    }
+    if (data.empty() || ! stbtt_InitFont(&font, (unsigned char*)(data.data()), 0)) {
+        m_data.erase(it);
+        return false;
+    }
+    it->second.metrics = FontMetrics(&font, filename.empty());
+    return true;
+}
+
+
+
+const stbtt_fontinfo* FontCache::get(const std::string& filename) const
+{
+    auto it = m_data.find(filename);
+    if (it == m_data.end())
+        return nullptr;
+    return &it->second.font_info;
+}
+
+
+
+FontMetrics* FontCache::get_metrics(const std::string& filename)
+{
+    auto it = m_data.find(filename);
+    if (it == m_data.end())
+        return nullptr;
+    return &it->second.metrics;
+}
+
+
+
+FontMetrics::FontMetrics(const stbtt_fontinfo* font, bool ascii)
+    : ascii_only(ascii), m_font(font), m_latin(256), m_latin_known(256, false)
+{
+    stbtt_GetFontVMetrics(font, &ascent, &descent, &line_gap);
+
+    m_has_kerning = font->kern != 0 || font->gpos != 0;
+    if (font->kern != 0 && font->gpos == 0) {
+        std::vector<stbtt_kerningentry> table(size_t(stbtt_GetKerningTableLength(font)));
+        table.resize(size_t(stbtt_GetKerningTable(font, table.data(), int(table.size()))));
+        m_kerning.reserve(table.size());
+        for (const stbtt_kerningentry& entry : table)
+            if (entry.advance != 0)
+                m_kerning[uint32_t(entry.glyph1) << 16 | uint32_t(entry.glyph2)] = entry.advance;
+        m_kerning_complete = true;
+    }
+}
+
+
+
+FontMetrics::Glyph FontMetrics::lookup(int codepoint) const
+{
+    Glyph glyph;
+    glyph.index = stbtt_FindGlyphIndex(m_font, codepoint);
+    stbtt_GetGlyphHMetrics(m_font, glyph.index, &glyph.advance, &glyph.left_bearing);
+    if (! stbtt_GetGlyphBox(m_font, glyph.index, &glyph.box[0], &glyph.box[1], &glyph.box[2], &glyph.box[3]))
+        glyph.box = {{0, 0, 0, 0}};
+    return glyph;
+}
+
+
+
+int FontMetrics::kerning(int first, int second)
+{
+    if (! m_has_kerning)
+        return 0;
+    const uint32_t key = uint32_t(glyph(first).index) << 16 | uint32_t(glyph(second).index);
+    auto it = m_kerning.find(key);
+    if (it != m_kerning.end())
+        return it->second;
+    if (m_kerning_complete)
+        return 0;
+    const int advance = stbtt_GetGlyphKernAdvance(m_font, glyph(first).index, glyph(second).index);
+    m_kerning.emplace(key, advance);
+    return advance;
+}
+
+
+
+const FontMetrics::Glyph& FontMetrics::glyph(int codepoint)
+{
+    if (codepoint >= 0 && codepoint < 256) {
+        if (! m_latin_known[size_t(codepoint)]) {
+            m_latin[size_t(codepoint)] = lookup(codepoint);
+            m_latin_known[size_t(codepoint)] = true;
+        }
+        return m_latin[size_t(codepoint)];
+    }
+    auto it = m_other.find(codepoint);
+    if (it == m_other.end())
+        it = m_other.emplace(codepoint, lookup(codepoint)).first;
+    return it->second;
+}
+
+
+
+void FontCache::release_all()
+{
+    m_data.clear();
+}
+
+
+
+int GlyphAtlas::bucket(double pixels)
+{
+    static const int sizes[] = {8, 10, 12, 14, 16, 20, 24};
+    for (int size : sizes)
+        if (size >= pixels)
+            return size;
+    return 0; // larger text is drawn from the distance field
+}
+
+
+
+// Signed distance field of a glyph outline, sampled at pixel centers of the
+// given box (pixels at given scale, y down). The outline is flattened into
+// segments, a texel gets the distance to the nearest one, positive inside
+// (nonzero winding). The distance is stored so that 128 is on the outline and
+// SdfSpread pixels map to the rest of the byte range.
+static std::vector<unsigned char> glyph_distance_field(const stbtt_fontinfo* font, int codepoint, float scale,
+                                                      int x0, int y0, int w, int h)
+{
+    std::vector<std::array<float, 4>> segments;
+    stbtt_vertex* vertices = nullptr;
+    const int count = stbtt_GetGlyphShape(font, stbtt_FindGlyphIndex(font, codepoint), &vertices);
+    float px = 0.f;
+    float py = 0.f;
+    for (int i=0; i<count; ++i) {
+        const stbtt_vertex& v = vertices[i];
+        const float x = v.x * scale;
+        const float y = -v.y * scale;
+        if (v.type == STBTT_vline)
+            segments.push_back({{px, py, x, y}});
+        else if (v.type == STBTT_vcurve || v.type == STBTT_vcubic) {
+            const float cx = v.cx * scale;
+            const float cy = -v.cy * scale;
+            const float cx1 = v.cx1 * scale;
+            const float cy1 = -v.cy1 * scale;
+            // Enough pieces to stay within about a tenth of a pixel from the curve.
+            float bend = std::hypot(px - 2.f*cx + x, py - 2.f*cy + y);
+            if (v.type == STBTT_vcubic)
+                bend = 3.f * std::max(std::hypot(px - 2.f*cx + cx1, py - 2.f*cy + cy1),
+                                      std::hypot(cx - 2.f*cx1 + x, cy - 2.f*cy1 + y));
+            const int pieces = std::min(16, 1 + int(std::sqrt(bend * 2.5f)));
+            float qx = px;
+            float qy = py;
+            for (int k=1; k<=pieces; ++k) {
+                const float t = float(k) / pieces;
+                const float u = 1.f - t;
+                float rx, ry;
+                if (v.type == STBTT_vcurve) {
+                    rx = u*u*px + 2.f*u*t*cx + t*t*x;
+                    ry = u*u*py + 2.f*u*t*cy + t*t*y;
+                }
+                else {
+                    rx = u*u*u*px + 3.f*u*u*t*cx + 3.f*u*t*t*cx1 + t*t*t*x;
+                    ry = u*u*u*py + 3.f*u*u*t*cy + 3.f*u*t*t*cy1 + t*t*t*y;
+                }
+                segments.push_back({{qx, qy, rx, ry}});
+                qx = rx;
+                qy = ry;
+            }
+        }
+        px = x;
+        py = y;
+    }
+    stbtt_FreeShape(font, vertices);
+
+    std::vector<unsigned char> field(size_t(w) * size_t(h));
+    for (int j=0; j<h; ++j) {
+        const float y = y0 + j + 0.5f;
+        for (int i=0; i<w; ++i) {
+            const float x = x0 + i + 0.5f;
+            float nearest = float(GlyphAtlas::SdfSpread * GlyphAtlas::SdfSpread);
+            int winding = 0;
+            for (const auto& s : segments) {
+                const float dx = s[2] - s[0];
+                const float dy = s[3] - s[1];
+                const float cross = dx * (y - s[1]) - dy * (x - s[0]);
+                if (s[1] <= y && y < s[3] && cross > 0.f)
+                    ++winding;
+                else if (s[3] <= y && y < s[1] && cross < 0.f)
+                    --winding;
+                const float length = dx*dx + dy*dy;
+                float t = length > 0.f ? ((x - s[0]) * dx + (y - s[1]) * dy) / length : 0.f;
+                t = std::min(1.f, std::max(0.f, t));
+                const float ex = s[0] + t*dx - x;
+                const float ey = s[1] + t*dy - y;
+                nearest = std::min(nearest, ex*ex + ey*ey);
             }
+            const float distance = (winding != 0 ? 1.f : -1.f) * std::sqrt(nearest);
+            const float value = 0.5f + 0.5f * distance / GlyphAtlas::SdfSpread;
+            field[size_t(j) * w + i] = (unsigned char)(std::min(1.f, std::max(0.f, value)) * 255.f + 0.5f);
+        }
+    }
+    return field;
+}
+
+
+
+const GlyphAtlas::Glyph& GlyphAtlas::get(const stbtt_fontinfo* font, int codepoint, int size)
+{
+    auto it = m_glyphs.find(Key{font, codepoint, size});
+    if (it != m_glyphs.end())
+        return it->second;
+    Glyph& glyph = m_glyphs[Key{font, codepoint, size}];
+
+    const float scale = stbtt_ScaleForPixelHeight(font, float(raster_size(size)));
+    int x1, y1, x2, y2;
+    stbtt_GetCodepointBitmapBox(font, codepoint, scale, scale, &x1, &y1, &x2, &y2);
+    if (x2 <= x1 || y2 <= y1)
+        return glyph;
+    if (size == 0) { // the distance field fades out around the outline
+        x1 -= SdfSpread;
+        y1 -= SdfSpread;
+        x2 += SdfSpread;
+        y2 += SdfSpread;
+    }
+    const int w = x2 - x1;
+    const int h = y2 - y1;
+
+    // Each glyph has a pixel of empty border, so neighbors do not bleed in.
+    if (m_x + w + 2 > PageSize) {
+        m_x = 0;
+        m_y += m_row_height;
+        m_row_height = 0;
+    }
+    if (m_pages.empty() || m_y + h + 2 > PageSize) {
+        GLuint page;
+        glGenTextures(1, &page);
+        glBindTexture(GL_TEXTURE_2D, page);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        const std::vector<unsigned char> empty(size_t(PageSize) * PageSize, 0);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, PageSize, PageSize, 0, GL_RED, GL_UNSIGNED_BYTE, empty.data());
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        m_pages.push_back(page);
+        m_x = m_y = m_row_height = 0;
+    }
+
+    std::vector<unsigned char> bitmap(size_t(w) * size_t(h));
+    if (size == 0)
+        bitmap = glyph_distance_field(font, codepoint, scale, x1, y1, w, h);
+    else
+        stbtt_MakeCodepointBitmap(font, bitmap.data(), w, h, w, scale, scale, codepoint);
+    glBindTexture(GL_TEXTURE_2D, m_pages.back());
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, m_x + 1, m_y + 1, w, h, GL_RED, GL_UNSIGNED_BYTE, bitmap.data());
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+    glyph.texture = m_pages.back();
+    glyph.uv = {float(m_x) / PageSize, float(m_y) / PageSize, float(w + 2) / PageSize, float(h + 2) / PageSize};
+    glyph.box = {{float(x1 - 1), float(y1 - 1), float(x2 + 1), float(y2 + 1)}};
+    m_x += w + 2;
+    m_row_height = std::max(m_row_height, h + 2);
+    return glyph;
+}
+
+
+
+void GlyphAtlas::release_all()
+{
+    if (! m_pages.empty())
+        glDeleteTextures(GLsizei(m_pages.size()), m_pages.data());
+    m_pages.clear();
+    m_glyphs.clear();
+    m_x = m_y = m_row_height = 0;
+}
+
+
+
+size_t TextLayoutCache::KeyHash::operator()(const Key& key) const
+{
+    size_t seed = std::hash<std::string>{}(key.text);
+    auto combine = [&seed](size_t val) {
+        seed ^= val + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+    };
+    combine(std::hash<const void*>{}(key.font));
+    combine(size_t(key.raster));
+    for (double val : key.size)
+        combine(std::hash<double>{}(val));
+    combine(size_t(key.align) * 2 + (key.wrap ? 1 : 0));
+    return seed;
+}
+
+
+
+const std::vector<TextLayoutCache::PlacedGlyph>* TextLayoutCache::get(const Key& key)
+{
+    auto it = m_data.find(key);
+    if (it == m_data.end())
+        return nullptr;
+    it->second.clears_without_use = -1;
+    return &it->second.glyphs;
+}
+
+
+
+const std::vector<TextLayoutCache::PlacedGlyph>& TextLayoutCache::add(const Key& key, std::vector<PlacedGlyph>&& glyphs)
+{
+    LayoutData& data = m_data[key];
+    data.glyphs = std::move(glyphs);
+    data.clears_without_use = -1;
+    return data.glyphs;
+}
+
+
+
+void TextLayoutCache::clear_notify()
+{
+    for (auto& it : m_data)
+        ++it.second.clears_without_use;
+}
+
+
+
+void TextLayoutCache::garbage_collect(int clears_not_used)
+{
+    for (auto it = m_data.begin(); it != m_data.end(); ) {
+        if (it->second.clears_without_use > clears_not_used)
+            it = m_data.erase(it);
+        else
+            ++it;
+    }
+}
+
+
+
+bool image(const std::string& filename,
+           double x, double y, double width, double height,
+           int cut_x, int cut_y, int cut_width, int cut_height)
+{
+    terminate_if_no_window(__FUNCTION__);
+
+    int twidth  = 0;
+    int theight = 0;
+    GLuint texture_idx = 0;
+
+    if (! g_state.textures.get(filename, texture_idx, twidth, theight)) {
+        if (! g_state.textures.add(filename)) {
+            std::cerr << "cppgraphics: Unable to load image from file " << filename << "\n";
+            return false;
+        } else
+            g_state.textures.get(filename, texture_idx, twidth, theight);
+    }
+
+    // Now calculate which part of the texture should be shown.
+    cg::Rect<float> rect{0.f, 0.f, 1.f, 1.f};
+    if (cut_width != 0 || cut_height != 0)
+        rect = {float(cut_x)/twidth, float(cut_y)/theight,
+                float(cut_width)/twidth, float(cut_height)/theight};
+
+    if (width == 0.) // use width from the texture
+        width = rect.width * twidth;
+
+    if (height == 0.) // autoset height to maintain aspect ratio
+        height = width * (rect.height*theight/(rect.width*twidth));
+    
+    cg::Rect<float> canvas_rect{float(x), float(y), float(width), float(height)};
+
+    // And push into the list of things to render.
+    g_state.current_batch->push_image(texture_idx, rect, canvas_rect);
+    return true;
+}
+
+
+
+// Upload w*h grid of single channel values into a texture identified by
+// the pointer and return the texture. Only the rows which changed since the
+// last call are uploaded, values not changing at all are not uploaded at all.
+static GLuint upload_grid_texture(const void* values, int w, int h, size_t value_bytes,
+                                  GLint internal_format, GLenum format, GLenum type)
+{
+    const unsigned char* data = static_cast<const unsigned char*>(values);
+    const size_t row_bytes = size_t(w) * value_bytes;
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1); // rows need not be aligned
+    auto it = g_state.grid_textures.find(values);
+    if (it == g_state.grid_textures.end() || it->second.width != w || it->second.height != h
+     || it->second.internal_format != internal_format) {
+        if (it == g_state.grid_textures.end()) {
+            it = g_state.grid_textures.emplace(values, State::GridTexture()).first;
+            glGenTextures(1, &it->second.texture);
+            glBindTexture(GL_TEXTURE_2D, it->second.texture);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST); // float and integer
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST); // textures need not be filterable
+        } else
+            glBindTexture(GL_TEXTURE_2D, it->second.texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, internal_format, w, h, 0, format, type, values);
+        it->second.width = w;
+        it->second.height = h;
+        it->second.internal_format = internal_format;
+        it->second.data.assign(data, data + row_bytes * size_t(h));
+    } else {
+        std::vector<unsigned char>& old = it->second.data;
+        auto row_equal = [&](int row) {
+            return std::equal(data + row*row_bytes, data + (row+1)*row_bytes, old.data() + row*row_bytes);
+        };
+        int first = 0;
+        while (first < h && row_equal(first))
+            ++first;
+        if (first < h) {
+            int last = h - 1;
+            while (row_equal(last))
+                --last;
+            glBindTexture(GL_TEXTURE_2D, it->second.texture);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, first, w, last - first + 1, format, type, data + first*row_bytes);
+            std::copy(data + first*row_bytes, data + (last+1)*row_bytes, old.data() + first*row_bytes);
         }
     }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    it->second.clears_without_use = -1;
+    return it->second.texture;
 }
 
 
 
-void line(double x1, double y1, double x2, double y2)
+void heatmap(const float* values, int w, int h, double x, double y, double width, double height,
+             int colormap, double min, double max)
 {
     terminate_if_no_window(__FUNCTION__);
+    if (! values || w <= 0 || h <= 0) {
+        std::cerr << "cppgraphics: heatmap(): Invalid values or grid size. The call is ignored.\n";
+        return;
+    }
+    if (min == max) // the range would be empty
+        max = min + 1e-6 * std::max(1., std::abs(min));
 
-    g_state.current_batch->push_line_vertex(cg::Vertex{g_state.color, float(x1), float(y1), 0.f, 0.f});
-    g_state.current_batch->push_line_vertex(cg::Vertex{g_state.color, float(x2), float(y2), 0.f, 0.f});
+    const GLuint texture = upload_grid_texture(values, w, h, sizeof(float), GL_R32F, GL_RED, GL_FLOAT);
+    g_state.current_batch->push_heatmap(texture, get_colormap_texture(colormap), float(min), float(max),
+                                        {float(x), float(y), float(width), float(height)});
 }
 
 
 
-void move_to(double x, double y)
+bool tilemap(const unsigned short* tile_ids, int cols, int rows, const std::string& atlas,
+             int tile_width, int tile_height, double x, double y, double width, double height)
 {
     terminate_if_no_window(__FUNCTION__);
-    g_state.pencil_x = x;
-    g_state.pencil_y = y;
+    if (! tile_ids || cols <= 0 || rows <= 0 || tile_width <= 0 || tile_height <= 0) {
+        std::cerr << "cppgraphics: tilemap(): Invalid tiles or tile size. The call is ignored.\n";
+        return false;
+    }
+
+    int twidth  = 0;
+    int theight = 0;
+    GLuint texture_idx = 0;
+    if (! g_state.textures.get(atlas, texture_idx, twidth, theight)) {
+        if (! g_state.textures.add(atlas)) {
+            std::cerr << "cppgraphics: Unable to load image from file " << atlas << "\n";
+            return false;
+        } else
+            g_state.textures.get(atlas, texture_idx, twidth, theight);
+    }
+    const int atlas_cols = twidth / tile_width;
+    if (atlas_cols == 0 || theight < tile_height) {
+        std::cerr << "cppgraphics: tilemap(): Tiles are larger than the atlas " << atlas << ". The call is ignored.\n";
+        return false;
+    }
+
+    const GLuint tiles_texture = upload_grid_texture(tile_ids, cols, rows, sizeof(unsigned short),
+                                                     GL_R16UI, GL_RED_INTEGER, GL_UNSIGNED_SHORT);
+    if (width == 0.)
+        width = double(cols) * tile_width;
+    if (height == 0.)
+        height = width * (double(rows) * tile_height) / (double(cols) * tile_width);
+    g_state.current_batch->push_tilemap(texture_idx, tiles_texture, cols, rows, atlas_cols,
+                                        {{float(tile_width) / twidth, float(tile_height) / theight}},
+                                        {float(x), float(y), float(width), float(height)});
+    return true;
 }
 
 
 
-void line_to(double x, double y)
+void image(const unsigned char* data, int x, int y, int width, int height,
+           int source_width, int source_height, bool reload)
 {
     terminate_if_no_window(__FUNCTION__);
-    line(g_state.pencil_x, g_state.pencil_y, x, y);
-    move_to(x, y);
+
+    int twidth  = 0;
+    int theight = 0;
+    GLuint texture_idx = 0;
+
+    std::string hash = TextureCache::ImagePrefix
+                      + std::to_string(std::hash<const unsigned char*>{}(data));
+
+    if (reload || ! g_state.textures.get(hash, texture_idx, twidth, theight)) {
+        if (! g_state.textures.add(hash, data, source_width, source_height)) {
+            std::cerr << "cppgraphics: Unable to load image from pixels.\n";
+            return;
+        } else
+            g_state.textures.get(hash, texture_idx, twidth, theight);
+    }
+
+    cg::Rect<float> canvas_rect = {float(x), float(y), float(width), float(height)};
+    cg::Rect<float> rect = {0.f, 0.f, 1.f, 1.f};
+
+    // And push into the list of things to render.
+    g_state.current_batch->push_image(texture_idx, rect, canvas_rect);
 }
 
 
 
-bool TextureCache::add(const std::string& filename, const unsigned char* data, int width, int height)
+bool image(const std::string& filename, double x, double y)
 {
-    {
-        // This function is meant to add new textures, it should not be called
-        // for ones already in the map. The only case when the texture with this
-        // id is already loaded is when it was created from user-provided pixel
-        // data. In that case, the string starts with ImagePrefix. Check
-        // this precondition:
-        auto texture_it = m_data.find(filename);
-        assert(texture_it == m_data.end()
-            || (filename.size() > 1
-                 && filename[0] == TextureCache::ImagePrefix[0]
-                 && filename[1] == TextureCache::ImagePrefix[1])
-               );
-    
-        if (texture_it != m_data.end()) {
-            // In this case we are asked to regenerate the pixel data.
-            // Delete the old texture and remove it from the map.
-            glDeleteTextures(1, &texture_it->second.idx);
-            m_data.erase(texture_it);
-        }
+    return image(filename, x, y, 0., 0., 0, 0, 0, 0);
+}
+
+
+
+bool image(const std::string& filename, double x, double y, double width, double height)
+{
+    return image(filename, x, y, width, height, 0, 0, 0, 0);
+}
+
+
+
+void draw_batch(const std::string& name, double x, double y)
+{
+    auto it = g_state.user_batches.find(name);
+    if (it == g_state.user_batches.end()) {
+        std::cerr << "cppgraphics: draw_batch(): Batch '" << name << "' was not "
+                     "previously created. The call is ignored.\n";
+        return;
     }
 
-    // First create the texture.
-    GLuint texture;
-    glGenTextures(1, &texture);
-    glBindTexture(GL_TEXTURE_2D, texture);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);	
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    g_state.current_batch->push_batch(name, x, y);
+}
 
-    if (data) {
-        // Create the texture from provided pixel data.
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
+
+
+void set_batch_palette(const std::string& name, const double* rgba, int count)
+{
+    terminate_if_no_window(__FUNCTION__);
+    auto it = g_state.user_batches.find(name);
+    if (it == g_state.user_batches.end()) {
+        std::cerr << "cppgraphics: set_batch_palette(): Batch '" << name << "' was not "
+                     "previously created. The call is ignored.\n";
+        return;
     }
-    else if (filename.size()<2 || filename[0] != TextureCache::TextPrefix[0]
-                               || filename[1] != TextureCache::TextPrefix[1]) {
-        // We are creating a texture from an image. Load it using stb_image
-        // and fill in the texture.
-        int nrChannels;
-        unsigned char *im_data = stbi_load(filename.c_str(), &width, &height, &nrChannels, 4);
-        if (! im_data) {
-            glDeleteTextures(1, &texture);
-            return false;
-        }
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, im_data);
-        stbi_image_free(im_data);
-    } else {
-        // "filename" starting with TextPrefix actually means a text to render.
-        // The whole string is ":/(gibberish)|Text", where gibberish encodes
-        // colors, outline and styles.
+    if (! rgba || count <= 0 || count > 65536) {
+        std::cerr << "cppgraphics: set_batch_palette(): Invalid palette. The call is ignored.\n";
+        return;
+    }
+    std::vector<cg::Color> colors(static_cast<size_t>(count));
+    for (size_t i=0; i<colors.size(); ++i)
+        colors[i] = {{float(rgba[4*i]), float(rgba[4*i+1]), float(rgba[4*i+2]), float(rgba[4*i+3])}};
+    it->second.set_palette(colors);
+}
 
-        // First fast forward past the gibberish to the actual text:
-        const char* text = filename.c_str();
-        while (*text != 0 && *(text++) != '|');
 
-        if (*text == 0) {
-            // This can happen if caller passes TextPrefix as filename.
-            glDeleteTextures(1, &texture);
-            return false; 
-        }
 
-        const stbtt_fontinfo* font = g_state.current_font_ptr;
-        assert(font);
-        const cg::Color& fc = g_state.color;
-        SDL_Color color = { Uint8(255*fc[0]), Uint8(255*fc[1]), Uint8(255*fc[2]), Uint8(255*fc[3]) };        
-        
-        // Draw the text into the SDL_Surface. The function returns a raw
-        // pointer we are responsible for freeing.
-        SDL_Surface* fg_surface = draw_text(font, text, 72., color, width, height, true);
-        SDL_Surface* surface = fg_surface; // see the commented-out part.
-
-        // TODO_TEXTSTYLES (see function set_text_style)
-        //SDL_Surface* bg_surface = nullptr;
-        //TTF_SetFontOutline(font, 0);
-        //if (g_state.text_style & cg::Outlined) {
-        //    const int thickness = 1;
-        //    const cg::Color& bc = g_state.fill_color;
-        //    SDL_Color fill_color = { Uint8(255*bc[0]), Uint8(255*bc[1]), Uint8(255*bc[2]), Uint8(255*bc[3]) };
-        //    SDL_Rect rect = {thickness, thickness, int(fg_surface->w), int(fg_surface->h)};
-        //    SDL_SetSurfaceBlendMode(fg_surface, SDL_BLENDMODE_BLEND);
-        //    TTF_SetFontOutline(font, thickness);
-        //    bg_surface = TTF_RenderUTF8_Blended(font, text, fill_color);
-        //    SDL_BlitSurface(fg_surface, NULL, bg_surface, &rect);
-        //}
-        //SDL_Surface* surface = bg_surface ? bg_surface : fg_surface;
-        //SDL_FreeSurface(bg_surface ? fg_surface : bg_surface);
-
-        width = surface->w;
-        height = surface->h;
-
-        surface = SDL_ConvertSurfaceFormat(surface, SDL_PIXELFORMAT_RGBA32, 0);
+void draw_batch_tween(const std::string& name_a, const std::string& name_b, double t,
+                      double x, double y)
+{
+    auto it_a = g_state.user_batches.find(name_a);
+    auto it_b = g_state.user_batches.find(name_b);
+    if (it_a == g_state.user_batches.end() || it_b == g_state.user_batches.end()) {
+        std::cerr << "cppgraphics: draw_batch_tween(): Batch '"
+                  << (it_a == g_state.user_batches.end() ? name_a : name_b)
+                  << "' was not previously created. The call is ignored.\n";
+        return;
+    }
+    if (it_a->second.vertex_count() != it_b->second.vertex_count()) {
+        std::cerr << "cppgraphics: draw_batch_tween(): Batches '" << name_a << "' and '" << name_b
+                  << "' do not have the same number of vertices. The call is ignored.\n";
+        return;
+    }
+    it_a->second.set_tweened();
+    it_b->second.set_tweened();
+    if (t == 0.)
+        g_state.current_batch->push_batch(name_a, x, y);
+    else
+        g_state.current_batch->push_batch(name_a, x, y, name_b, float(t));
+}
 
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, surface->pixels);
 
-        SDL_FreeSurface(surface);
+
+void set_batch_quantization(const std::string& name, bool quantize)
+{
+    auto it = g_state.user_batches.find(name);
+    if (it == g_state.user_batches.end()) {
+        std::cerr << "cppgraphics: set_batch_quantization(): Batch '" << name << "' was not "
+                     "previously created. The call is ignored.\n";
+        return;
     }
+    it->second.set_quantization(quantize);
+}
 
-    // The texture is created. Save the id into our map so we can find it
-    // when needed again.
-    m_data.emplace(filename, TextureData{texture, width, height, -1});
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Vector assets (see load_vector). A small SVG reader: the file is split into
+// tags, groups pass their style and transform to the children and each shape
+// is converted into path commands (see PathCommand) in window coordinates,
+// which are then filled and stroked into the batch.
+
+namespace {
+
+struct SvgStyle {
+    cg::Color fill = {{0.f, 0.f, 0.f, 1.f}};
+    cg::Color stroke = {{0.f, 0.f, 0.f, 0.f}};
+    double fill_opacity = 1.;
+    double stroke_opacity = 1.;
+    double opacity = 1.;         // product of opacities of the element and its groups
+    double element_opacity = 1.; // opacity property of the element itself
+    double stroke_width = 1.;
+    int line_join = 0;
+    int line_cap = 0;
+    double miter_limit = 4.;
+    bool even_odd = false; // fill-rule, nonzero by default
+    std::array<double, 6> transform = {{1., 0., 0., 1., 0., 0.}};
+    bool hidden = false;
+};
+
+
+
+bool svg_space(char c)
+{
+    return c == ' ' || c == ',' || c == '\t' || c == '\n' || c == '\r';
+}
+
+
+
+// Read count numbers separated by whitespace and/or commas.
+bool svg_numbers(const char*& p, double* out, int count)
+{
+    for (int i=0; i<count; ++i) {
+        while (svg_space(*p))
+            ++p;
+        char* end = nullptr;
+        out[i] = std::strtod(p, &end);
+        if (end == p)
+            return false;
+        p = end;
+    }
     return true;
 }
 
 
 
-bool TextureCache::get(const std::string& filename, GLuint& idx, int& width, int& height)
+// Flags of arcs may be written without separators ("a1 1 0 011 1").
+bool svg_flag(const char*& p, bool& out)
 {
-    auto it = m_data.find(filename);
-    if (it == m_data.end())
+    while (svg_space(*p))
+        ++p;
+    if (*p != '0' && *p != '1')
         return false;
-    width = it->second.width;
-    height = it->second.height;
-    idx = it->second.idx;
-    it->second.clears_without_use = -1;
+    out = *p++ == '1';
     return true;
 }
 
 
 
-void TextureCache::clear_notify()
+std::array<double, 6> svg_multiply(const std::array<double, 6>& a, const std::array<double, 6>& b)
 {
-    // Mark all cached textures as unused since last clear.
-    // Using a texture sets the number to -1, the texture
-    // is freed in TextureCache::garbage_collect.
-    for (auto& it : m_data)
-        ++it.second.clears_without_use;
+    return {{a[0]*b[0] + a[2]*b[1], a[1]*b[0] + a[3]*b[1],
+             a[0]*b[2] + a[2]*b[3], a[1]*b[2] + a[3]*b[3],
+             a[0]*b[4] + a[2]*b[5] + a[4], a[1]*b[4] + a[3]*b[5] + a[5]}};
+}
+
+
+
+// Parse the transform attribute and apply it on top of m.
+std::array<double, 6> svg_transform(std::array<double, 6> m, const std::string& value)
+{
+    const double pi = 3.14159265358979323846;
+    const char* p = value.c_str();
+    while (true) {
+        while (svg_space(*p))
+            ++p;
+        const char* name = p;
+        while (*p && *p != '(')
+            ++p;
+        if (! *p)
+            break;
+        const std::string fn(name, p - name);
+        ++p;
+        double a[6] = {0., 0., 0., 0., 0., 0.};
+        int n = 0;
+        while (n < 6 && svg_numbers(p, a + n, 1))
+            ++n;
+        while (*p && *p != ')')
+            ++p;
+        if (*p)
+            ++p;
+        if (fn.find("matrix") != std::string::npos && n == 6)
+            m = svg_multiply(m, {{a[0], a[1], a[2], a[3], a[4], a[5]}});
+        else if (fn.find("translate") != std::string::npos && n >= 1)
+            m = svg_multiply(m, {{1., 0., 0., 1., a[0], a[1]}});
+        else if (fn.find("scale") != std::string::npos && n >= 1)
+            m = svg_multiply(m, {{a[0], 0., 0., n == 1 ? a[0] : a[1], 0., 0.}});
+        else if (fn.find("rotate") != std::string::npos && n >= 1) {
+            const double c = std::cos(a[0] * pi / 180.);
+            const double s = std::sin(a[0] * pi / 180.);
+            m = svg_multiply(m, {{1., 0., 0., 1., a[1], a[2]}});
+            m = svg_multiply(m, {{c, s, -s, c, 0., 0.}});
+            m = svg_multiply(m, {{1., 0., 0., 1., -a[1], -a[2]}});
+        }
+        else if (fn.find("skewX") != std::string::npos && n == 1)
+            m = svg_multiply(m, {{1., 0., std::tan(a[0] * pi / 180.), 1., 0., 0.}});
+        else if (fn.find("skewY") != std::string::npos && n == 1)
+            m = svg_multiply(m, {{1., std::tan(a[0] * pi / 180.), 0., 1., 0., 0.}});
+    }
+    return m;
+}
+
+
+
+// Colors as #rgb, #rrggbb, rgb(r, g, b) or one of the basic names. Anything
+// else (gradients and patterns referenced by url) is treated as none.
+cg::Color svg_color(const std::string& value)
+{
+    auto hex = [](char c) {
+        return c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : 0;
+    };
+    if (value.size() == 4 && value[0] == '#')
+        return {{hex(value[1]) / 15.f, hex(value[2]) / 15.f, hex(value[3]) / 15.f, 1.f}};
+    if (value.size() == 7 && value[0] == '#')
+        return {{(16 * hex(value[1]) + hex(value[2])) / 255.f, (16 * hex(value[3]) + hex(value[4])) / 255.f,
+                 (16 * hex(value[5]) + hex(value[6])) / 255.f, 1.f}};
+    if (value.compare(0, 4, "rgb(") == 0) {
+        const char* p = value.c_str() + 4;
+        cg::Color color = {{0.f, 0.f, 0.f, 1.f}};
+        for (int i=0; i<3; ++i) {
+            double v = 0.;
+            if (! svg_numbers(p, &v, 1))
+                break;
+            color[i] = float(std::min(1., std::max(0., *p == '%' ? v / 100. : v / 255.)));
+            if (*p == '%')
+                ++p;
+        }
+        return color;
+    }
+    static const std::pair<const char*, unsigned> names[] = {
+        {"black", 0x000000}, {"white", 0xffffff}, {"red", 0xff0000}, {"lime", 0x00ff00},
+        {"green", 0x008000}, {"blue", 0x0000ff}, {"yellow", 0xffff00}, {"cyan", 0x00ffff},
+        {"aqua", 0x00ffff}, {"magenta", 0xff00ff}, {"fuchsia", 0xff00ff}, {"gray", 0x808080},
+        {"grey", 0x808080}, {"silver", 0xc0c0c0}, {"maroon", 0x800000}, {"navy", 0x000080},
+        {"olive", 0x808000}, {"purple", 0x800080}, {"teal", 0x008080}, {"orange", 0xffa500},
+        {"currentColor", 0x000000}
+    };
+    for (const auto& name : names)
+        if (value == name.first)
+            return {{(name.second >> 16) / 255.f, ((name.second >> 8) & 0xff) / 255.f, (name.second & 0xff) / 255.f, 1.f}};
+    return {{0.f, 0.f, 0.f, 0.f}};
+}
+
+
+
+// Apply one presentation attribute (or property of the style attribute).
+void svg_property(SvgStyle& style, const std::string& name, const std::string& value)
+{
+    if (name == "fill")
+        style.fill = svg_color(value);
+    else if (name == "stroke")
+        style.stroke = svg_color(value);
+    else if (name == "stroke-width")
+        style.stroke_width = std::atof(value.c_str());
+    else if (name == "fill-opacity")
+        style.fill_opacity = std::atof(value.c_str());
+    else if (name == "stroke-opacity")
+        style.stroke_opacity = std::atof(value.c_str());
+    else if (name == "opacity")
+        style.element_opacity = std::atof(value.c_str());
+    else if (name == "stroke-linejoin")
+        style.line_join = value == "round" ? LineJoinRound : value == "bevel" ? LineJoinBevel : LineJoinMiter;
+    else if (name == "stroke-linecap")
+        style.line_cap = value == "round" ? LineCapRound : value == "square" ? LineCapSquare : LineCapButt;
+    else if (name == "stroke-miterlimit")
+        style.miter_limit = std::atof(value.c_str());
+    else if (name == "fill-rule")
+        style.even_odd = value == "evenodd";
+    else if ((name == "display" && value == "none") || (name == "visibility" && value == "hidden"))
+        style.hidden = true;
+}
+
+
+
+// Append an elliptical arc as cubic curves (endpoint parametrization as in
+// the SVG specification, angle in degrees).
+void svg_arc(std::vector<double>& out, double x1, double y1, double rx, double ry, double angle,
+             bool large, bool sweep, double x2, double y2)
+{
+    const double pi = 3.14159265358979323846;
+    if (x1 == x2 && y1 == y2)
+        return;
+    rx = std::abs(rx);
+    ry = std::abs(ry);
+    if (rx == 0. || ry == 0.) {
+        out.insert(out.end(), {double(PathCommand::Line), x2, y2});
+        return;
+    }
+    const double c = std::cos(angle * pi / 180.);
+    const double s = std::sin(angle * pi / 180.);
+    const double x1p =  c * (x1 - x2) / 2. + s * (y1 - y2) / 2.;
+    const double y1p = -s * (x1 - x2) / 2. + c * (y1 - y2) / 2.;
+    const double lambda = x1p*x1p / (rx*rx) + y1p*y1p / (ry*ry);
+    if (lambda > 1.) {
+        rx *= std::sqrt(lambda);
+        ry *= std::sqrt(lambda);
+    }
+    const double num = rx*rx*ry*ry - rx*rx*y1p*y1p - ry*ry*x1p*x1p;
+    const double den = rx*rx*y1p*y1p + ry*ry*x1p*x1p;
+    const double coef = (large != sweep ? 1. : -1.) * std::sqrt(std::max(0., num / den));
+    const double cxp =  coef * rx * y1p / ry;
+    const double cyp = -coef * ry * x1p / rx;
+    const double cx = c * cxp - s * cyp + (x1 + x2) / 2.;
+    const double cy = s * cxp + c * cyp + (y1 + y2) / 2.;
+    const double theta = std::atan2((y1p - cyp) / ry, (x1p - cxp) / rx);
+    double delta = std::atan2((-y1p - cyp) / ry, (-x1p - cxp) / rx) - theta;
+    if (! sweep && delta > 0.)
+        delta -= 2. * pi;
+    else if (sweep && delta < 0.)
+        delta += 2. * pi;
+
+    // At most a quarter of the ellipse per cubic.
+    const int segments = std::max(1, int(std::ceil(std::abs(delta) / (pi / 2.) - 1e-9)));
+    const double d = delta / segments;
+    const double k = 4. / 3. * std::tan(d / 4.);
+    auto point = [&](double t) {
+        return Point{{cx + rx * std::cos(t) * c - ry * std::sin(t) * s, cy + rx * std::cos(t) * s + ry * std::sin(t) * c}};
+    };
+    auto tangent = [&](double t) {
+        return Point{{-rx * std::sin(t) * c - ry * std::cos(t) * s, -rx * std::sin(t) * s + ry * std::cos(t) * c}};
+    };
+    for (int i=0; i<segments; ++i) {
+        const double t0 = theta + i * d;
+        const double t1 = t0 + d;
+        const Point p0 = point(t0), p1 = i + 1 == segments ? Point{{x2, y2}} : point(t1);
+        const Point d0 = tangent(t0), d1 = tangent(t1);
+        out.insert(out.end(), {double(PathCommand::Cubic), p0[0] + k * d0[0], p0[1] + k * d0[1],
+                               p1[0] - k * d1[0], p1[1] - k * d1[1], p1[0], p1[1]});
+    }
+}
+
+
+
+// Convert path data (the d attribute) into path commands. Parsing stops at the
+// first error, everything before it is kept (as the specification says).
+std::vector<double> svg_path(const char* p)
+{
+    std::vector<double> out;
+    char cmd = 0;
+    char previous = 0;                   // previous command, to reflect control points
+    double x = 0., y = 0.;               // current point
+    double start_x = 0., start_y = 0.;   // start of the subpath
+    double ctrl_x = 0., ctrl_y = 0.;     // last control point
+    double a[7];
+    while (true) {
+        while (svg_space(*p))
+            ++p;
+        if (! *p)
+            break;
+        if ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z'))
+            cmd = *p++;
+        else if (cmd == 0)
+            break;
+        const bool rel = cmd >= 'a';
+        const double ox = rel ? x : 0.;
+        const double oy = rel ? y : 0.;
+        const char upper = rel ? char(cmd - 'a' + 'A') : cmd;
+        bool reflect = false;
+        switch (upper) {
+        case 'M':
+            if (! svg_numbers(p, a, 2))
+                return out;
+            x = start_x = ox + a[0];
+            y = start_y = oy + a[1];
+            out.insert(out.end(), {double(PathCommand::Move), x, y});
+            cmd = rel ? 'l' : 'L'; // more coordinates are line segments
+            break;
+        case 'L':
+        case 'H':
+        case 'V':
+            if (! svg_numbers(p, a, upper == 'L' ? 2 : 1))
+                return out;
+            if (upper == 'L') {
+                x = ox + a[0];
+                y = oy + a[1];
+            } else if (upper == 'H')
+                x = ox + a[0];
+            else
+                y = oy + a[0];
+            out.insert(out.end(), {double(PathCommand::Line), x, y});
+            break;
+        case 'C':
+        case 'S':
+            if (! svg_numbers(p, a + (upper == 'C' ? 0 : 2), upper == 'C' ? 6 : 4))
+                return out;
+            if (upper == 'S') {
+                reflect = previous == 'C' || previous == 'S';
+                a[0] = (reflect ? 2. * x - ctrl_x : x) - ox;
+                a[1] = (reflect ? 2. * y - ctrl_y : y) - oy;
+            }
+            ctrl_x = ox + a[2];
+            ctrl_y = oy + a[3];
+            out.insert(out.end(), {double(PathCommand::Cubic), ox + a[0], oy + a[1], ctrl_x, ctrl_y, ox + a[4], oy + a[5]});
+            x = ox + a[4];
+            y = oy + a[5];
+            break;
+        case 'Q':
+        case 'T':
+            if (! svg_numbers(p, a + (upper == 'Q' ? 0 : 2), upper == 'Q' ? 4 : 2))
+                return out;
+            if (upper == 'T') {
+                reflect = previous == 'Q' || previous == 'T';
+                a[0] = (reflect ? 2. * x - ctrl_x : x) - ox;
+                a[1] = (reflect ? 2. * y - ctrl_y : y) - oy;
+            }
+            ctrl_x = ox + a[0];
+            ctrl_y = oy + a[1];
+            out.insert(out.end(), {double(PathCommand::Quad), ctrl_x, ctrl_y, ox + a[2], oy + a[3]});
+            x = ox + a[2];
+            y = oy + a[3];
+            break;
+        case 'A': {
+            bool large = false, sweep = false;
+            if (! svg_numbers(p, a, 3) || ! svg_flag(p, large) || ! svg_flag(p, sweep) || ! svg_numbers(p, a + 3, 2))
+                return out;
+            svg_arc(out, x, y, a[0], a[1], a[2], large, sweep, ox + a[3], oy + a[4]);
+            x = ox + a[3];
+            y = oy + a[4];
+            break;
+        }
+        case 'Z':
+            out.push_back(double(PathCommand::Close));
+            x = start_x;
+            y = start_y;
+            cmd = 0; // numbers cannot follow
+            break;
+        default:
+            return out;
+        }
+        previous = upper;
+    }
+    return out;
+}
+
+
+
+// Fill and stroke a shape given by path commands in its own coordinates.
+void svg_draw(std::vector<double> commands, const SvgStyle& style, double tol)
+{
+    const std::array<double, 6>& m = style.transform;
+    for (size_t i=0; i<commands.size(); ) {
+        const PathCommand cmd = PathCommand(int(commands[i]));
+        const size_t pairs = cmd == PathCommand::Close ? 0 : cmd == PathCommand::Quad ? 2 : cmd == PathCommand::Cubic ? 3 : 1;
+        for (size_t k=0; k<pairs; ++k) {
+            const double x = commands[i + 1 + 2*k];
+            const double y = commands[i + 2 + 2*k];
+            commands[i + 1 + 2*k] = m[0] * x + m[2] * y + m[4];
+            commands[i + 2 + 2*k] = m[1] * x + m[3] * y + m[5];
+        }
+        i += 1 + 2 * pairs;
+    }
+    std::vector<std::vector<Point>> polylines;
+    std::vector<bool> closed;
+    flatten_path(commands, tol, polylines, closed);
+
+    cg::Color fill = style.fill;
+    fill[3] *= float(style.fill_opacity * style.opacity);
+    if (fill[3] > 0.f) {
+        // Subpaths may overlap each other, the fill rule decides what is inside.
+        const std::vector<Point> triangles = fill_polylines(polylines, style.even_odd);
+        cg::Vertex* out = g_state.current_batch->push_block(triangles.size());
+        for (const Point& p : triangles)
+            *out++ = cg::Vertex{fill, float(p[0]), float(p[1]), 0.f, 0.f};
+    }
+
+    g_state.color = style.stroke;
+    g_state.color[3] *= float(style.stroke_opacity * style.opacity);
+    g_state.thickness = style.stroke_width * std::sqrt(std::abs(m[0] * m[3] - m[1] * m[2]));
+    g_state.line_join = style.line_join;
+    g_state.line_cap = style.line_cap;
+    g_state.miter_limit = style.miter_limit;
+    if (g_state.color[3] > 0.f && g_state.thickness > 0.)
+        for (size_t i=0; i<polylines.size(); ++i)
+            if (polylines[i].size() >= 2)
+                stroke_points(polylines[i], closed[i]);
+}
+
+
+
+// Draw the whole document into current batch. Returns false when it is not SVG.
+bool svg_document(const std::string& text, double tol)
+{
+    const double kappa = 0.5522847498; // cubic approximation of a quarter circle
+    std::vector<SvgStyle> styles(1);
+    bool found = false;
+    size_t pos = 0;
+    while ((pos = text.find('<', pos)) != std::string::npos) {
+        if (text.compare(pos, 4, "<!--") == 0) {
+            pos = text.find("-->", pos);
+            continue;
+        }
+        if (text.compare(pos, 9, "<![CDATA[") == 0) {
+            pos = text.find("]]>", pos);
+            continue;
+        }
+        if (pos + 1 < text.size() && (text[pos+1] == '?' || text[pos+1] == '!')) {
+            pos = text.find('>', pos);
+            continue;
+        }
+        if (pos + 1 < text.size() && text[pos+1] == '/') {
+            if (styles.size() > 1)
+                styles.pop_back();
+            pos = text.find('>', pos);
+            continue;
+        }
+
+        // Element name and attributes.
+        ++pos;
+        const size_t name_end = text.find_first_of(" \t\r\n/>", pos);
+        if (name_end == std::string::npos)
+            break;
+        std::string name = text.substr(pos, name_end - pos);
+        if (name.find(':') != std::string::npos)
+            name = name.substr(name.find(':') + 1); // svg:path
+        std::map<std::string, std::string> attributes;
+        pos = name_end;
+        bool self_closing = false;
+        while (pos < text.size() && text[pos] != '>') {
+            if (text[pos] == '/') {
+                self_closing = true;
+                ++pos;
+                continue;
+            }
+            if (svg_space(text[pos])) {
+                ++pos;
+                continue;
+            }
+            const size_t eq = text.find('=', pos);
+            const size_t quote = eq == std::string::npos ? eq : text.find_first_of("\"'", eq);
+            const size_t close = quote == std::string::npos ? quote : text.find(text[quote], quote + 1);
+            if (close == std::string::npos)
+                return found;
+            std::string key = text.substr(pos, eq - pos);
+            key.erase(key.find_last_not_of(" \t\r\n") + 1);
+            attributes[key] = text.substr(quote + 1, close - quote - 1);
+            pos = close + 1;
+        }
+
+        SvgStyle style = styles.back();
+        if (name == "svg" && attributes.count("viewBox")) {
+            double box[4] = {0., 0., 0., 0.};
+            const char* p = attributes["viewBox"].c_str();
+            if (svg_numbers(p, box, 4) && box[2] > 0. && box[3] > 0.) {
+                // The view box is fit into the size given by width and height (taken as
+                // pixels, percentages are ignored) and centered, unless the aspect ratio
+                // is not to be preserved.
+                auto length = [&](const char* key) {
+                    const std::string& value = attributes[key];
+                    return value.find('%') == std::string::npos ? std::atof(value.c_str()) : 0.;
+                };
+                double width = length("width");
+                double height = length("height");
+                if (width <= 0.)
+                    width = height > 0. ? box[2] * height / box[3] : box[2];
+                if (height <= 0.)
+                    height = box[3] * width / box[2];
+                double sx = width / box[2];
+                double sy = height / box[3];
+                double tx = 0.;
+                double ty = 0.;
+                if (attributes["preserveAspectRatio"].find("none") == std::string::npos) {
+                    sx = sy = std::min(sx, sy);
+                    tx = (width - box[2] * sx) / 2.;
+                    ty = (height - box[3] * sy) / 2.;
+                }
+                style.transform = svg_multiply(style.transform, {{sx, 0., 0., sy, tx - box[0] * sx, ty - box[1] * sy}});
+            }
+        }
+        if (attributes.count("transform"))
+            style.transform = svg_transform(style.transform, attributes["transform"]);
+        style.element_opacity = 1.; // not inherited, it is already in opacity
+        for (const auto& attribute : attributes)
+            svg_property(style, attribute.first, attribute.second);
+        if (attributes.count("style")) {
+            // Properties of the style attribute override presentation attributes.
+            std::string properties = attributes["style"];
+            size_t start = 0;
+            while (start < properties.size()) {
+                size_t end = properties.find(';', start);
+                if (end == std::string::npos)
+                    end = properties.size();
+                const std::string property = properties.substr(start, end - start);
+                const size_t colon = property.find(':');
+                if (colon != std::string::npos) {
+                    auto trim = [](std::string s) {
+                        s.erase(0, s.find_first_not_of(" \t\r\n"));
+                        s.erase(s.find_last_not_of(" \t\r\n") + 1);
+                        return s;
+                    };
+                    svg_property(style, trim(property.substr(0, colon)), trim(property.substr(colon + 1)));
+                }
+                start = end + 1;
+            }
+        }
+        style.opacity *= style.element_opacity;
+        auto number = [&](const char* key) { return attributes.count(key) ? std::atof(attributes[key].c_str()) : 0.; };
+
+        found = found || name == "svg";
+        std::vector<double> commands;
+        if (name == "path")
+            commands = svg_path(attributes["d"].c_str());
+        else if (name == "rect") {
+            const double x = number("x"), y = number("y"), w = number("width"), h = number("height");
+            double rx = number("rx"), ry = number("ry");
+            if (rx == 0.)
+                rx = ry;
+            if (ry == 0.)
+                ry = rx;
+            rx = std::min(rx, w / 2.);
+            ry = std::min(ry, h / 2.);
+            if (w > 0. && h > 0.) {
+                commands = {double(PathCommand::Move), x + rx, y, double(PathCommand::Line), x + w - rx, y};
+                svg_arc(commands, x + w - rx, y, rx, ry, 0., false, true, x + w, y + ry);
+                commands.insert(commands.end(), {double(PathCommand::Line), x + w, y + h - ry});
+                svg_arc(commands, x + w, y + h - ry, rx, ry, 0., false, true, x + w - rx, y + h);
+                commands.insert(commands.end(), {double(PathCommand::Line), x + rx, y + h});
+                svg_arc(commands, x + rx, y + h, rx, ry, 0., false, true, x, y + h - ry);
+                commands.insert(commands.end(), {double(PathCommand::Line), x, y + ry});
+                svg_arc(commands, x, y + ry, rx, ry, 0., false, true, x + rx, y);
+                commands.push_back(double(PathCommand::Close));
+            }
+        } else if (name == "circle" || name == "ellipse") {
+            const double cx = number("cx"), cy = number("cy");
+            const double rx = name == "circle" ? number("r") : number("rx");
+            const double ry = name == "circle" ? number("r") : number("ry");
+            if (rx > 0. && ry > 0.) {
+                const double kx = kappa * rx, ky = kappa * ry;
+                commands = {double(PathCommand::Move), cx + rx, cy,
+                            double(PathCommand::Cubic), cx + rx, cy + ky, cx + kx, cy + ry, cx, cy + ry,
+                            double(PathCommand::Cubic), cx - kx, cy + ry, cx - rx, cy + ky, cx - rx, cy,
+                            double(PathCommand::Cubic), cx - rx, cy - ky, cx - kx, cy - ry, cx, cy - ry,
+                            double(PathCommand::Cubic), cx + kx, cy - ry, cx + rx, cy - ky, cx + rx, cy,
+                            double(PathCommand::Close)};
+            }
+        } else if (name == "line")
+            commands = {double(PathCommand::Move), number("x1"), number("y1"), double(PathCommand::Line), number("x2"), number("y2")};
+        else if (name == "polyline" || name == "polygon") {
+            const char* p = attributes["points"].c_str();
+            double xy[2];
+            while (svg_numbers(p, xy, 2))
+                commands.insert(commands.end(), {double(commands.empty() ? PathCommand::Move : PathCommand::Line), xy[0], xy[1]});
+            if (name == "polygon" && ! commands.empty())
+                commands.push_back(double(PathCommand::Close));
+        }
+        else if (name == "defs" || name == "symbol" || name == "clipPath" || name == "mask" || name == "marker"
+              || name == "pattern" || name == "text" || name == "style" || name == "script")
+            style.hidden = true;
+        if (! commands.empty() && ! style.hidden)
+            svg_draw(commands, style, tol);
+        if (! self_closing)
+            styles.push_back(style);
+    }
+    return found;
 }
 
+} // anonymous namespace
+
 
 
-void TextureCache::garbage_collect(int clears_not_used)
+bool load_vector(const std::string& name, const std::string& filename)
 {
-    std::vector<std::string> names;
-    for (const auto& name_and_data : m_data) {
-        if (name_and_data.second.clears_without_use > clears_not_used)
-            names.emplace_back(name_and_data.first);
+    terminate_if_no_window(__FUNCTION__);
+    if (g_state.current_batch != &g_state.toplevel_batch) {
+        std::cerr << "cppgraphics: load_vector(): Cannot be called between begin_batch and end_batch. "
+                     "The call is ignored.\n";
+        return false;
     }
-
-    for (const std::string& name : names) {
-        auto it = m_data.find(name);
-        assert(it != m_data.end());
-        glDeleteTextures(1, &it->second.idx);
-        m_data.erase(it);
+    std::ifstream stream(filename, std::ios::in | std::ios::binary);
+    if (! stream) {
+        std::cerr << "cppgraphics: load_vector(): Cannot open file '" << filename << "'.\n";
+        return false;
     }
-}
-
-
-
-// Decoding routines for the built-it font, function taken from Dear ImGui.
-// https://github.com/ocornut/imgui
-namespace {
-    extern const unsigned char s_built_in_font_data[54951]; // defined at the end of file
-    
-    int Decode85Byte(char c)
-    {
-        return c >= '\\' ? c-36 : c-35;
+    const std::string text((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+
+    // Curves are flattened for current view and scale, so the tolerance is
+    // stored in the cache together with a hash (FNV-1a) of the file. It is
+    // rounded down to a power of two, so that the cache stays valid while
+    // the window is resized a little.
+    const double tol = std::exp2(std::floor(std::log2(g_state.curve_tolerance / pixels_per_unit())));
+    auto fnv1a = [](const std::string& str) {
+        std::uint64_t hash = 14695981039346656037ull;
+        for (char c : str)
+            hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+        return hash;
+    };
+    const std::uint64_t hash = fnv1a(text);
+    const char magic[8] = {'c', 'g', 'v', 'e', 'c', '0', '0', char('0' + sizeof(cg::Vertex) % 64)};
+
+    const bool existed = g_state.user_batches.count(name) != 0;
+    BatchToDraw& batch = g_state.user_batches[name];
+    std::string cache_name;
+    if (! g_state.vector_cache_directory.empty()) {
+        char hex[17];
+        std::snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(fnv1a(filename)));
+        cache_name = g_state.vector_cache_directory + "/" + hex + ".cgcache";
+    }
+    std::ifstream cache;
+    if (! cache_name.empty())
+        cache.open(cache_name, std::ios::in | std::ios::binary);
+    if (cache) {
+        char cached_magic[8];
+        std::uint64_t cached_hash = 0;
+        double cached_tol = 0.;
+        cache.read(cached_magic, sizeof(cached_magic));
+        cache.read(reinterpret_cast<char*>(&cached_hash), sizeof(cached_hash));
+        cache.read(reinterpret_cast<char*>(&cached_tol), sizeof(cached_tol));
+        if (cache && std::memcmp(magic, cached_magic, sizeof(magic)) == 0 && cached_hash == hash
+         && cached_tol == tol && batch.read_geometry(cache))
+            return true;
     }
 
-    void Decode85(const unsigned char* src, unsigned char* dst)
-    {
-        while (*src)
-        {
-            unsigned int tmp = Decode85Byte(src[0]) + 85 * (Decode85Byte(src[1])
-                       + 85 * (Decode85Byte(src[2]) + 85 * (Decode85Byte(src[3])
-                       + 85 *  Decode85Byte(src[4]))));
-            dst[0] = ((tmp >> 0) & 0xFF);
-            dst[1] = ((tmp >> 8) & 0xFF);
-            dst[2] = ((tmp >> 16) & 0xFF);
-            dst[3] = ((tmp >> 24) & 0xFF);
-            src += 5;
-            dst += 4;
+    // Shapes are tessellated in window coordinates with identity transform,
+    // but for the scale of current transform (see pixels_per_unit).
+    const cg::Color color = g_state.color;
+    const double thickness = g_state.thickness;
+    const int line_join = g_state.line_join;
+    const int line_cap = g_state.line_cap;
+    const double miter_limit = g_state.miter_limit;
+    const int dash_row = g_state.dash_row;
+    const std::array<double, 6> transform = g_state.transform;
+    const double transform_scale = g_state.transform_scale;
+    set_current_transform({{1., 0., 0., 1., 0., 0.}});
+    g_state.transform_scale = transform_scale;
+    g_state.dash_row = -1;
+    batch.clear();
+    g_state.current_batch = &batch;
+    const bool ok = svg_document(text, tol);
+    g_state.current_batch = &g_state.toplevel_batch;
+    set_current_transform(transform);
+    g_state.dash_row = dash_row;
+    g_state.color = color;
+    g_state.thickness = thickness;
+    g_state.line_join = line_join;
+    g_state.line_cap = line_cap;
+    g_state.miter_limit = miter_limit;
+
+    if (! ok) {
+        std::cerr << "cppgraphics: load_vector(): File '" << filename << "' is not an SVG image.\n";
+        if (! existed)
+            g_state.user_batches.erase(name);
+        return false;
+    }
+    if (cache_name.empty())
+        return true;
+
+    // The cache is optional, failing to write it (e.g. in a read-only directory) is
+    // not an error. It is written aside and renamed, so it is never seen half written.
+    const std::string temp_name = cache_name + ".tmp";
+    std::ofstream out(temp_name, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (out) {
+        out.write(magic, sizeof(magic));
+        out.write(reinterpret_cast<const char*>(&hash), sizeof(hash));
+        out.write(reinterpret_cast<const char*>(&tol), sizeof(tol));
+        const bool written = batch.write_geometry(out);
+        out.close();
+        if (! written || ! out)
+            std::remove(temp_name.c_str());
+        else if (std::rename(temp_name.c_str(), cache_name.c_str()) != 0) {
+            std::remove(cache_name.c_str()); // rename does not replace files on Windows
+            if (std::rename(temp_name.c_str(), cache_name.c_str()) != 0)
+                std::remove(temp_name.c_str());
         }
     }
-} // anonymous namespace
+    return true;
+}
 
 
 
-bool FontCache::add(const std::string& filename)
+void set_vector_cache_directory(const std::string& directory)
 {
-    assert(m_data.find(filename) == m_data.end());
-    auto it = m_data.insert(std::pair<std::string, FontData>(filename, FontData())).first;
-    stbtt_fontinfo& font = it->second.font_info;
-    std::vector<unsigned char>& data = it->second.font_data;
-
-    if (filename.empty()) {
-        data.resize(54951);
-        Decode85(s_built_in_font_data, data.data());
-    } else {
-        std::ifstream stream(filename, std::ios::in | std::ios::binary);
-        if (stream)
-            data = std::vector<unsigned char>((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
-    }
-    if (data.empty() || ! stbtt_InitFont(&font, (unsigned char*)(data.data()), 0)) {
-        m_data.erase(it);
-        return false;
-    }
-    return true;
+    g_state.vector_cache_directory = directory;
 }
 
 
 
-const stbtt_fontinfo* FontCache::get(const std::string& filename) const
+double get_geometry_cache_hit_rate()
 {
-    auto it = m_data.find(filename);
-    if (it == m_data.end())
-        return nullptr;
-    return &it->second.font_info;
+    return g_state.geometry.hit_rate();
 }
 
 
 
-void FontCache::release_all()
+int get_geometry_cache_memory()
 {
-    m_data.clear();
+    return int(g_state.geometry.memory_used());
 }
 
 
 
-bool image(const std::string& filename,
-           double x, double y, double width, double height,
-           int cut_x, int cut_y, int cut_width, int cut_height)
+double get_optimizer_savings(int rule)
 {
-    terminate_if_no_window(__FUNCTION__);
+    if (rule < 0 || rule >= int(g_state.optimizer_savings.size())) {
+        std::cerr << "cppgraphics: get_optimizer_savings(): Unknown rule " << rule << ".\n";
+        return 0.;
+    }
+    return g_state.optimizer_savings[size_t(rule)];
+}
 
-    int twidth  = 0;
-    int theight = 0;
-    GLuint texture_idx = 0;
 
-    if (! g_state.textures.get(filename, texture_idx, twidth, theight)) {
-        if (! g_state.textures.add(filename)) {
-            std::cerr << "cppgraphics: Unable to load image from file " << filename << "\n";
-            return false;
-        } else
-            g_state.textures.get(filename, texture_idx, twidth, theight);
-    }
 
-    // Now calculate which part of the texture should be shown.
-    cg::Rect<float> rect{0.f, 0.f, 1.f, 1.f};
-    if (cut_width != 0 || cut_height != 0)
-        rect = {float(cut_x)/twidth, float(cut_y)/theight,
-                float(cut_width)/twidth, float(cut_height)/theight};
+void reset_optimizer_savings()
+{
+    g_state.optimizer_savings.fill(0.);
+}
 
-    if (width == 0.) // use width from the texture
-        width = rect.width * twidth;
 
-    if (height == 0.) // autoset height to maintain aspect ratio
-        height = width * (rect.height*theight/(rect.width*twidth));
-    
-    cg::Rect<float> canvas_rect{float(x), float(y), float(width), float(height)};
 
-    // And push into the list of things to render.
-    g_state.current_batch->push_image(texture_idx, rect, canvas_rect);
-    return true;
+void set_geometry_cache_size(int megabytes)
+{
+    if (megabytes < 0) {
+        std::cerr << "cppgraphics: Geometry cache size cannot be negative. Setting to zero instead.\n";
+        megabytes = 0;
+    }
+    g_state.geometry.set_capacity(size_t(megabytes) * 1024 * 1024);
 }
 
 
 
-void image(const unsigned char* data, int x, int y, int width, int height,
-           int source_width, int source_height, bool reload)
+int create_mesh(const float* xy, int vertex_count, const unsigned int* indices, int index_count,
+                const float* values, const float* rgba)
 {
     terminate_if_no_window(__FUNCTION__);
+    if (! xy || ! indices || vertex_count <= 0 || index_count <= 0 || index_count % 3 != 0) {
+        std::cerr << "cppgraphics: create_mesh(): Invalid vertex or index data. The call is ignored.\n";
+        return -1;
+    }
+    for (int i=0; i<index_count; ++i) {
+        if (indices[i] >= unsigned(vertex_count)) {
+            std::cerr << "cppgraphics: create_mesh(): Index " << indices[i] << " is out of range. "
+                         "The call is ignored.\n";
+            return -1;
+        }
+    }
+    const int id = ++g_state.last_mesh_id;
+    g_state.meshes[id].set(xy, size_t(vertex_count), indices, size_t(index_count), values, rgba);
+    return id;
+}
 
-    int twidth  = 0;
-    int theight = 0;
-    GLuint texture_idx = 0;
 
-    std::string hash = TextureCache::ImagePrefix
-                      + std::to_string(std::hash<const unsigned char*>{}(data));
 
-    if (reload || ! g_state.textures.get(hash, texture_idx, twidth, theight)) {
-        if (! g_state.textures.add(hash, data, source_width, source_height)) {
-            std::cerr << "cppgraphics: Unable to load image from pixels.\n";
-            return;
-        } else
-            g_state.textures.get(hash, texture_idx, twidth, theight);
+// Returns the mesh or nullptr (with a message to stderr) when id is invalid.
+static Mesh* find_mesh(int mesh, const std::string& fn)
+{
+    auto it = g_state.meshes.find(mesh);
+    if (it == g_state.meshes.end()) {
+        std::cerr << "cppgraphics: " << fn << "(): Mesh " << mesh << " does not exist. "
+                     "The call is ignored.\n";
+        return nullptr;
     }
+    return &it->second;
+}
 
-    cg::Rect<float> canvas_rect = {float(x), float(y), float(width), float(height)};
-    cg::Rect<float> rect = {0.f, 0.f, 1.f, 1.f};
 
-    // And push into the list of things to render.
-    g_state.current_batch->push_image(texture_idx, rect, canvas_rect);
+
+void update_mesh(int mesh, int first_vertex, int count, const float* xy,
+                 const float* values, const float* rgba)
+{
+    Mesh* m = find_mesh(mesh, __FUNCTION__);
+    if (! m)
+        return;
+    if (first_vertex < 0 || count < 0 || size_t(first_vertex) + size_t(count) > m->vertex_count()) {
+        std::cerr << "cppgraphics: update_mesh(): Vertex range is out of bounds. The call is ignored.\n";
+        return;
+    }
+    m->update(size_t(first_vertex), size_t(count), xy, values, rgba);
 }
 
 
 
-bool image(const std::string& filename, double x, double y)
+void set_mesh_colormap(int mesh, int colormap, double min, double max)
 {
-    return image(filename, x, y, 0., 0., 0, 0, 0, 0);
+    Mesh* m = find_mesh(mesh, __FUNCTION__);
+    if (! m)
+        return;
+    if (min == max) // the shader would not know the mesh is colormapped
+        max = min + 1e-6 * std::max(1., std::abs(min));
+    m->colormap = colormap;
+    m->value_min = min;
+    m->value_max = max;
 }
 
 
 
-bool image(const std::string& filename, double x, double y, double width, double height)
+void draw_mesh(int mesh, double x, double y, double scale, double angle)
 {
-    return image(filename, x, y, width, height, 0, 0, 0, 0);
+    terminate_if_no_window(__FUNCTION__);
+    if (find_mesh(mesh, __FUNCTION__))
+        g_state.current_batch->push_mesh(mesh, x, y, scale, angle);
 }
 
 
 
-void draw_batch(const std::string& name, double x, double y)
+void delete_mesh(int mesh)
 {
-    auto it = g_state.user_batches.find(name);
-    if (it == g_state.user_batches.end()) {
-        std::cerr << "cppgraphics: draw_batch(): Batch '" << name << "' was not "
-                     "previously created. The call is ignored.\n";
-        return;
-    }
-
-    g_state.current_batch->push_batch(name, x, y);
+    if (find_mesh(mesh, __FUNCTION__))
+        g_state.meshes.erase(mesh);
 }
 
 
@@ -15099,66 +20240,66 @@ static void text_internal(const std::string& str_u8, double x, double y, double
     if (str_u8.empty())
         return;
     const stbtt_fontinfo * font = g_state.current_font_ptr;
+    FontMetrics& metrics = *g_state.current_font_metrics;
     assert(font);
 
-    // Text is a texture generated by the TextureCache::add. It is passed as
-    // a string encoded as ":/gibberish|Text to draw", where the gibberish
-    // encodes color, fill_color, outline thickness and text styles. This is
-    // needed because textures are cached and the string serves as a key.
-    std::string text = TextureCache::TextPrefix;
-    // encode color as one char per component, rounded to a hundreth (1-101):
-    const cg::Color* col = &g_state.color;
-    for (int i=0; i<8; ++i) {
-        assert((*col)[i%4] >= 0.f && (*col)[i%4] <= 1.f);
-        text += char((*col)[i%4]*100)+1;
-        if (i==3)
-            col = &g_state.fill_color;
-    }
-    // text style is a bitmask, should not exceed 16 (just save it as a char)
-    // TODO_TEXTSTYLES: commented-out, see set_text_style function
-    // text += char(1 + g_state.text_style);
-
-    // Also encode font. Fonts are cached, save two chars as a pointer hash.
-    size_t font_hash = std::hash<const stbtt_fontinfo*>{}(font);
-    text += 1 + char((font_hash / 19) % 120); // | is ASCII 124, see below.
-    text += 1 + char(font_hash % 120);
-
-    // All that needed to be encoded is there, now add the text itself.
-    assert(text.find("|") == std::string::npos);
-    text += "|";
-    text.reserve(text.size() + str_u8.size() + 1);
-    const char* text_start = text.c_str() + text.size();
-
-    // When using the built-in font, replace non-ASCII with a question mark.
-    if (g_state.fonts.get("") == font) {
-        for (const unsigned char c : str_u8) {
-            if (c < 127)
-                text += c;
-            else if (c >= 0xC0)
-                text += '?';
-        }
-    } else
-        text += str_u8;
-
-    if (text.empty())
+    // The string is decoded on the fly, twice: first to measure it, then to
+    // place the glyphs. When using the built-in font, replace non-ASCII with
+    // a question mark.
+    auto next = [&metrics, &str_u8](size_t& i) {
+        const int c = next_codepoint(str_u8, i);
+        return metrics.ascii_only && c >= 127 ? int('?') : c;
+    };
+    double units = 0.; // in font units
+    int previous = -1;
+    for (size_t i=0; i<str_u8.size(); ) {
+        const int c = next(i);
+        if (previous != -1)
+            units += metrics.kerning(previous, c);
+        units += metrics.glyph(c).advance;
+        previous = c;
+    }
+    if (units <= 0.)
         return;
 
     if (height == 0. && width == 0.)
         height = g_state.height * 0.075; // default size
-    if (width == 0.) {
-        // height is used as 'font size'. Set width to maintain aspect ratio.
-        int text_width, text_height;
-        // The 36 is font size - it is irrelevant here, only the w/h ratio matters.
-        draw_text(font, text_start, 36., SDL_Color(), text_width, text_height, false);
-        width = text_width * height/text_height;
-    }
+    const int ascent = metrics.ascent;
+    const double scale_y = height / (ascent - metrics.descent);
+    const double scale_x = width == 0. ? scale_y : width / units; // otherwise keep aspect ratio
+    width = units * scale_x;
 
     double offset_x = center ? width/2. : 0.;
     double offset_y = center ? height/2. : 0.;
 
-    cg::image(text, x-offset_x,
-                    y-offset_y,
-                    width, height);    
+    // Small glyphs are rasterized at about the size they have on screen,
+    // larger ones share one distance field.
+    const int size = GlyphAtlas::bucket(height * pixels_per_unit());
+    const double raster = stbtt_ScaleForPixelHeight(font, float(GlyphAtlas::raster_size(size)));
+    const double raster_x = scale_x / raster;
+    const double raster_y = scale_y / raster;
+    const double baseline = y - offset_y + ascent * scale_y;
+    cg::Color color;
+    for (int i=0; i<4; ++i) // palette colors are not supported by text
+        color[i] = std::min(1.f, std::max(0.f, g_state.color[i]));
+
+    double pen = 0.;
+    previous = -1;
+    for (size_t i=0; i<str_u8.size(); ) {
+        const int c = next(i);
+        if (previous != -1)
+            pen += metrics.kerning(previous, c);
+        previous = c;
+        const GlyphAtlas::Glyph& glyph = g_state.glyphs.get(font, c, size);
+        if (glyph.texture != 0) {
+            const double left = x - offset_x + pen * scale_x;
+            g_state.current_batch->push_glyph(glyph.texture, glyph.uv,
+                {float(left + glyph.box[0] * raster_x), float(baseline + glyph.box[1] * raster_y),
+                 float((glyph.box[2] - glyph.box[0]) * raster_x), float((glyph.box[3] - glyph.box[1]) * raster_y)},
+                color, size == 0);
+        }
+        pen += metrics.glyph(c).advance;
+    }
 }
 
 
@@ -15195,6 +20336,154 @@ void text_centered(const std::string& str, double x, double y, double height)
 
 
 
+double text_width(const std::string& str, double height)
+{
+    terminate_if_no_window(__FUNCTION__);
+    FontMetrics& metrics = *g_state.current_font_metrics;
+    if (height == 0.)
+        height = g_state.height * 0.075; // default size, as in text_internal
+
+    // The same as the measuring pass of text_internal.
+    double units = 0.;
+    int previous = -1;
+    for (size_t i=0; i<str.size(); ) {
+        int c = next_codepoint(str, i);
+        if (metrics.ascii_only && c >= 127)
+            c = '?';
+        if (previous != -1)
+            units += metrics.kerning(previous, c);
+        units += metrics.glyph(c).advance;
+        previous = c;
+    }
+    return units * height / (metrics.ascent - metrics.descent);
+}
+
+
+
+// Break text into lines of at most max_units (font units) wide, at spaces
+// when possible. Returns the ranges of codepoints and widths of the lines.
+struct TextLine {
+    size_t begin;
+    size_t end;
+    double units;
+};
+
+static std::vector<TextLine> break_lines(const std::vector<int>& codepoints, FontMetrics& metrics,
+                                         double max_units, bool wrap)
+{
+    std::vector<TextLine> lines;
+    const size_t n = codepoints.size();
+    size_t begin = 0;
+    while (true) {
+        double units = 0.;
+        double units_at_space = 0.;
+        size_t space = n; // last space on the line, where it can be broken
+        size_t i = begin;
+        bool overflow = false;
+        for (; i<n && codepoints[i] != '\n'; ++i) {
+            double advance = metrics.glyph(codepoints[i]).advance;
+            if (i != begin)
+                advance += metrics.kerning(codepoints[i-1], codepoints[i]);
+            if (codepoints[i] == ' ') {
+                space = i;
+                units_at_space = units;
+            }
+            else if (wrap && i != begin && units + advance > max_units) {
+                overflow = true;
+                break;
+            }
+            units += advance;
+        }
+        if (! overflow) {
+            lines.push_back({begin, i, units});
+            if (i == n)
+                break;
+            begin = i + 1; // past the newline
+        }
+        else if (space != n) {
+            lines.push_back({begin, space, units_at_space});
+            begin = space + 1;
+        }
+        else {
+            lines.push_back({begin, i, units}); // a word longer than the line
+            begin = i;
+        }
+    }
+    return lines;
+}
+
+
+
+void text_box(const std::string& str, double x, double y, double width, double height,
+              int align, bool wrap, double size)
+{
+    terminate_if_no_window(__FUNCTION__);
+    if (align != cg::TextAlignLeft && align != cg::TextAlignCenter && align != cg::TextAlignRight) {
+        std::cerr << "cppgraphics: text_box(): Unknown alignment " << align << ". The call is ignored.\n";
+        return;
+    }
+    if (str.empty() || width <= 0. || height <= 0.)
+        return;
+    const stbtt_fontinfo * font = g_state.current_font_ptr;
+    FontMetrics& metrics = *g_state.current_font_metrics;
+    assert(font);
+    if (size == 0.)
+        size = g_state.height * 0.075; // default size, as in text_internal
+
+    const int glyph_size = GlyphAtlas::bucket(size * pixels_per_unit());
+    const TextLayoutCache::Key key{str, font, glyph_size, {{size, width, height}}, align, wrap};
+    const std::vector<TextLayoutCache::PlacedGlyph>* layout = g_state.text_layouts.get(key);
+
+    if (! layout) {
+        std::vector<int> codepoints = string_to_utf8_codepoints(str);
+        if (metrics.ascii_only)
+            for (int& c : codepoints)
+                c = c < 127 ? c : '?';
+        const double scale = size / (metrics.ascent - metrics.descent);
+        const double line_height = (metrics.ascent - metrics.descent + metrics.line_gap) * scale;
+        const double raster = stbtt_ScaleForPixelHeight(font, float(GlyphAtlas::raster_size(glyph_size)));
+        const double to_units = scale / raster;
+
+        std::vector<TextLayoutCache::PlacedGlyph> glyphs;
+        const std::vector<TextLine> lines = break_lines(codepoints, metrics, width / scale, wrap);
+        for (size_t l=0; l<lines.size(); ++l) {
+            if ((l + 1) * line_height - metrics.line_gap * scale > height)
+                break; // lines which do not fit are not drawn
+            const TextLine& line = lines[l];
+            const double baseline = l * line_height + metrics.ascent * scale;
+            double left = 0.;
+            if (align == cg::TextAlignCenter)
+                left = (width - line.units * scale) / 2.;
+            else if (align == cg::TextAlignRight)
+                left = width - line.units * scale;
+            double units = 0.;
+            for (size_t i=line.begin; i<line.end; ++i) {
+                if (i != line.begin)
+                    units += metrics.kerning(codepoints[i-1], codepoints[i]);
+                const GlyphAtlas::Glyph& glyph = g_state.glyphs.get(font, codepoints[i], glyph_size);
+                if (glyph.texture != 0) {
+                    glyphs.push_back({glyph.texture, glyph.uv,
+                        {float(left + units * scale + glyph.box[0] * to_units), float(baseline + glyph.box[1] * to_units),
+                         float((glyph.box[2] - glyph.box[0]) * to_units), float((glyph.box[3] - glyph.box[1]) * to_units)}});
+                }
+                units += metrics.glyph(codepoints[i]).advance;
+            }
+        }
+        layout = &g_state.text_layouts.add(key, std::move(glyphs));
+    }
+
+    cg::Color color;
+    for (int i=0; i<4; ++i) // palette colors are not supported by text
+        color[i] = std::min(1.f, std::max(0.f, g_state.color[i]));
+    for (const TextLayoutCache::PlacedGlyph& glyph : *layout) {
+        const cg::Rect<float>& r = glyph.rect;
+        g_state.current_batch->push_glyph(glyph.texture, glyph.uv,
+            {float(x + r.x), float(y + r.y), r.width, r.height}, color, glyph_size == 0);
+    }
+}
+
+
+
 void set_thickness(double thickness)
 {
     terminate_if_no_window(__FUNCTION__);
@@ -15252,6 +20541,7 @@ bool set_font(const std::string& name)
         }
     }
     g_state.current_font_ptr = g_state.fonts.get(name);
+    g_state.current_font_metrics = g_state.fonts.get_metrics(name);
 
     // TODO_TEXTSTYLES (see function set_text_style)
     //if (g_state.current_font_ptr)
@@ -15360,6 +20650,96 @@ void set_background_color(int color)
 
 
 
+// Palette colors are marked by alpha = -3, red component is the index.
+static cg::Color palette_color(int index)
+{
+    if (index < 0 || index > 65535) {
+        std::cerr << "cppgraphics: Palette index " << index << " is out of range. Using zero instead.\n";
+        index = 0;
+    }
+    return {{float(index), 0.f, 0.f, -3.f}};
+}
+
+
+
+void set_color_from_palette(int index)
+{
+    terminate_if_no_window(__FUNCTION__);
+    g_state.color = palette_color(index);
+    g_state.palette_colors_used = true;
+}
+
+
+
+void set_fill_color_from_palette(int index)
+{
+    terminate_if_no_window(__FUNCTION__);
+    g_state.fill_color = palette_color(index);
+    g_state.palette_colors_used = true;
+}
+
+
+
+// Gradients are marked by alpha = -6 (linear) or -7 (radial), red component
+// is the row in the gradient table.
+static void set_fill_gradient(const std::array<float, 4>& geometry, float kind,
+                              const double* positions, const double* rgba, int count)
+{
+    if (! positions || ! rgba || count <= 0) {
+        std::cerr << "cppgraphics: Invalid gradient color stops. The call is ignored.\n";
+        return;
+    }
+    for (int i=1; i<count; ++i) {
+        if (positions[i] < positions[i-1]) {
+            std::cerr << "cppgraphics: Positions of gradient color stops must not decrease. The call is ignored.\n";
+            return;
+        }
+    }
+
+    std::vector<float> texels(4 * LookupTable::Width);
+    int stop = 0;
+    for (int i=0; i<256; ++i) {
+        const double pos = i / 255.;
+        while (stop < count && positions[stop] < pos)
+            ++stop;
+        // Colors before the first and after the last stop are constant.
+        const int a = std::max(0, stop - 1);
+        const int b = std::min(count - 1, stop);
+        const double t = positions[b] > positions[a] ? std::min(1., std::max(0., (pos - positions[a]) / (positions[b] - positions[a]))) : 1.;
+        for (int j=0; j<4; ++j)
+            texels[4*i+j] = float(rgba[4*a+j] + t * (rgba[4*b+j] - rgba[4*a+j]));
+    }
+    std::copy(geometry.begin(), geometry.end(), texels.begin() + 4*256);
+
+    g_state.fill_color = {{float(g_state.lookup_table.row(texels)), 0.f, 0.f, kind}};
+}
+
+
+
+void set_fill_gradient_linear(double x1, double y1, double x2, double y2,
+                              const double* positions, const double* rgba, int count)
+{
+    terminate_if_no_window(__FUNCTION__);
+    if (x1 == x2 && y1 == y2) // the direction would be undefined
+        x2 += 1e-6 * std::max(1., std::abs(x1));
+    set_fill_gradient({{float(x1), float(y1), float(x2), float(y2)}}, -6.f, positions, rgba, count);
+}
+
+
+
+void set_fill_gradient_radial(double cx, double cy, double radius,
+                              const double* positions, const double* rgba, int count)
+{
+    terminate_if_no_window(__FUNCTION__);
+    if (radius <= 0.) {
+        std::cerr << "cppgraphics: set_fill_gradient_radial(): Radius must be positive. The call is ignored.\n";
+        return;
+    }
+    set_fill_gradient({{float(cx), float(cy), float(radius), 0.f}}, -7.f, positions, rgba, count);
+}
+
+
+
 void set_color(double r, double g, double b, double a)
 {
     terminate_if_no_window(__FUNCTION__);
@@ -15434,6 +20814,28 @@ const int Gray          = 14;
 const int DarkGray      = 15;
 const int Transparent   = 16;
 
+const int ColormapNone    = -1;
+const int ColormapGray    = 0;
+const int ColormapJet     = 1;
+const int ColormapHot     = 2;
+const int ColormapViridis = 3;
+
+const int LineJoinMiter   = 0;
+const int LineJoinBevel   = 1;
+const int LineJoinRound   = 2;
+const int LineCapButt     = 0;
+const int LineCapSquare   = 1;
+const int LineCapRound    = 2;
+
+const int OptimizeHidden      = 0;
+const int OptimizeTransparent = 1;
+const int OptimizeSubpixel    = 2;
+const int OptimizeMerged      = 3;
+
+const int TextAlignLeft   = 0;
+const int TextAlignCenter = 1;
+const int TextAlignRight  = 2;
+
 
 
 
@@ -1,6 +1,7 @@
 #ifndef CPPGRAPHICS_HPP_INCLUDE_GUARD
 #define CPPGRAPHICS_HPP_INCLUDE_GUARD
 
+#include <cstddef>
 #include <string>
 
 
@@ -171,6 +172,7 @@ int wait_until_input(double timeout = -1); // mouse OR key
 // These functions are used to set them.
 
 // Sets all the attributes (except background color) to default values.
+// The transform is reset as well and saved transforms are dropped.
 void set_defaults();
 
 // Setting colors: accepts a color index from the list below.
@@ -237,6 +239,27 @@ void line_to(double x, double y);
 // Draw line from one point to the other.
 void line(double x1, double y1, double x2, double y2);
 
+// Draw quadratic / cubic Bezier curve from current pencil position to (x, y),
+// using given control points. The number of segments adapts to the size of
+// the curve on screen (see set_curve_tolerance).
+void quad_to(double cx, double cy, double x, double y);
+void cubic_to(double c1x, double c1y, double c2x, double c2y, double x, double y);
+
+// Draw line back to where the pencil was last moved by move_to.
+void close_path();
+
+// Paths: after begin_path, move_to, line_to, quad_to, cubic_to and close_path
+// do not draw anything, they record a path instead. The path is then filled
+// by fill_path and/or outlined by stroke_path (either of them ends the
+// recording, the path is kept until the next begin_path). The first subpath
+// (started by move_to) is the outline, the following ones are holes.
+// Without a move_to, the path starts at the current pencil position.
+// Flattened and triangulated paths are cached, so a path drawn the same way
+// in the next frame is only copied.
+void begin_path();
+void fill_path();
+void stroke_path();
+
 // Draw a triangle.
 void triangle(double x1, double y1, double x2, double y2, double x3, double y3);
 
@@ -246,6 +269,40 @@ void rectangle(double x, double y, double a, double b);
 // Draw a circle with given center and radius.
 void circle(double x, double y, double r);
 
+// Draw an ellipse with given center and semi-axes (a along x, b along y).
+void ellipse(double x, double y, double a, double b);
+
+// Draw a part of a circle's outline (using line thickness and color).
+// Angles are in radians, measured from the x axis towards the y axis
+// (i.e. clockwise, because y goes down).
+void arc(double x, double y, double r, double angle_start, double angle_end);
+
+// Draw a circular sector (a pie chart slice). Angles are the same as in arc.
+void pie(double x, double y, double r, double angle_start, double angle_end);
+
+// Draw a rectangle with corners rounded by radius r.
+void rounded_rectangle(double x, double y, double a, double b, double r);
+
+// Draw a polygon with n vertices, xy contains their coordinates (x1, y1, x2, y2, ...).
+// The polygon may be concave. It is filled by fill color, the outline is made
+// of lines (same as cg::line draws). The triangulation is cached, so drawing
+// the same polygon again (e.g. in the next frame) is cheap.
+void polygon(const double* xy, size_t n);
+
+// Same, but the polygon has holes. The points in xy form ring_count closed
+// rings, ring_sizes gives number of vertices in each. The first ring is the
+// outline, the others are holes.
+void polygon_with_holes(const double* xy, const size_t* ring_sizes, size_t ring_count);
+
+// Draw n round points (e.g. a scatter plot), point i is at (x[i], y[i]).
+// The size is diameter of the points, it is limited by the graphics driver
+// (typically to 64 pixels or more, use circle for larger markers). The points
+// have current color, or rgba may point to n colors (RGBA in 0 to 1 range).
+// The arrays are copied to the GPU as they are, no triangles are generated,
+// so millions of points can be drawn each frame. When the points do not
+// change, putting them into a batch (see begin_batch) avoids even the copy.
+void points(const float* x, const float* y, size_t n, double size = 1., const float* rgba = nullptr);
+
 // Draw image loaded from file 'filename'.
 // Bmp, png, tga, jpg, gif, psd, and pnm are supported.
 // Functions return true if successful, false when file not found.
@@ -257,6 +314,18 @@ bool image(const std::string& filename, double x, double y, double width, double
 bool image(const std::string& filename, double x, double y, double width, double height,
            int cut_x, int cut_y, int cut_width, int cut_height);
 
+// Draw a map of cols*rows tiles in one go, tile_ids holds id of each tile (row
+// by row, the first row on top). Images of the tiles are taken from the atlas,
+// which is an image file with tiles of tile_width*tile_height pixels, numbered
+// from zero row by row. Tiles with id 65535 are not drawn. The size of the map
+// is chosen as for images (zero width means the atlas pixel size, zero height
+// keeps aspect ratio). If called repeatedly with the same pointer, only the
+// rows which changed since the last call are uploaded to the GPU. As with
+// heatmap, the ids of pointers not passed for a while are released unless
+// a kept batch draws them.
+bool tilemap(const unsigned short* tile_ids, int cols, int rows, const std::string& atlas,
+             int tile_width, int tile_height, double x, double y, double width = 0., double height = 0.);
+
 
 // Following functions draw text (UTF-8 encoded). Current font and color are used.
 
@@ -272,6 +341,24 @@ void text(const std::string& str, double x, double y, double width, double heigh
 // Draw text centered on point (x,y) with given height.
 void text_centered(const std::string& str, double x, double y, double height);
 
+// Width of the text drawn with given height (zero means default size) using
+// current font. Measuring does not draw anything and is cheap, metrics of
+// glyphs are cached.
+double text_width(const std::string& str, double height);
+
+// Draw text into a box with top left corner at (x,y). Lines are broken at '\n'
+// and, when wrap is true, at spaces so that they fit the width. Lines are
+// aligned by align (see constants below) and spaced as the font says. size is
+// the height of the text, zero means default size. Lines which do not fit the
+// box height are not drawn. The layout is cached, drawing the same box again
+// only copies its glyphs.
+void text_box(const std::string& str, double x, double y, double width, double height,
+              int align, bool wrap, double size = 0.);
+
+extern const int TextAlignLeft;
+extern const int TextAlignCenter;
+extern const int TextAlignRight;
+
 
 
 
@@ -338,6 +425,180 @@ void begin_batch(const std::string& name);
 void end_batch();
 void draw_batch(const std::string& name, double x = 0., double y = 0.);
 
+// Load an SVG image into a batch of given name (its previous contents is
+// replaced), to be drawn by draw_batch under any transform. Supported is a
+// subset of SVG: path, rect, circle, ellipse, line, polyline and polygon
+// elements, g groups with the transform attribute, solid fills and strokes
+// (fill, fill-rule, stroke, stroke-width, opacities, line joins and caps)
+// given either as attributes or in the style attribute. Self-intersecting and
+// overlapping subpaths are filled by the nonzero (default) or evenodd rule.
+// Gradients, text, clipping and masks are skipped.
+// The viewBox is scaled to width and height of the svg element (in pixels).
+// Curves are flattened for current view and transform. When a cache
+// directory is set (see below), the tessellated image is stored there and
+// reused while the file and the view do not change much.
+// Returns false if the file cannot be read.
+bool load_vector(const std::string& name, const std::string& filename);
+
+// Directory where load_vector stores tessellated images (it must exist).
+// Empty string (default) means that nothing is stored.
+void set_vector_cache_directory(const std::string& directory);
+
+// Draw a batch with positions and colors interpolated between two keyframes
+// (two batches drawn the same way, just with different coordinates and colors).
+// t = 0 draws the first one, t = 1 the second one. The interpolation is done
+// on the GPU, so an animation costs one draw call and nothing is uploaded.
+// For more keyframes, tween between the two neighbouring ones.
+// Both batches must have the same number of vertices, the first one defines
+// everything else (images, line thickness, etc.).
+void draw_batch_tween(const std::string& name_a, const std::string& name_b, double t,
+                      double x = 0., double y = 0.);
+
+// Palette colors. Instead of the color itself, vertices drawn into a batch only
+// store an index into the palette of the batch (at most 65536 colors). Setting
+// the palette later recolors the batch without generating it again or uploading
+// its vertices. A batch which only uses palette colors also takes less GPU memory.
+// Palette colors only make sense inside batches and are not supported by text.
+// Drawn outside of a batch, they are replaced by white (with a warning).
+void set_color_from_palette(int index);
+void set_fill_color_from_palette(int index);
+
+// Set palette of a batch. rgba points to count colors, four values in 0 to 1 range each.
+void set_batch_palette(const std::string& name, const double* rgba, int count);
+
+// Fill shapes with a gradient instead of a plain color (set_fill_color switches
+// back to plain colors). The gradient is defined by count color stops: positions
+// in 0 to 1 range (not decreasing) and rgba with four values in 0 to 1 range for
+// each stop. A linear gradient goes from (x1, y1) to (x2, y2), a radial one from
+// the center to the radius. The gradient is evaluated per pixel on the GPU, so
+// it costs nothing extra per vertex and works with any filled shape. When drawn
+// into a batch, the gradient moves with it.
+void set_fill_gradient_linear(double x1, double y1, double x2, double y2,
+                              const double* positions, const double* rgba, int count);
+void set_fill_gradient_radial(double cx, double cy, double radius,
+                              const double* positions, const double* rgba, int count);
+
+// Store vertices of a batch in quantized form: positions as 16-bit fixed point
+// numbers relative to the bounding box of the batch and colors as bytes. This
+// takes four times less GPU memory and upload time. Position error is about
+// 1/131070 of the batch size and colors are rounded to 1/255. The batch is
+// only quantized when the position error is below 1/16 of a pixel as it is
+// drawn (so it cannot be seen) and when it contains no images and text. When
+// it is later drawn larger (bigger window, draw_batch under a transform),
+// it is stored in full again.
+void set_batch_quantization(const std::string& name, bool quantize);
+
+// Lines thicker than a pixel are drawn as triangles. Following functions set
+// how segments of consecutive line_to calls (and polygon outlines) are joined,
+// how ends of lines look (see constants below) and how long miter joins can
+// get relative to line thickness before they are cut (default is 4).
+void set_line_join(int join);
+void set_line_cap(int cap);
+void set_miter_limit(double limit);
+
+extern const int LineJoinMiter; // default
+extern const int LineJoinBevel;
+extern const int LineJoinRound;
+extern const int LineCapButt;   // default
+extern const int LineCapSquare;
+extern const int LineCapRound;
+
+// Draw lines, polygon outlines and stroked paths dashed. pattern holds count
+// lengths of dashes and gaps (dash, gap, dash, ...), an odd count is repeated
+// twice. offset shifts the pattern along the line. Dashes are evaluated on the
+// GPU, a dashed line takes as many vertices as a solid one. Pass null pattern
+// (or zero count) to draw solid lines again (default).
+void set_dash(const double* pattern, int count, double offset = 0.);
+
+// Transform everything drawn afterwards. translate, rotate (angle in radians,
+// from the x axis towards the y axis, as in arc) and scale apply to the
+// coordinates before the transforms already set, as in other 2D APIs. push_transform saves current transform,
+// pop_transform restores the last saved one. Transforms are applied on the GPU,
+// shapes are tessellated (and cached) in their own coordinates, only the level
+// of detail of curves follows the scale. Each vertex refers to its transform,
+// so shapes under different transforms are still drawn by one draw call.
+void push_transform();
+void pop_transform();
+void translate(double dx, double dy);
+void rotate(double angle);
+void scale(double sx, double sy);
+void scale(double s);
+void reset_transform();
+
+// Circles are approximated by polygons. The number of segments depends on
+// the size of the circle on screen, so that the polygon is never farther
+// than given number of pixels from the real circle (default is 0.25).
+// Lower values give smoother but more expensive circles.
+void set_curve_tolerance(double pixels);
+
+// Circles, outlined rectangles and outlined triangles are cached once they are
+// tessellated, so drawing the same shape again (e.g. in the next frame) only
+// copies the vertices. Following functions return ratio of cache hits to all
+// lookups and memory currently used by the cache (in bytes). The cache size
+// can be changed (default is 16 MB), zero turns the caching off.
+double get_geometry_cache_hit_rate();
+int get_geometry_cache_memory();
+void set_geometry_cache_size(int megabytes);
+
+// Before the drawing is sent to the GPU, it is optimized: everything under an
+// opaque rectangle or image covering the whole window (such as the one drawn
+// by clear) is dropped, as are fully transparent triangles and lines and
+// triangles which cover no pixel. Neighbouring draws of the same kind are
+// merged into a single draw call. Following function returns how much each
+// of the rules saved (number of vertices, number of draw calls for
+// OptimizeMerged) since the start or since the savings were reset.
+// Batches (see begin_batch) are not optimized.
+double get_optimizer_savings(int rule);
+void reset_optimizer_savings();
+
+extern const int OptimizeHidden;
+extern const int OptimizeTransparent;
+extern const int OptimizeSubpixel;
+extern const int OptimizeMerged;
+
+// Meshes are user-owned triangle meshes which stay on the GPU, so they are
+// not regenerated nor uploaded in each frame. xy points to vertex_count pairs
+// of coordinates, indices to index_count vertex indices (three per triangle).
+// Each vertex can have a scalar value (shown using a colormap, see below)
+// and/or a color (four floats, RGBA in 0 to 1 range). Either of these two
+// pointers may be null. Returns a mesh id or -1 in case of an error.
+int create_mesh(const float* xy, int vertex_count, const unsigned int* indices, int index_count,
+                const float* values = nullptr, const float* rgba = nullptr);
+
+// Overwrite count vertices of the mesh starting at first_vertex. Null pointers
+// leave respective data unchanged. Only the changed part is uploaded to the GPU.
+void update_mesh(int mesh, int first_vertex, int count, const float* xy,
+                 const float* values = nullptr, const float* rgba = nullptr);
+
+// Show values of the mesh using a colormap (see the list below), [min, max]
+// range is mapped onto the whole colormap. Changing the range is cheap, no
+// vertex data are uploaded. Use cg::ColormapNone to show vertex colors again.
+void set_mesh_colormap(int mesh, int colormap, double min = 0., double max = 1.);
+
+// Draw the mesh scaled and rotated (radians) around origin and then translated.
+void draw_mesh(int mesh, double x = 0., double y = 0., double scale = 1., double angle = 0.);
+
+// Release the mesh. Its id is not valid anymore.
+void delete_mesh(int mesh);
+
+// Colormaps for set_mesh_colormap and heatmap.
+extern const int ColormapNone;
+extern const int ColormapGray;
+extern const int ColormapJet;
+extern const int ColormapHot;
+extern const int ColormapViridis;
+
+// Draw a grid of w*h values (row by row, the first row on top) into given
+// rectangle, colored by the colormap. [min, max] range is mapped onto the whole
+// colormap. The values are kept on the GPU as a texture; if called repeatedly
+// with the same pointer, only the rows which changed since the last call are
+// uploaded. Drawing a simulation grid this way is much faster than drawing
+// a rectangle for each cell. Textures of pointers not passed for a while are
+// released unless a kept batch draws them, a grid in a new buffer each frame
+// does not pile up.
+void heatmap(const float* values, int w, int h, double x, double y, double width, double height,
+             int colormap, double min = 0., double max = 1.);
+
 
 
 